@@ -8,6 +8,7 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <systemd/sd-bus.h>
 #include <systemd/sd-event.h>
 #include <unistd.h>
@@ -112,7 +113,7 @@ int emit_internal_signal(sd_bus *bus, const char *transaction, const char* signa
         fprintf(stderr, "Error during sd_bus_message_new_signal for %s (Transaction %s): %s\n", signame, transaction, strerror(ret));
     }
     va_start(ap, types);
-    if (ret >= 0 && (ret = sd_bus_message_appendv(m, "sis", ap)) < 0) {
+    if (ret >= 0 && (ret = sd_bus_message_appendv(m, types, ap)) < 0) {
         fprintf(stderr, "Error during sd_bus_message_appendv for %s (Transaction %s): %s\n", signame, transaction, strerror(ret));
     }
     va_end(ap);
@@ -139,6 +140,74 @@ int send_error_signal(sd_bus *bus, const char *transaction, const char *message,
     return ret;
 }
 
+// The output is sent in CommandOutput signals while the command is running; only
+// its end is kept for the CommandExecuted or Error signal, so long running commands
+// can't make tukitd's memory usage grow without bounds.
+#define OUTPUT_TAIL_SIZE 65536
+
+struct output_args {
+    sd_bus *bus;
+    const char *transaction;
+    char tail[OUTPUT_TAIL_SIZE + 1];
+    size_t len;
+    int truncated;
+};
+
+static void output_func(const char* data, size_t len, void* userdata) {
+    struct output_args* oa = (struct output_args*)userdata;
+
+    char *chunk = strndup(data, len);
+    if (chunk != NULL) {
+        if (oa->bus == NULL) {
+            oa->bus = get_bus();
+        }
+        emit_internal_signal(oa->bus, oa->transaction, "CommandOutput", "ss", oa->transaction, chunk);
+        free(chunk);
+    }
+
+    if (len >= OUTPUT_TAIL_SIZE) {
+        memcpy(oa->tail, data + len - OUTPUT_TAIL_SIZE, OUTPUT_TAIL_SIZE);
+        oa->len = OUTPUT_TAIL_SIZE;
+        oa->truncated = 1;
+    } else {
+        if (oa->len + len > OUTPUT_TAIL_SIZE) {
+            size_t drop = oa->len + len - OUTPUT_TAIL_SIZE;
+            memmove(oa->tail, oa->tail + drop, oa->len - drop);
+            oa->len -= drop;
+            oa->truncated = 1;
+        }
+        memcpy(oa->tail + oa->len, data, len);
+        oa->len += len;
+    }
+    oa->tail[oa->len] = '\0';
+}
+
+// Runs the command and returns the end of its output, starting with a complete line
+static int execute_with_output(struct tukit_tx* tx, char* argv[], int chrooted, struct output_args* oa, const char** output) {
+    int exec_ret;
+
+    oa->len = 0;
+    oa->truncated = 0;
+    oa->tail[0] = '\0';
+    if (chrooted) {
+        exec_ret = tukit_tx_execute_with_cb(tx, argv, output_func, oa);
+    } else {
+        exec_ret = tukit_tx_call_ext_with_cb(tx, argv, output_func, oa);
+    }
+    // Make sure all output was sent before the final signal
+    sd_bus_flush_close_unref(oa->bus);
+    oa->bus = NULL;
+
+    *output = oa->tail;
+    if (oa->truncated) {
+        char *newline = memchr(oa->tail, '\n', oa->len);
+        if (newline != NULL) {
+            *output = newline + 1;
+        }
+    }
+    return exec_ret;
+}
+
 static void *execute_func(void *args) {
     int ret = 0;
     int exec_ret = 0;
@@ -181,8 +250,9 @@ static void *execute_func(void *args) {
         goto finish_execute;
     }
 
+    struct output_args oa = { .bus = NULL, .transaction = transaction };
     const char* output;
-    exec_ret = tukit_tx_execute(tx, p.we_wordv, &output);
+    exec_ret = execute_with_output(tx, p.we_wordv, 1, &oa, &output);
 
     wordfree(&p);
 
@@ -204,8 +274,6 @@ static void *execute_func(void *args) {
         send_error_signal(bus, transaction, "Cannot send signal 'CommandExecuted'.", ret);
     }
 
-    free((void*)output);
-
     if (strcmp(rebootmethod, "none") != 0) {
         if (tukit_reboot(rebootmethod) != 0){
             bus = get_bus();
@@ -505,18 +573,14 @@ static void *call_func(void *args) {
         goto finish_execute;
     }
 
+    struct output_args oa = { .bus = NULL, .transaction = transaction };
     const char* output;
-    if (chrooted) {
-        exec_ret = tukit_tx_execute(tx, p.we_wordv, &output);
-    } else {
-        exec_ret = tukit_tx_call_ext(tx, p.we_wordv, &output);
-    }
+    exec_ret = execute_with_output(tx, p.we_wordv, chrooted, &oa, &output);
 
     wordfree(&p);
 
     ret = tukit_tx_keep(tx);
     if (ret != 0) {
-        free((void*)output);
         send_error_signal(bus, transaction, tukit_get_errmsg(), -1);
         goto finish_execute;
     }
@@ -527,8 +591,6 @@ static void *call_func(void *args) {
         send_error_signal(bus, transaction, "Cannot send signal 'CommandExecuted'.", ret);
     }
 
-    free((void*)output);
-
 finish_execute:
     sd_bus_flush_close_unref(bus);
     tukit_free_tx(tx);
@@ -640,7 +702,17 @@ static int signalCallback(sd_bus_message *m, void *userdata, sd_bus_error *ret_e
         sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Could not read member name.");
         return -1;
     }
-    if (strcmp(member, "CommandExecuted") == 0) {
+    if (strcmp(member, "CommandOutput") == 0) {
+        if (sd_bus_message_read(m, "ss", &transaction, &output) < 0) {
+            sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Could not read CommandOutput signal data.");
+            return -1;
+        }
+
+        int ret = sd_bus_emit_signal(sd_bus_message_get_bus(m), "/org/opensuse/tukit/Transaction", "org.opensuse.tukit.Transaction", "CommandOutput", "ss", transaction, output);
+        if (ret < 0) {
+            fprintf(stderr, "Cannot send signal 'CommandOutput' for snapshot %s: %s\n", transaction, strerror(-ret));
+        }
+    } else if (strcmp(member, "CommandExecuted") == 0) {
         if (sd_bus_message_read(m, "sis", &transaction, &exec_ret, &output) < 0) {
             sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Could not read CommandExecuted signal data.");
             return -1;
@@ -877,6 +949,53 @@ finish_snapshotlist:
     return ret;
 }
 
+static int snapshot_diff(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    char *snapshot;
+    size_t diff_len = 0;
+    int ret = 0;
+    tukit_sm_diff diff = NULL;
+    sd_bus_message *message = NULL;
+
+    if (sd_bus_message_read(m, "s", &snapshot) < 0) {
+        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Could not read D-Bus parameters.");
+        return -1;
+    }
+
+    if ((diff = tukit_sm_get_diff(&diff_len, snapshot)) == NULL) {
+        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", tukit_get_errmsg());
+        return -1;
+    }
+
+    if ((ret = sd_bus_message_new_method_return(m, &message)) < 0) {
+        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Creating new return method failed.");
+        goto finish_snapshotdiff;
+    }
+    if ((ret = sd_bus_message_open_container(message, 'a', "(ss)")) < 0 ) {
+        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Creating container (array of changes) failed.");
+        goto finish_snapshotdiff;
+    }
+    for (size_t i = 0; i < diff_len; i++) {
+        char change[2] = {tukit_sm_get_diff_change(diff, i), '\0'};
+        if ((ret = sd_bus_message_append(message, "(ss)", change, tukit_sm_get_diff_path(diff, i))) < 0) {
+            sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Appending change failed.");
+            goto finish_snapshotdiff;
+        }
+    }
+    if ((ret = sd_bus_message_close_container(message)) < 0) {
+        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Closing container (array of changes) failed.");
+        goto finish_snapshotdiff;
+    }
+    if ((ret = sd_bus_send(sd_bus_message_get_bus(message), message, NULL)) < 0) {
+        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Sending message failed.");
+        goto finish_snapshotdiff;
+    }
+
+finish_snapshotdiff:
+    sd_bus_message_unref(message);
+    tukit_free_sm_diff(diff);
+    return ret;
+}
+
 static int snapshot_delete(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
     char *snapshot;
     int ret = 0;
@@ -904,6 +1023,69 @@ static int snapshot_delete(sd_bus_message *m, void *userdata, sd_bus_error *ret_
     return sd_bus_reply_method_return(m, "");
 }
 
+static int snapshot_delete_multiple(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    char **snapshots = NULL;
+    size_t locked = 0;
+    size_t unique = 0;
+    int ret = 0;
+
+    if (sd_bus_message_read_strv(m, &snapshots) < 0) {
+        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Could not read D-Bus parameters.");
+        ret = -1;
+        goto finish_deletemultiple;
+    }
+
+    // A snapshot listed twice would fail to lock the second time
+    for (size_t i = 0; snapshots && snapshots[i]; i++) {
+        size_t j = 0;
+        while (j < unique && strcmp(snapshots[j], snapshots[i]) != 0)
+            j++;
+        if (j < unique) {
+            free(snapshots[i]);
+            continue;
+        }
+        snapshots[unique++] = snapshots[i];
+    }
+    if (snapshots)
+        snapshots[unique] = NULL;
+
+    for (; snapshots && snapshots[locked]; locked++) {
+        if ((ret = lockSnapshot(userdata, snapshots[locked], ret_error)) != 0) {
+            goto finish_deletemultiple;
+        }
+    }
+
+    fprintf(stdout, "Deleting %zu snapshots...\n", locked);
+    // Waiting for the btrfs cleaner would block the event loop; clients can poll
+    // IsCleanupPending instead
+    if (locked > 0 && (ret = tukit_sm_deletesnaps((const char**) snapshots, 0)) < 0) {
+        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", tukit_get_errmsg());
+    }
+
+finish_deletemultiple:
+    for (size_t i = 0; i < locked; i++) {
+        unlockSnapshot(userdata, snapshots[i]);
+    }
+    for (size_t i = 0; snapshots && snapshots[i]; i++) {
+        free(snapshots[i]);
+    }
+    free(snapshots);
+    if (ret < 0) {
+        return ret;
+    }
+    return sd_bus_reply_method_return(m, "");
+}
+
+static int snapshot_is_cleanup_pending(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    int pending;
+
+    if ((pending = tukit_sm_is_cleanup_pending(0)) < 0) {
+        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", tukit_get_errmsg());
+        return -1;
+    }
+    return sd_bus_reply_method_return(m, "b", pending);
+}
+
 static int snapshot_rollback(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
     char *snapshot;
     const char* rollback_id;
@@ -963,6 +1145,7 @@ static const sd_bus_vtable tukit_transaction_vtable[] = {
     SD_BUS_METHOD_WITH_ARGS("Abort", SD_BUS_ARGS("s", transaction), SD_BUS_NO_RESULT, transaction_abort, 0),
     SD_BUS_METHOD_WITH_ARGS("AbortWithOpts", SD_BUS_ARGS("s", transaction, "a{sv}", options), SD_BUS_NO_RESULT, transaction_abort, 0),
     SD_BUS_SIGNAL_WITH_ARGS("TransactionOpened", SD_BUS_ARGS("s", snapshot), 0),
+    SD_BUS_SIGNAL_WITH_ARGS("CommandOutput", SD_BUS_ARGS("s", snapshot, "s", output), 0),
     SD_BUS_SIGNAL_WITH_ARGS("CommandExecuted", SD_BUS_ARGS("s", snapshot, "i", returncode, "s", output), 0),
     SD_BUS_SIGNAL_WITH_ARGS("Error", SD_BUS_ARGS("s", snapshot, "i", returncode, "s", output), 0),
     SD_BUS_VTABLE_END
@@ -971,7 +1154,10 @@ static const sd_bus_vtable tukit_transaction_vtable[] = {
 static const sd_bus_vtable tukit_snapshot_vtable[] = {
     SD_BUS_VTABLE_START(0),
     SD_BUS_METHOD_WITH_ARGS("List", SD_BUS_ARGS("s", columns), SD_BUS_RESULT("aa{ss}", list), snapshot_list, 0),
+    SD_BUS_METHOD_WITH_ARGS("Diff", SD_BUS_ARGS("s", snapshot), SD_BUS_RESULT("a(ss)", changes), snapshot_diff, 0),
     SD_BUS_METHOD_WITH_ARGS("Delete", SD_BUS_ARGS("s", snapshot), SD_BUS_NO_RESULT, snapshot_delete, 0),
+    SD_BUS_METHOD_WITH_ARGS("DeleteMultiple", SD_BUS_ARGS("as", snapshots), SD_BUS_NO_RESULT, snapshot_delete_multiple, 0),
+    SD_BUS_METHOD_WITH_ARGS("IsCleanupPending", SD_BUS_NO_ARGS, SD_BUS_RESULT("b", pending), snapshot_is_cleanup_pending, 0),
     SD_BUS_METHOD_WITH_ARGS("RollbackTo", SD_BUS_ARGS("s", snapshot), SD_BUS_RESULT("s", snapshot), snapshot_rollback, 0),
     SD_BUS_VTABLE_END
 };
@@ -2,6 +2,7 @@
 /* SPDX-FileCopyrightText: Copyright SUSE LLC */
 
 #include "libtukit.h"
+#include "ChangeManifest.hpp"
 #include "Configuration.hpp"
 #include "Log.hpp"
 #include "Reboot.hpp"
@@ -91,6 +92,17 @@ int tukit_tx_discard_if_unchanged(tukit_tx tx, int discard) {
     }
     return 0;
 }
+int tukit_tx_pin_namespace(tukit_tx tx, int pin) {
+    Transaction* transaction = reinterpret_cast<Transaction*>(tx);
+    try {
+        transaction->setPinNamespace(pin);
+    } catch (const std::exception &e) {
+        fprintf(stderr, "ERROR: %s\n", e.what());
+        errmsg = e.what();
+        return -1;
+    }
+    return 0;
+}
 int tukit_tx_resume(tukit_tx tx, char* id) {
     Transaction* transaction = reinterpret_cast<Transaction*>(tx);
     try {
@@ -106,10 +118,12 @@ int tukit_tx_execute(tukit_tx tx, char* argv[], const char* output[]) {
     Transaction* transaction = reinterpret_cast<Transaction*>(tx);
     std::string buffer;
     try {
-        int ret = transaction->execute(argv, &buffer);
-        if (output) {
-            *output = strdup(buffer.c_str());
+        if (!output) {
+            // Keep the output off the console as before, but don't collect it
+            return transaction->execute(argv, [](const char*, size_t) {});
         }
+        int ret = transaction->execute(argv, &buffer);
+        *output = strdup(buffer.c_str());
         return ret;
     } catch (const std::exception &e) {
         fprintf(stderr, "ERROR: %s\n", e.what());
@@ -121,10 +135,12 @@ int tukit_tx_call_ext(tukit_tx tx, char* argv[], const char* output[]) {
     Transaction* transaction = reinterpret_cast<Transaction*>(tx);
     std::string buffer;
     try {
-        int ret = transaction->callExt(argv, &buffer);
-        if (output) {
-            *output = strdup(buffer.c_str());
+        if (!output) {
+            // Keep the output off the console as before, but don't collect it
+            return transaction->callExt(argv, [](const char*, size_t) {});
         }
+        int ret = transaction->callExt(argv, &buffer);
+        *output = strdup(buffer.c_str());
         return ret;
     } catch (const std::exception &e) {
         fprintf(stderr, "ERROR: %s\n", e.what());
@@ -132,6 +148,30 @@ int tukit_tx_call_ext(tukit_tx tx, char* argv[], const char* output[]) {
         return -1;
     }
 }
+int tukit_tx_execute_with_cb(tukit_tx tx, char* argv[], tukit_output_cb callback, void* userdata) {
+    Transaction* transaction = reinterpret_cast<Transaction*>(tx);
+    try {
+        return transaction->execute(argv, [callback, userdata](const char* data, size_t len) {
+            callback(data, len, userdata);
+        });
+    } catch (const std::exception &e) {
+        fprintf(stderr, "ERROR: %s\n", e.what());
+        errmsg = e.what();
+        return -1;
+    }
+}
+int tukit_tx_call_ext_with_cb(tukit_tx tx, char* argv[], tukit_output_cb callback, void* userdata) {
+    Transaction* transaction = reinterpret_cast<Transaction*>(tx);
+    try {
+        return transaction->callExt(argv, [callback, userdata](const char* data, size_t len) {
+            callback(data, len, userdata);
+        });
+    } catch (const std::exception &e) {
+        fprintf(stderr, "ERROR: %s\n", e.what());
+        errmsg = e.what();
+        return -1;
+    }
+}
 int tukit_tx_finalize(tukit_tx tx) {
     Transaction* transaction = reinterpret_cast<Transaction*>(tx);
     try {
@@ -216,10 +256,10 @@ const char* tukit_sm_get_default() {
 tukit_sm_list tukit_sm_get_list(size_t* len, const char* columns) {
     try {
         std::unique_ptr<TransactionalUpdate::SnapshotManager> snapshotMgr = TransactionalUpdate::SnapshotFactory::get();
-        auto list = new std::deque<std::map<std::string, std::string>>;
+        auto list = new TransactionalUpdate::SnapshotTable;
         try {
             *list = snapshotMgr->getList(columns);
-            *len = list->size();
+            *len = list->rows();
             return reinterpret_cast<tukit_sm_list>(list);
         } catch (const std::exception &e) {
             delete list;
@@ -236,8 +276,8 @@ tukit_sm_list tukit_sm_get_list(size_t* len, const char* columns) {
 
 const char* tukit_sm_get_list_value(tukit_sm_list list, size_t row, char* column) {
     try {
-        auto result = reinterpret_cast<std::deque<std::map<std::string, std::string>>*>(list);
-        return result->at(row)[column].c_str();
+        auto result = reinterpret_cast<TransactionalUpdate::SnapshotTable*>(list);
+        return result->c_str(row, column);
     } catch (const std::exception &e) {
         fprintf(stderr, "ERROR: %s\n", e.what());
         errmsg = e.what();
@@ -246,13 +286,57 @@ const char* tukit_sm_get_list_value(tukit_sm_list list, size_t row, char* column
 }
 
 void tukit_free_sm_list(tukit_sm_list list) {
-    auto result = reinterpret_cast<std::deque<std::map<std::string, std::string>>*>(list);
+    auto result = reinterpret_cast<TransactionalUpdate::SnapshotTable*>(list);
+    delete result;
+}
+
+tukit_sm_diff tukit_sm_get_diff(size_t* len, const char* id) {
+    try {
+        auto diff = new TransactionalUpdate::ChangeManifest;
+        try {
+            *diff = TransactionalUpdate::ChangeManifest::forSnapshot(id);
+            *len = diff->getEntries().size();
+            return reinterpret_cast<tukit_sm_diff>(diff);
+        } catch (const std::exception &e) {
+            delete diff;
+            fprintf(stderr, "ERROR: %s\n", e.what());
+            errmsg = e.what();
+            return nullptr;
+        }
+    } catch (const std::exception &e) {
+        fprintf(stderr, "ERROR: %s\n", e.what());
+        errmsg = e.what();
+        return nullptr;
+    }
+}
+
+const char* tukit_sm_get_diff_path(tukit_sm_diff diff, size_t row) {
+    auto result = reinterpret_cast<TransactionalUpdate::ChangeManifest*>(diff);
+    if (row >= result->getEntries().size()) {
+        errmsg = "Row " + std::to_string(row) + " is out of range.";
+        return nullptr;
+    }
+    return result->getEntries()[row].path.c_str();
+}
+
+char tukit_sm_get_diff_change(tukit_sm_diff diff, size_t row) {
+    auto result = reinterpret_cast<TransactionalUpdate::ChangeManifest*>(diff);
+    if (row >= result->getEntries().size()) {
+        errmsg = "Row " + std::to_string(row) + " is out of range.";
+        return '\0';
+    }
+    return static_cast<char>(result->getEntries()[row].change);
+}
+
+void tukit_free_sm_diff(tukit_sm_diff diff) {
+    auto result = reinterpret_cast<TransactionalUpdate::ChangeManifest*>(diff);
     delete result;
 }
 
 int tukit_sm_deletesnap(const char* id) {
     try {
         std::unique_ptr<TransactionalUpdate::SnapshotManager> snapshotMgr = TransactionalUpdate::SnapshotFactory::get();
+        TransactionalUpdate::Transaction::unpinNamespace(id);
         snapshotMgr->deleteSnap(id);
         return 0;
     } catch (const std::exception &e) {
@@ -262,6 +346,35 @@ int tukit_sm_deletesnap(const char* id) {
     }
 }
 
+int tukit_sm_deletesnaps(const char* ids[], int wait) {
+    try {
+        std::vector<std::string> snapshots;
+        for (int i = 0; ids[i] != nullptr; i++) {
+            snapshots.push_back(ids[i]);
+        }
+        std::unique_ptr<TransactionalUpdate::SnapshotManager> snapshotMgr = TransactionalUpdate::SnapshotFactory::get();
+        for (auto& snapshot: snapshots)
+            TransactionalUpdate::Transaction::unpinNamespace(snapshot);
+        snapshotMgr->deleteSnaps(snapshots, wait);
+        return 0;
+    } catch (const std::exception &e) {
+        fprintf(stderr, "ERROR: %s\n", e.what());
+        errmsg = e.what();
+        return -1;
+    }
+}
+
+int tukit_sm_is_cleanup_pending(int wait) {
+    try {
+        std::unique_ptr<TransactionalUpdate::SnapshotManager> snapshotMgr = TransactionalUpdate::SnapshotFactory::get();
+        return snapshotMgr->isCleanupPending(wait);
+    } catch (const std::exception &e) {
+        fprintf(stderr, "ERROR: %s\n", e.what());
+        errmsg = e.what();
+        return -1;
+    }
+}
+
 const char* tukit_sm_rollbackto(const char* id) {
     try {
         std::unique_ptr<TransactionalUpdate::SnapshotManager> snapshotMgr = TransactionalUpdate::SnapshotFactory::get();
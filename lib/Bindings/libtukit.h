@@ -29,9 +29,14 @@ void tukit_free_tx(tukit_tx tx);
 int tukit_tx_init(tukit_tx tx, char* base);
 int tukit_tx_init_with_desc(tukit_tx tx, char* base, char* description);
 int tukit_tx_discard_if_unchanged(tukit_tx tx, int discard);
+int tukit_tx_pin_namespace(tukit_tx tx, int pin);
 int tukit_tx_resume(tukit_tx tx, char* id);
 int tukit_tx_execute(tukit_tx tx, char* argv[], const char* output[]);
 int tukit_tx_call_ext(tukit_tx tx, char* argv[], const char* output[]);
+/* Called with the command's output in complete lines as far as possible while it is running */
+typedef void (*tukit_output_cb)(const char* data, size_t len, void* userdata);
+int tukit_tx_execute_with_cb(tukit_tx tx, char* argv[], tukit_output_cb callback, void* userdata);
+int tukit_tx_call_ext_with_cb(tukit_tx tx, char* argv[], tukit_output_cb callback, void* userdata);
 int tukit_tx_finalize(tukit_tx tx);
 int tukit_tx_keep(tukit_tx tx);
 int tukit_tx_send_signal(tukit_tx tx, int signal);
@@ -42,7 +47,15 @@ typedef void* tukit_sm_list;
 tukit_sm_list tukit_sm_get_list(size_t* len, const char* columns);
 const char* tukit_sm_get_list_value(tukit_sm_list list, size_t row, char* columns);
 void tukit_free_sm_list(tukit_sm_list list);
+typedef void* tukit_sm_diff;
+tukit_sm_diff tukit_sm_get_diff(size_t* len, const char* id);
+const char* tukit_sm_get_diff_path(tukit_sm_diff diff, size_t row);
+/* Returns '+' for created, 'c' for changed and '-' for deleted files */
+char tukit_sm_get_diff_change(tukit_sm_diff diff, size_t row);
+void tukit_free_sm_diff(tukit_sm_diff diff);
 int tukit_sm_deletesnap(const char* id);
+int tukit_sm_deletesnaps(const char* ids[], int wait);
+int tukit_sm_is_cleanup_pending(int wait);
 const char* tukit_sm_rollbackto(const char* id);
 int tukit_reboot(const char* method);
 
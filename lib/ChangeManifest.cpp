@@ -0,0 +1,235 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  List of the paths changed in a snapshot
+ */
+
+#include "ChangeManifest.hpp"
+#include "Log.hpp"
+#include "Snapshot.hpp"
+#include "SnapshotManager.hpp"
+#include "Subvolume.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <sys/stat.h>
+
+namespace TransactionalUpdate {
+
+static const char MAGIC[] = {'T', 'U', 'C', 'M'};
+static const char FORMAT_VERSION = 1;
+
+static void writeNumber(std::string& out, uint64_t value) {
+    do {
+        char byte = value & 0x7f;
+        value >>= 7;
+        if (value)
+            byte |= 0x80;
+        out += byte;
+    } while (value);
+}
+
+static uint64_t readNumber(const std::string& in, size_t& pos) {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (pos >= in.length())
+            throw std::runtime_error{"Unexpected end of data"};
+        unsigned char byte = in[pos++];
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return value;
+    }
+    throw std::runtime_error{"Invalid number"};
+}
+
+static std::optional<struct stat> lstatPath(const std::filesystem::path& path) {
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0)
+        return st;
+    if (errno != ENOENT && errno != ENOTDIR)
+        throw std::runtime_error{"Reading '" + path.native() + "' failed: " + std::string(strerror(errno))};
+    return std::nullopt;
+}
+
+// The snapshot the subvolume was created from; tukit only creates snapshots of other
+// snapshots, so it is one of the siblings
+static std::optional<std::filesystem::path> findBase(const std::filesystem::path& root, Subvolume& subvolume) {
+    std::string parentUuid = subvolume.getParentUuid();
+    if (parentUuid.empty())
+        return std::nullopt;
+    std::error_code ec;
+    for (auto& dir: std::filesystem::directory_iterator{root.parent_path().parent_path(), ec}) {
+        std::filesystem::path candidate = dir.path() / "snapshot";
+        if (candidate == root || !Subvolume::isSubvolume(candidate))
+            continue;
+        try {
+            if (Subvolume{candidate}.getUuid() == parentUuid)
+                return candidate;
+        } catch (const std::exception& e) {
+            tulog.debug(e.what());
+        }
+    }
+    return std::nullopt;
+}
+
+ChangeManifest ChangeManifest::compute(std::filesystem::path root) {
+    if (!Subvolume::isSubvolume(root))
+        throw std::runtime_error{"Change manifests are only available for btrfs snapshots, '" + root.native() + "' is none."};
+    tulog.debug("Computing changes of ", root, "...");
+
+    Subvolume subvolume{root};
+    std::optional<std::filesystem::path> base = findBase(root, subvolume);
+    if (!base)
+        tulog.info("Snapshot ", root, " was not created from another snapshot, deleted files can't be determined.");
+
+    std::map<std::string, Change> changes;
+    std::vector<std::string> changedDirs;
+    for (auto& inode: subvolume.getChangedInodes()) {
+        for (auto& relPath: subvolume.getInodePaths(inode.inode)) {
+            std::string path = "/" + relPath;
+            Change change = inode.created ? Change::Created : Change::Modified;
+            // A file replaced by a new inode (e.g. by rename) or moved around
+            if (base)
+                change = lstatPath(*base / relPath) ? Change::Modified : Change::Created;
+            changes[path] = change;
+            // Entries can only have vanished from directories which existed before
+            auto st = lstatPath(root / relPath);
+            if (change == Change::Modified && st && S_ISDIR(st->st_mode))
+                changedDirs.push_back(relPath);
+        }
+    }
+
+    if (base) {
+        for (auto& dir: changedDirs) {
+            std::error_code ec;
+            for (auto& entry: std::filesystem::directory_iterator{*base / dir, ec}) {
+                std::filesystem::path relPath = std::filesystem::path{dir} / entry.path().filename();
+                if (lstatPath(root / relPath))
+                    continue;
+                changes["/" + relPath.native()] = Change::Deleted;
+                if (!entry.is_directory(ec) || entry.is_symlink(ec))
+                    continue;
+                for (auto& child: std::filesystem::recursive_directory_iterator{entry.path(),
+                        std::filesystem::directory_options::skip_permission_denied, ec}) {
+                    changes["/" + child.path().lexically_relative(*base).native()] = Change::Deleted;
+                }
+            }
+        }
+    }
+
+    ChangeManifest manifest;
+    manifest.entries.reserve(changes.size());
+    for (auto& [path, change]: changes)
+        manifest.entries.push_back({path, change});
+    return manifest;
+}
+
+ChangeManifest ChangeManifest::forSnapshot(std::string id) {
+    std::unique_ptr<Snapshot> snapshot = SnapshotFactory::get()->open(id);
+    std::filesystem::path file = getFile(snapshot->getRoot());
+    if (!snapshot->isInProgress() && std::filesystem::exists(file))
+        return read(file);
+    return compute(snapshot->getRoot());
+}
+
+std::filesystem::path ChangeManifest::getFile(std::filesystem::path root) {
+    // snapper removes "filelist-*.txt" files together with the snapshot; any other
+    // file would keep the snapshot's directory from being deleted. snapper itself
+    // only reads "filelist-<number>.txt", so this name can't clash with its files.
+    return root.parent_path() / "filelist-tukit.txt";
+}
+
+ChangeManifest ChangeManifest::read(std::filesystem::path file) {
+    std::ifstream input{file, std::ios::binary};
+    if (!input)
+        throw std::runtime_error{"Opening change manifest '" + file.native() + "' failed: " + std::string(strerror(errno))};
+    std::string data{std::istreambuf_iterator<char>{input}, std::istreambuf_iterator<char>{}};
+
+    ChangeManifest manifest;
+    try {
+        if (data.length() < sizeof(MAGIC) + 1 || data.compare(0, sizeof(MAGIC), MAGIC, sizeof(MAGIC)) != 0)
+            throw std::runtime_error{"Not a change manifest"};
+        if (data[sizeof(MAGIC)] != FORMAT_VERSION)
+            throw std::runtime_error{"Unsupported version " + std::to_string(data[sizeof(MAGIC)])};
+        size_t pos = sizeof(MAGIC) + 1;
+        uint64_t count = readNumber(data, pos);
+        std::string path;
+        for (uint64_t i = 0; i < count; i++) {
+            if (pos >= data.length())
+                throw std::runtime_error{"Unexpected end of data"};
+            Change change = static_cast<Change>(data[pos++]);
+            if (change != Change::Created && change != Change::Modified && change != Change::Deleted)
+                throw std::runtime_error{"Invalid change type"};
+            uint64_t shared = readNumber(data, pos);
+            uint64_t length = readNumber(data, pos);
+            if (shared > path.length() || length > data.length() - pos)
+                throw std::runtime_error{"Invalid path length"};
+            path.resize(shared);
+            path.append(data, pos, length);
+            pos += length;
+            manifest.entries.push_back({path, change});
+        }
+    } catch (const std::exception& e) {
+        throw std::runtime_error{"Reading change manifest '" + file.native() + "' failed: " + e.what()};
+    }
+    return manifest;
+}
+
+void ChangeManifest::write(std::filesystem::path file) const {
+    std::string data{MAGIC, sizeof(MAGIC)};
+    data += FORMAT_VERSION;
+    writeNumber(data, entries.size());
+    const std::string* previous = nullptr;
+    for (auto& entry: entries) {
+        size_t shared = 0;
+        if (previous) {
+            size_t max = std::min(previous->length(), entry.path.length());
+            while (shared < max && (*previous)[shared] == entry.path[shared])
+                shared++;
+        }
+        data += static_cast<char>(entry.change);
+        writeNumber(data, shared);
+        writeNumber(data, entry.path.length() - shared);
+        data.append(entry.path, shared);
+        previous = &entry.path;
+    }
+
+    // Readers must never see a partially written manifest
+    std::filesystem::path tmpFile = file;
+    tmpFile += ".new";
+    std::ofstream output{tmpFile, std::ios::binary | std::ios::trunc};
+    output.write(data.data(), data.length());
+    output.close();
+    if (!output)
+        throw std::runtime_error{"Writing change manifest '" + tmpFile.native() + "' failed."};
+    std::filesystem::rename(tmpFile, file);
+}
+
+const std::vector<ChangeManifest::Entry>& ChangeManifest::getEntries() const {
+    return entries;
+}
+
+bool ChangeManifest::hasChangesBelow(std::string path) const {
+    while (path.length() > 1 && path.back() == '/')
+        path.pop_back();
+    if (path == "/")
+        return !entries.empty();
+    auto byPath = [](const Entry& entry, const std::string& value) { return entry.path < value; };
+    auto it = std::lower_bound(entries.begin(), entries.end(), path, byPath);
+    if (it != entries.end() && it->path == path)
+        return true;
+    // Paths such as "/etc-foo" sort between "/etc" and "/etc/..."
+    path += '/';
+    it = std::lower_bound(entries.begin(), entries.end(), path, byPath);
+    return it != entries.end() && it->path.compare(0, path.length(), path) == 0;
+}
+
+} // namespace TransactionalUpdate
@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  List of the paths changed in a snapshot compared to the snapshot it was
+  created from; stored as "filelist-tukit.txt" next to the snapshot's root
+  directory when the transaction is closed.
+
+  File format: "TUCM", a version byte and the number of entries, followed by
+  the entries sorted by path. Each entry consists of the change type ('+',
+  'c' or '-'), the length of the prefix shared with the previous path, the
+  length of the remaining suffix and the suffix itself. All numbers are
+  encoded as unsigned LEB128.
+ */
+
+#ifndef T_U_CHANGEMANIFEST_H
+#define T_U_CHANGEMANIFEST_H
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace TransactionalUpdate {
+
+class ChangeManifest
+{
+public:
+    enum class Change : char {
+        Created = '+',
+        Modified = 'c',
+        Deleted = '-'
+    };
+    struct Entry {
+        // Absolute path inside of the snapshot
+        std::string path;
+        Change change;
+    };
+
+    /**
+     * @brief compute Determines the changes of the snapshot at root from the btrfs metadata;
+     * only inodes written since the snapshot was taken are looked at, not the whole tree.
+     * @throws std::runtime_error if root isn't a btrfs subvolume
+     */
+    static ChangeManifest compute(std::filesystem::path root);
+    /**
+     * @brief forSnapshot Returns the stored manifest of a closed snapshot; for snapshots in
+     * progress or without a stored manifest it is computed instead.
+     */
+    static ChangeManifest forSnapshot(std::string id);
+    // Location of the manifest belonging to the snapshot at root
+    static std::filesystem::path getFile(std::filesystem::path root);
+    static ChangeManifest read(std::filesystem::path file);
+    void write(std::filesystem::path file) const;
+
+    const std::vector<Entry>& getEntries() const;
+    // Whether path itself or anything below it changed
+    bool hasChangesBelow(std::string path) const;
+private:
+    // Sorted by path
+    std::vector<Entry> entries;
+};
+
+} // namespace TransactionalUpdate
+
+#endif // T_U_CHANGEMANIFEST_H
@@ -26,6 +26,8 @@ Configuration::Configuration() {
         {"REBOOT_ALLOW_SOFT_REBOOT", "true"},
         {"REBOOT_ALLOW_KEXEC", "false"},
         {"OCI_TARGET", ""},
+        {"POOL_SIZE", "0"},
+        {"SERVE_TIMEOUT", "600"},
         {"SNAPSHOT_MANAGER", "auto"}
     };
     for(auto &[key, value] : defaults) {
@@ -0,0 +1,254 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Minimal JSON parser
+ */
+
+#include "Json.hpp"
+#include <cstdlib>
+#include <stdexcept>
+
+namespace TransactionalUpdate {
+
+class Json::Parser {
+public:
+    Parser(std::string_view text): text{text} {}
+
+    Json parseDocument() {
+        Json value = parseValue();
+        skipWhitespace();
+        if (pos != text.size())
+            fail("trailing characters");
+        return value;
+    }
+private:
+    std::string_view text;
+    size_t pos = 0;
+    unsigned int depth = 0;
+
+    [[noreturn]] void fail(const std::string& reason) {
+        throw std::runtime_error{"Invalid JSON at offset " + std::to_string(pos) + ": " + reason};
+    }
+
+    void skipWhitespace() {
+        while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\n' || text[pos] == '\r'))
+            pos++;
+    }
+
+    void expect(std::string_view literal) {
+        if (text.substr(pos, literal.size()) != literal)
+            fail("expected '" + std::string(literal) + "'");
+        pos += literal.size();
+    }
+
+    Json parseValue() {
+        skipWhitespace();
+        if (pos >= text.size())
+            fail("unexpected end of input");
+        if (++depth > 256)
+            fail("nesting too deep");
+
+        Json value;
+        switch (text[pos]) {
+        case '{':
+            value.type = Type::Object;
+            pos++;
+            skipWhitespace();
+            if (pos < text.size() && text[pos] == '}') {
+                pos++;
+                break;
+            }
+            for (;;) {
+                skipWhitespace();
+                if (pos >= text.size() || text[pos] != '"')
+                    fail("expected object key");
+                value.keys.push_back(parseString());
+                skipWhitespace();
+                expect(":");
+                value.values.push_back(parseValue());
+                skipWhitespace();
+                if (pos < text.size() && text[pos] == ',') {
+                    pos++;
+                    continue;
+                }
+                expect("}");
+                break;
+            }
+            break;
+        case '[':
+            value.type = Type::Array;
+            pos++;
+            skipWhitespace();
+            if (pos < text.size() && text[pos] == ']') {
+                pos++;
+                break;
+            }
+            for (;;) {
+                value.values.push_back(parseValue());
+                skipWhitespace();
+                if (pos < text.size() && text[pos] == ',') {
+                    pos++;
+                    continue;
+                }
+                expect("]");
+                break;
+            }
+            break;
+        case '"':
+            value.type = Type::String;
+            value.string = parseString();
+            break;
+        case 't':
+            expect("true");
+            value.type = Type::Bool;
+            value.boolean = true;
+            break;
+        case 'f':
+            expect("false");
+            value.type = Type::Bool;
+            break;
+        case 'n':
+            expect("null");
+            break;
+        default: {
+            size_t end = text.find_first_not_of("+-0123456789.eE", pos);
+            if (end == pos)
+                fail("unexpected character");
+            std::string number{text.substr(pos, end == std::string_view::npos ? std::string_view::npos : end - pos)};
+            char* numberEnd;
+            value.type = Type::Number;
+            value.number = strtod(number.c_str(), &numberEnd);
+            if (*numberEnd != '\0')
+                fail("invalid number");
+            pos += number.size();
+        }
+        }
+        depth--;
+        return value;
+    }
+
+    static void appendUtf8(std::string& s, unsigned long cp) {
+        if (cp < 0x80) {
+            s += static_cast<char>(cp);
+        } else if (cp < 0x800) {
+            s += static_cast<char>(0xC0 | (cp >> 6));
+            s += static_cast<char>(0x80 | (cp & 0x3F));
+        } else if (cp < 0x10000) {
+            s += static_cast<char>(0xE0 | (cp >> 12));
+            s += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+            s += static_cast<char>(0x80 | (cp & 0x3F));
+        } else {
+            s += static_cast<char>(0xF0 | (cp >> 18));
+            s += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+            s += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+            s += static_cast<char>(0x80 | (cp & 0x3F));
+        }
+    }
+
+    unsigned long parseHex4() {
+        if (pos + 4 > text.size())
+            fail("truncated unicode escape");
+        std::string hex{text.substr(pos, 4)};
+        char* end;
+        unsigned long cp = strtoul(hex.c_str(), &end, 16);
+        if (*end != '\0')
+            fail("invalid unicode escape");
+        pos += 4;
+        return cp;
+    }
+
+    std::string parseString() {
+        std::string result;
+        pos++; // opening quote
+        for (;;) {
+            size_t special = text.find_first_of("\"\\", pos);
+            if (special == std::string_view::npos)
+                fail("unterminated string");
+            result.append(text.substr(pos, special - pos));
+            pos = special + 1;
+            if (text[special] == '"')
+                return result;
+            if (pos >= text.size())
+                fail("unterminated string");
+            char c = text[pos++];
+            switch (c) {
+            case '"': result += '"'; break;
+            case '\\': result += '\\'; break;
+            case '/': result += '/'; break;
+            case 'b': result += '\b'; break;
+            case 'f': result += '\f'; break;
+            case 'n': result += '\n'; break;
+            case 'r': result += '\r'; break;
+            case 't': result += '\t'; break;
+            case 'u': {
+                unsigned long cp = parseHex4();
+                if (cp >= 0xD800 && cp < 0xDC00 && text.substr(pos, 2) == "\\u") {
+                    pos += 2;
+                    unsigned long low = parseHex4();
+                    if (low < 0xDC00 || low > 0xDFFF)
+                        fail("invalid surrogate pair");
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                }
+                appendUtf8(result, cp);
+                break;
+            }
+            default:
+                fail("invalid escape sequence");
+            }
+        }
+    }
+};
+
+Json Json::parse(std::string_view text) {
+    return Parser{text}.parseDocument();
+}
+
+Json::Type Json::getType() const {
+    return type;
+}
+
+bool Json::isNull() const {
+    return type == Type::Null;
+}
+
+bool Json::asBool() const {
+    if (type != Type::Bool)
+        throw std::runtime_error{"JSON value is not a boolean."};
+    return boolean;
+}
+
+double Json::asNumber() const {
+    if (type != Type::Number)
+        throw std::runtime_error{"JSON value is not a number."};
+    return number;
+}
+
+const std::string& Json::asString() const {
+    if (type != Type::String)
+        throw std::runtime_error{"JSON value is not a string."};
+    return string;
+}
+
+const std::vector<Json>& Json::asArray() const {
+    if (type != Type::Array)
+        throw std::runtime_error{"JSON value is not an array."};
+    return values;
+}
+
+const Json& Json::operator[](const std::string& key) const {
+    static const Json null;
+    if (type != Type::Object)
+        throw std::runtime_error{"JSON value is not an object."};
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (keys[i] == key)
+            return values[i];
+    }
+    return null;
+}
+
+bool Json::has(const std::string& key) const {
+    return type == Type::Object && !(*this)[key].isNull();
+}
+
+} // namespace TransactionalUpdate
@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Minimal JSON parser, sufficient for reading OCI image indexes and manifests
+ */
+
+#ifndef T_U_JSON_H
+#define T_U_JSON_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace TransactionalUpdate {
+
+class Json
+{
+public:
+    enum class Type { Null, Bool, Number, String, Array, Object };
+    static Json parse(std::string_view text);
+    Type getType() const;
+    bool isNull() const;
+    bool asBool() const;
+    double asNumber() const;
+    const std::string& asString() const;
+    const std::vector<Json>& asArray() const;
+    // Object member access; returns a null value for missing keys
+    const Json& operator[](const std::string& key) const;
+    bool has(const std::string& key) const;
+private:
+    Type type = Type::Null;
+    bool boolean = false;
+    double number = 0;
+    std::string string;
+    std::vector<Json> values;
+    std::vector<std::string> keys;
+    class Parser;
+};
+
+} // namespace TransactionalUpdate
+
+#endif // T_U_JSON_H
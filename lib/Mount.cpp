@@ -7,12 +7,78 @@
 
 #include "Log.hpp"
 #include "Mount.hpp"
+#include <cerrno>
 #include <cstring>
+#include <exception>
+#include <fcntl.h>
 #include <filesystem>
 #include <stdexcept>
+#include <string_view>
+#include <unordered_map>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 namespace TransactionalUpdate {
 
+#ifdef HAVE_OPEN_TREE
+// Disabled on the first ENOSYS, i.e. for kernels older than 5.12
+static bool mountApi = true;
+#else
+static bool mountApi = false;
+#endif
+
+// listmount() and statmount() (Linux 6.8) aren't wrapped by the C library yet;
+// they use the same numbers on all architectures with the generic syscall table
+#if !defined(SYS_listmount) && (defined(__x86_64__) || defined(__i386__) || defined(__aarch64__) \
+        || defined(__arm__) || defined(__powerpc64__) || defined(__s390x__) || defined(__riscv))
+#define SYS_statmount 457
+#define SYS_listmount 458
+#endif
+#ifdef SYS_listmount
+// Disabled on the first ENOSYS
+static bool listMountApi = true;
+#else
+static bool listMountApi = false;
+#endif
+#ifndef STATX_MNT_ID_UNIQUE
+#define STATX_MNT_ID_UNIQUE 0x00004000U
+#endif
+
+// Kernel ABI of struct mnt_id_req and struct statmount, see linux/mount.h
+struct MountIdRequest {
+    uint32_t size;
+    uint32_t spare;
+    uint64_t mntId;
+    uint64_t param;
+};
+struct StatMount {
+    uint32_t size;
+    uint32_t spare1;
+    uint64_t mask;
+    uint32_t sbDevMajor;
+    uint32_t sbDevMinor;
+    uint64_t sbMagic;
+    uint32_t sbFlags;
+    uint32_t fsType;
+    uint64_t mntId;
+    uint64_t mntParentId;
+    uint32_t mntIdOld;
+    uint32_t mntParentIdOld;
+    uint64_t mntAttr;
+    uint64_t mntPropagation;
+    uint64_t mntPeerGroup;
+    uint64_t mntMaster;
+    uint64_t propagateFrom;
+    uint32_t mntRoot;
+    uint32_t mntPoint;
+    uint64_t spare2[50];
+    // Followed by the strings, mntPoint is an offset into them
+};
+static const uint64_t STATMOUNT_MNT_BASIC = 0x2;
+static const uint64_t STATMOUNT_MNT_POINT = 0x10;
+
 Mount::Mount(std::filesystem::path mountpoint, unsigned long flags, bool umount)
     : mnt_table{mnt_new_table()}, mountpoint{std::move(mountpoint)},
       flags{std::move(flags)}, umount{std::move(umount)}
@@ -30,15 +96,8 @@ Mount::Mount(Mount&& other) noexcept
 }
 
 Mount::~Mount() {
-    if (mnt_fs && umount) {
-        struct libmnt_table* umount_table = mnt_new_table();
-        if ((mnt_table_parse_mtab(umount_table, nullptr)) != 0)
-            tulog.error("Error reading mtab for umount");
-        struct libmnt_fs* umount_fs = mnt_table_find_target(umount_table,  mnt_fs_get_target(mnt_fs), MNT_ITER_BACKWARD);
-        umountRecursive(umount_table, umount_fs);
-        mnt_free_fs(umount_fs);
-        mnt_free_table(umount_table);
-    }
+    if (mnt_fs && mnt_cxt && umount)
+        MountList::umountTree(mnt_fs_get_target(mnt_fs));
 
     mnt_free_context(mnt_cxt);
     mnt_unref_fs(mnt_fs);
@@ -167,6 +226,212 @@ void Mount::setType(std::string type) {
     }
 }
 
+bool Mount::mountApiSupported() {
+    return mountApi;
+}
+
+#ifdef HAVE_OPEN_TREE
+// Disabled on the first kernel refusing to mount onto a detached mount (before Linux 6.15)
+static bool detachedTreeApi = true;
+
+static const unsigned long propagationFlags = MS_PRIVATE | MS_SLAVE | MS_SHARED | MS_UNBINDABLE;
+
+// Creates a detached mount (a clone of the source tree for bind mounts) with
+// the mount's attributes set, skipping libmount's option parsing; returns -1
+// if the mount can't be done this way.
+int Mount::openDetached() {
+    const unsigned long supportedFlags = MS_BIND | MS_REC | MS_RDONLY | MS_NOSUID | MS_NODEV | MS_NOEXEC | MS_NOATIME | propagationFlags;
+    if (mnt_fs == nullptr)
+        return -1;
+    const char* source = mnt_fs_get_source(mnt_fs);
+    if (!mountApi || (flags & ~supportedFlags) || mnt_fs_get_options(mnt_fs) != nullptr || source == nullptr)
+        return -1;
+    unsigned int recursive = (flags & MS_REC) ? AT_RECURSIVE : 0;
+
+    int fd = -1;
+    auto fallback = [&](const char* call) {
+        int err = errno;
+        if (fd >= 0)
+            close(fd);
+        if (err == ENOSYS)
+            mountApi = false;
+        tulog.debug(call, " for ", mountpoint, " failed: ", strerror(err), "; falling back to libmount.");
+        return -1;
+    };
+
+    if (flags & MS_BIND) {
+        fd = open_tree(AT_FDCWD, source, OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | recursive);
+        if (fd < 0)
+            return fallback("open_tree");
+    } else {
+        const char* type = mnt_fs_get_fstype(mnt_fs);
+        if (type == nullptr)
+            return -1;
+        int fsFd = fsopen(type, FSOPEN_CLOEXEC);
+        if (fsFd < 0)
+            return fallback("fsopen");
+        if (fsconfig(fsFd, FSCONFIG_SET_STRING, "source", source, 0) == 0
+                && fsconfig(fsFd, FSCONFIG_CMD_CREATE, nullptr, nullptr, 0) == 0)
+            fd = fsmount(fsFd, FSMOUNT_CLOEXEC, 0);
+        int err = errno;
+        close(fsFd);
+        errno = err;
+        if (fd < 0)
+            return fallback("fsmount");
+    }
+
+    struct mount_attr attr = {};
+    if (flags & MS_RDONLY)
+        attr.attr_set |= MOUNT_ATTR_RDONLY;
+    if (flags & MS_NOSUID)
+        attr.attr_set |= MOUNT_ATTR_NOSUID;
+    if (flags & MS_NODEV)
+        attr.attr_set |= MOUNT_ATTR_NODEV;
+    if (flags & MS_NOEXEC)
+        attr.attr_set |= MOUNT_ATTR_NOEXEC;
+    if (flags & MS_NOATIME) {
+        attr.attr_clr |= MOUNT_ATTR__ATIME;
+        attr.attr_set |= MOUNT_ATTR_NOATIME;
+    }
+    if (attr.attr_set && mount_setattr(fd, "", AT_EMPTY_PATH | recursive, &attr, sizeof(attr)) < 0)
+        return fallback("mount_setattr");
+    return fd;
+}
+
+// The propagation type can only be changed once the mount is attached
+void Mount::setPropagation(int fd, const std::filesystem::path& target) {
+    if (!(flags & propagationFlags))
+        return;
+    struct mount_attr propagation = {};
+    propagation.propagation = flags & propagationFlags;
+    if (mount_setattr(fd, "", AT_EMPTY_PATH | ((flags & MS_REC) ? AT_RECURSIVE : 0), &propagation, sizeof(propagation)) < 0)
+        throw std::runtime_error{"Setting propagation of '" + target.native() + "' failed: " + std::string(strerror(errno))};
+}
+
+// Attaches the mount with move_mount; returns false without changing
+// anything if the mount can't be done this way.
+bool Mount::mountFd(const std::filesystem::path& target) {
+    int fd = openDetached();
+    if (fd < 0)
+        return false;
+    if (move_mount(fd, "", AT_FDCWD, target.c_str(), MOVE_MOUNT_F_EMPTY_PATH) < 0) {
+        tulog.debug("move_mount for ", mountpoint, " failed: ", strerror(errno), "; falling back to libmount.");
+        close(fd);
+        return false;
+    }
+    MountTable::invalidate();
+    try {
+        setPropagation(fd, target);
+    } catch (const std::exception &e) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    return true;
+}
+
+// Opens (and creates if necessary) the directory rel below dir, following
+// mounts as a path lookup would
+static int openTreeDir(int dir, const std::filesystem::path& rel) {
+    int fd = dup(dir);
+    for (auto& component: rel) {
+        if (fd < 0)
+            return -1;
+        if (mkdirat(fd, component.c_str(), 0755) < 0 && errno != EEXIST) {
+            close(fd);
+            return -1;
+        }
+        int next = openat(fd, component.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        close(fd);
+        fd = next;
+    }
+    return fd;
+}
+
+bool Mount::mountTree(std::vector<std::unique_ptr<Mount>>& mounts, std::filesystem::path prefix) {
+    if (!mountApi || !detachedTreeApi || mounts.empty())
+        return false;
+
+    std::vector<int> fds;
+    int treeFd = -1;
+    // Nothing is attached until the very end, so giving up just means closing
+    // the file descriptors, which drops the detached mounts again
+    auto fallback = [&](const std::string& msg) {
+        tulog.debug(msg, "; mounting directories one by one.");
+        for (int fd: fds)
+            close(fd);
+        if (treeFd >= 0)
+            close(treeFd);
+        return false;
+    };
+
+    treeFd = open_tree(AT_FDCWD, prefix.c_str(), OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC);
+    if (treeFd < 0)
+        return fallback("Cloning " + prefix.native() + " failed: " + strerror(errno));
+    for (auto& mount: mounts) {
+        // Same as BindMount::mount
+        if ((mount->flags & MS_BIND) && mount->mnt_fs == nullptr)
+            mount->setSource(mount->mountpoint);
+        std::filesystem::path rel = mount->mountpoint.relative_path();
+        int fd = mount->openDetached();
+        if (fd < 0)
+            return fallback("Mount " + mount->mountpoint.native() + " needs libmount");
+        fds.push_back(fd);
+        int dir = openTreeDir(treeFd, rel.parent_path());
+        if (dir < 0)
+            return fallback("Creating " + rel.parent_path().native() + " failed: " + strerror(errno));
+        int rc = mkdirat(dir, rel.filename().c_str(), 0755);
+        if (rc == 0 || errno == EEXIST)
+            rc = move_mount(fd, "", dir, rel.filename().c_str(), MOVE_MOUNT_F_EMPTY_PATH);
+        int err = errno;
+        close(dir);
+        if (rc < 0) {
+            if (fds.size() == 1)
+                detachedTreeApi = false;
+            return fallback("Mounting " + mount->mountpoint.native() + " in a detached tree failed: " + strerror(err));
+        }
+    }
+
+    // Replace the original mount by the complete tree in a single step
+    if (umount2(prefix.c_str(), 0) < 0)
+        return fallback("Unmounting " + prefix.native() + " failed: " + strerror(errno));
+    int rc = move_mount(treeFd, "", AT_FDCWD, prefix.c_str(), MOVE_MOUNT_F_EMPTY_PATH);
+    int err = errno;
+    MountTable::invalidate();
+    if (rc < 0) {
+        fallback("");
+        throw std::runtime_error{"Attaching the mount tree to '" + prefix.native() + "' failed: " + std::string(strerror(err))};
+    }
+    close(treeFd);
+
+    std::exception_ptr error;
+    for (size_t i = 0; i < mounts.size(); i++) {
+        std::filesystem::path target = prefix / mounts[i]->mountpoint.relative_path();
+        // Needed for unmounting later
+        mnt_fs_set_target(mounts[i]->mnt_fs, target.c_str());
+        mounts[i]->mnt_cxt = mnt_new_context();
+        try {
+            if (!error)
+                mounts[i]->setPropagation(fds[i], target);
+        } catch (const std::exception &e) {
+            error = std::current_exception();
+        }
+        close(fds[i]);
+    }
+    if (error)
+        std::rethrow_exception(error);
+    return true;
+}
+#else
+bool Mount::mountFd(const std::filesystem::path&) {
+    return false;
+}
+
+bool Mount::mountTree(std::vector<std::unique_ptr<Mount>>&, std::filesystem::path) {
+    return false;
+}
+#endif
+
 void Mount::mount(std::filesystem::path prefix) {
     tulog.debug("Mounting ", mountpoint, "...");
 
@@ -176,7 +441,12 @@ void Mount::mount(std::filesystem::path prefix) {
         throw std::runtime_error{"Setting target '" + mounttarget.native() + "' for mountpoint failed: " + std::to_string(rc)};
     }
 
+    // The context is also needed for unmounting later
     mnt_cxt = mnt_new_context();
+    std::filesystem::create_directories(mounttarget);
+    if (mountFd(mounttarget))
+        return;
+
     if ((rc = mnt_context_set_fs(mnt_cxt, mnt_fs)) != 0) {
         throw std::runtime_error{"Setting mount context for '" + mountpoint.native() + "' failed: " + std::to_string(rc)};
     }
@@ -189,9 +459,8 @@ void Mount::mount(std::filesystem::path prefix) {
         throw std::runtime_error{"Setting mount flags for '" + mountpoint.native() + "' failed: " + std::to_string(rc)};
     }
 
-    std::filesystem::create_directories(mounttarget);
-
     rc = mnt_context_mount(mnt_cxt);
+    MountTable::invalidate();
     char buf[BUFSIZ] = { 0 };
     mnt_context_get_excode(mnt_cxt, rc, buf, sizeof(buf));
     if (*buf)
@@ -229,39 +498,6 @@ void Mount::persist(std::filesystem::path file) {
     }
 }
 
-void Mount::umountRecursive(libmnt_table* umount_table, libmnt_fs* umount_fs) {
-    int rc;
-    struct libmnt_context* umount_cxt = mnt_new_context();
-    if (mnt_cxt && umount_fs) {
-        // Check for child mounts
-        struct libmnt_fs* child_fs;
-        struct libmnt_iter *iter = mnt_new_iter(MNT_ITER_BACKWARD);
-        if (!iter)
-            tulog.error("Error allocating umount iter");
-        while ((rc = mnt_table_next_child_fs(umount_table, iter, umount_fs, &child_fs)) != 1) {
-            if (rc < 0) {
-                tulog.error("Error determining child mounts of ", mnt_fs_get_target(umount_fs), ": ", rc);
-                break;
-            } else if (rc == 0) {
-                umountRecursive(umount_table, child_fs);
-            }
-        }
-        mnt_free_iter(iter);
-
-        // Unmount
-        tulog.debug("Unmounting ", mnt_fs_get_target(umount_fs), "...");
-        if ((rc = mnt_context_set_fs(umount_cxt, umount_fs)) != 0) {
-            tulog.error("Setting umount context for '", mnt_fs_get_target(umount_fs), "' failed: ", rc);
-        }
-        int rc = mnt_context_umount(umount_cxt);
-        char buf[BUFSIZ] = { 0 };
-        mnt_context_get_excode(umount_cxt, rc, buf, sizeof(buf));
-        if (*buf)
-            tulog.error("Error unmounting '", mnt_fs_get_target(umount_fs), "': ", buf);
-    }
-    mnt_free_context(umount_cxt);
-}
-
 BindMount::BindMount(std::filesystem::path mountpoint, unsigned long flags, bool umount)
     : Mount(mountpoint, flags | MS_BIND, umount)
 {
@@ -279,40 +515,333 @@ PropagatedBindMount::PropagatedBindMount(std::filesystem::path mountpoint, unsig
 {
 }
 
-std::vector<std::filesystem::path> MountList::getList(std::filesystem::path prefix) {
-    int rc = 0;
-    std::string err;
+// Whether path is below (or equal to) dir; both have to be normalized
+static bool isBelow(const std::string& path, const std::string& dir) {
+    return path.compare(0, dir.length(), dir) == 0
+        && (dir == "/" || path.length() == dir.length() || path[dir.length()] == '/');
+}
 
+static std::vector<std::filesystem::path> listMountpoints(const std::vector<MountInfo>& mounts, std::filesystem::path prefix,
+                                                          const std::string& below) {
     std::vector<std::filesystem::path> list;
-    struct libmnt_table* mount_table = mnt_new_table();
-    struct libmnt_iter* mount_iter = mnt_new_iter(MNT_ITER_FORWARD);
-    struct libmnt_fs* mount_fs;
-
-    if ((rc = mnt_table_parse_mtab(mount_table, NULL)) != 0)
-        err = "Couldn't read fstab for reading mount points: " + std::to_string(rc);
-    while (rc == 0) {
-        if ((rc = mnt_table_next_fs(mount_table, mount_iter, &mount_fs)) == 0) {
-            std::filesystem::path target;
-            if ((target = mnt_fs_get_target(mount_fs)) == "") {
-                err = "Could't read target for mount point list.";
-                break;
+    for (auto& mount: mounts) {
+        if (mount.mountpoint == "/" || !isBelow(mount.mountpoint, below))
+            continue;
+        list.push_back(prefix / mount.mountpoint.relative_path());
+    }
+    return list;
+}
+
+#ifdef SYS_listmount
+// Sets mountpoint and parent of the given mount, or mountpoint to an empty
+// string if it is gone; returns 0 or an errno value
+static int statMount(uint64_t id, std::vector<char>& buf, std::string& mountpoint, uint64_t& parent) {
+    MountIdRequest req{sizeof(MountIdRequest), 0, id, STATMOUNT_MNT_BASIC | STATMOUNT_MNT_POINT};
+    while (syscall(SYS_statmount, &req, buf.data(), buf.size(), 0) < 0) {
+        if (errno == EOVERFLOW) {
+            buf.resize(buf.size() * 2);
+            continue;
+        }
+        mountpoint.clear();
+        return errno == ENOENT ? 0 : errno;
+    }
+    auto sm = reinterpret_cast<const StatMount*>(buf.data());
+    if (!(sm->mask & STATMOUNT_MNT_BASIC) || !(sm->mask & STATMOUNT_MNT_POINT))
+        return EOPNOTSUPP;
+    mountpoint = buf.data() + sizeof(StatMount) + sm->mntPoint;
+    parent = sm->mntParentId;
+    return 0;
+}
+
+// Returns 0 or an errno value
+static int walkMounts(std::vector<std::filesystem::path>& list, const std::filesystem::path& prefix,
+                      const std::string& below, uint64_t start) {
+    std::vector<char> buf(4096);
+    std::vector<uint64_t> children(512);
+    std::unordered_set<uint64_t> seen{start};
+    std::string mountpoint;
+    uint64_t parent;
+    int err;
+    if ((err = statMount(start, buf, mountpoint, parent)) != 0)
+        return err;
+    if (!mountpoint.empty() && mountpoint != "/" && isBelow(mountpoint, below))
+        list.push_back(prefix / std::filesystem::path{mountpoint}.relative_path());
+
+    // Linux 6.8 only lists the direct children of a mount, later versions
+    // the whole subtree; in the latter case one level is enough.
+    bool subtree = false;
+    std::vector<uint64_t> queue{start};
+    for (size_t i = 0; i < queue.size() && !subtree; i++) {
+        MountIdRequest req{sizeof(MountIdRequest), 0, queue[i], 0};
+        for (;;) {
+            long count = syscall(SYS_listmount, &req, children.data(), children.size(), 0);
+            if (count < 0)
+                return errno == ENOENT ? 0 : errno;
+            for (long c = 0; c < count; c++) {
+                if (!seen.insert(children[c]).second)
+                    continue;
+                if ((err = statMount(children[c], buf, mountpoint, parent)) != 0)
+                    return err;
+                if (mountpoint.empty())
+                    continue;
+                if (parent != queue[i])
+                    subtree = true;
+                if (isBelow(mountpoint, below)) {
+                    list.push_back(prefix / std::filesystem::path{mountpoint}.relative_path());
+                    queue.push_back(children[c]);
+                } else if (isBelow(below, mountpoint)) {
+                    queue.push_back(children[c]);
+                }
             }
-            if (target == "/")
-                continue;
-            list.push_back(prefix / target.relative_path());
-        } else if (rc < 0) {
-            err = "Error iterating fstab: " + std::to_string(rc);
-            break;
+            if (static_cast<size_t>(count) < children.size())
+                break;
+            // Continue after the last returned mount
+            req.param = children[count - 1];
         }
     }
+    return 0;
+}
+#endif
+
+// Walks the mount tree with listmount() and statmount() instead of parsing all
+// of mountinfo: starting from the mount below resides on, only the branches
+// leading to below are descended into. Returns false if the syscalls are not
+// available.
+static bool listMountpointsFast(std::vector<std::filesystem::path>& list, const std::filesystem::path& prefix,
+                                const std::string& below) {
+#ifdef SYS_listmount
+    if (!listMountApi)
+        return false;
+    struct statx stx;
+    if (statx(AT_FDCWD, below.c_str(), 0, STATX_MNT_ID_UNIQUE, &stx) < 0)
+        return false;
+    if (!(stx.stx_mask & STATX_MNT_ID_UNIQUE)) {
+        listMountApi = false;
+        return false;
+    }
+    int err = walkMounts(list, prefix, below, stx.stx_mnt_id);
+    if (err != 0) {
+        if (err == ENOSYS)
+            listMountApi = false;
+        tulog.debug("Listing mounts with listmount failed: ", strerror(err));
+        list.clear();
+        return false;
+    }
+    return true;
+#else
+    (void)list;
+    (void)prefix;
+    (void)below;
+    return false;
+#endif
+}
 
-    mnt_free_iter(mount_iter);
-    mnt_free_table(mount_table);
+std::vector<std::filesystem::path> MountList::getList(std::filesystem::path prefix, std::filesystem::path below) {
+    std::string dir = below.lexically_normal();
+    std::vector<std::filesystem::path> list;
+    // All mounts are needed for "/"; reading them one by one with statmount()
+    // is slower than parsing mountinfo then
+    if (dir != "/" && listMountpointsFast(list, prefix, dir))
+        return list;
+    return listMountpoints(getMountInfo(), prefix, dir);
+}
 
-    if (!err.empty()) {
-        throw std::runtime_error{err};
+// Decodes the octal escapes (e.g. "\040" for a space) used by the kernel in mountinfo fields
+static std::string unescapeMountField(std::string_view field) {
+    std::string result;
+    result.reserve(field.length());
+    for (size_t i = 0; i < field.length(); i++) {
+        if (field[i] == '\\' && i + 3 < field.length()
+                && field[i + 1] >= '0' && field[i + 1] <= '3'
+                && field[i + 2] >= '0' && field[i + 2] <= '7'
+                && field[i + 3] >= '0' && field[i + 3] <= '7') {
+            result += static_cast<char>((field[i + 1] - '0') * 64 + (field[i + 2] - '0') * 8 + (field[i + 3] - '0'));
+            i += 3;
+        } else {
+            result += field[i];
+        }
     }
-    return list;
+    return result;
+}
+
+std::vector<MountInfo> MountList::getMountInfo(std::filesystem::path file) {
+    int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw std::runtime_error{"Opening " + file.native() + " failed: " + std::string(strerror(errno))};
+    std::string content;
+    char buf[16384];
+    ssize_t len;
+    while ((len = read(fd, buf, sizeof(buf))) > 0 || (len < 0 && errno == EINTR)) {
+        if (len > 0)
+            content.append(buf, len);
+    }
+    int err = errno;
+    close(fd);
+    if (len < 0)
+        throw std::runtime_error{"Reading " + file.native() + " failed: " + std::string(strerror(err))};
+
+    // Format: ID PARENT MAJ:MIN ROOT MOUNTPOINT OPTIONS [OPTIONAL...] - FSTYPE SOURCE SUPEROPTIONS
+    std::vector<MountInfo> mounts;
+    std::string_view data{content};
+    while (!data.empty()) {
+        size_t eol = data.find('\n');
+        std::string_view line = data.substr(0, eol);
+        data.remove_prefix(eol == std::string_view::npos ? data.length() : eol + 1);
+        if (line.empty())
+            continue;
+
+        std::vector<std::string_view> fields;
+        while (!line.empty()) {
+            size_t sep = line.find(' ');
+            fields.push_back(line.substr(0, sep));
+            line.remove_prefix(sep == std::string_view::npos ? line.length() : sep + 1);
+        }
+        size_t dash = 6;
+        while (dash < fields.size() && fields[dash] != "-")
+            dash++;
+        if (fields.size() < 6 || dash + 2 >= fields.size())
+            throw std::runtime_error{"Malformed line in " + file.native() + "."};
+
+        MountInfo mount;
+        mount.id = std::stoi(std::string{fields[0]});
+        mount.parentId = std::stoi(std::string{fields[1]});
+        mount.root = unescapeMountField(fields[3]);
+        mount.mountpoint = unescapeMountField(fields[4]);
+        mount.options = fields[5];
+        mount.fstype = unescapeMountField(fields[dash + 1]);
+        mount.source = unescapeMountField(fields[dash + 2]);
+        mounts.push_back(std::move(mount));
+    }
+    return mounts;
+}
+
+void MountList::umountTree(std::filesystem::path target) {
+    std::vector<MountInfo> mounts;
+    try {
+        mounts = getMountInfo();
+    } catch (const std::exception &e) {
+        tulog.error("Error reading mount table for umount: ", e.what());
+        return;
+    }
+    const MountInfo* root = nullptr;
+    for (auto& mount: mounts) {
+        if (mount.mountpoint == target)
+            root = &mount;
+    }
+    if (root == nullptr)
+        return;
+
+    // Children have to be unmounted before their parents; of the siblings
+    // the later ones may hide earlier ones, so they go first.
+    std::unordered_map<int, std::vector<const MountInfo*>> children;
+    for (auto& mount: mounts) {
+        if (mount.id != mount.parentId)
+            children[mount.parentId].push_back(&mount);
+    }
+    std::vector<const MountInfo*> order;
+    std::vector<std::pair<const MountInfo*, bool>> stack{{root, false}};
+    while (!stack.empty()) {
+        auto [mount, visited] = stack.back();
+        stack.pop_back();
+        if (visited) {
+            order.push_back(mount);
+            continue;
+        }
+        stack.emplace_back(mount, true);
+        for (auto child: children[mount->id])
+            stack.emplace_back(child, false);
+    }
+
+    bool failed = false;
+    for (auto mount: order) {
+        tulog.debug("Unmounting ", mount->mountpoint.native(), "...");
+        if (umount2(mount->mountpoint.c_str(), UMOUNT_NOFOLLOW) < 0) {
+            tulog.error("Error unmounting '", mount->mountpoint.native(), "': ", strerror(errno));
+            failed = true;
+        }
+    }
+    // Don't leave the remains of the tree behind, detach them once they're not busy anymore
+    if (failed && umount2(target.c_str(), MNT_DETACH | UMOUNT_NOFOLLOW) < 0 && errno != EINVAL)
+        tulog.error("Error detaching '", target.native(), "': ", strerror(errno));
+    MountTable::invalidate();
+}
+
+// Returns the topmost mount the given path resides on (i.e. the last mount of the deepest
+// matching mount point), optionally restricted to the given file system type
+const MountInfo* MountList::findTarget(const std::vector<MountInfo>& mounts, std::filesystem::path target, std::string fstype) {
+    const MountInfo* found = nullptr;
+    size_t foundLength = 0;
+    std::string path = target.lexically_normal();
+    for (auto& mount: mounts) {
+        const std::string& mp = mount.mountpoint.native();
+        bool matches = path.compare(0, mp.length(), mp) == 0
+            && (mp == "/" || path.length() == mp.length() || path[mp.length()] == '/');
+        if (matches && mp.length() >= foundLength) {
+            found = &mount;
+            foundLength = mp.length();
+        }
+    }
+    if (found && !fstype.empty() && found->fstype != fstype) {
+        // The path may be overmounted by a different file system type; look for the
+        // last mount of the requested type on the same mount point
+        const MountInfo* typed = nullptr;
+        for (auto& mount: mounts) {
+            if (mount.mountpoint == found->mountpoint && mount.fstype == fstype)
+                typed = &mount;
+        }
+        found = typed;
+    }
+    return found;
+}
+
+std::atomic<unsigned long> MountTable::generation{1};
+
+// fstab targets are compared without trailing slashes, as mnt_table_find_target does
+static std::string normalizeTarget(const std::filesystem::path& target) {
+    std::string normalized = target.lexically_normal();
+    while (normalized.length() > 1 && normalized.back() == '/')
+        normalized.pop_back();
+    return normalized;
+}
+
+bool MountTable::isMount(const std::filesystem::path& mountpoint) {
+    if (!fstabParsed) {
+        struct libmnt_table* table = mnt_new_table();
+        int rc;
+        if ((rc = mnt_table_parse_fstab(table, nullptr)) != 0) {
+            mnt_free_table(table);
+            throw std::runtime_error{"Error reading fstab: " + std::to_string(rc)};
+        }
+        struct libmnt_iter* iter = mnt_new_iter(MNT_ITER_FORWARD);
+        struct libmnt_fs* fs;
+        while (mnt_table_next_fs(table, iter, &fs) == 0) {
+            if (mnt_fs_get_target(fs) != nullptr)
+                fstabTargets.insert(normalizeTarget(mnt_fs_get_target(fs)));
+        }
+        mnt_free_iter(iter);
+        mnt_free_table(table);
+        fstabParsed = true;
+    }
+    return fstabTargets.count(normalizeTarget(mountpoint)) > 0;
+}
+
+const std::vector<MountInfo>& MountTable::getMountInfo() {
+    unsigned long current = generation;
+    if (mountInfoGeneration != current) {
+        mountInfo = MountList::getMountInfo();
+        mountInfoGeneration = current;
+    }
+    return mountInfo;
+}
+
+std::vector<std::filesystem::path> MountTable::getList(std::filesystem::path prefix, std::filesystem::path below) {
+    if (mountInfoGeneration == generation)
+        return listMountpoints(mountInfo, prefix, below.lexically_normal());
+    return MountList::getList(prefix, below);
+}
+
+void MountTable::invalidate() {
+    generation++;
 }
 
 } // namespace TransactionalUpdate
@@ -8,9 +8,12 @@
 #ifndef T_U_MOUNT_H
 #define T_U_MOUNT_H
 
+#include <atomic>
 #include <filesystem>
 #include <libmount/libmount.h>
+#include <memory>
 #include <string>
+#include <unordered_set>
 #include <vector>
 
 namespace TransactionalUpdate {
@@ -31,6 +34,14 @@ public:
     void setSource(std::filesystem::path source);
     void setTabSource(std::filesystem::path source);
     void setType(std::string type);
+    // Whether mounts are created with the file descriptor based mount API
+    // (open_tree / fsmount and move_mount) instead of libmount
+    static bool mountApiSupported();
+    // Mounts all mounts below prefix at once: they are assembled in a detached
+    // copy of the mount at prefix, which then replaces it with a single
+    // move_mount. Returns false without changing anything if this isn't
+    // possible, e.g. on kernels before 6.15; use mount() for each then.
+    static bool mountTree(std::vector<std::unique_ptr<Mount>>& mounts, std::filesystem::path prefix);
 protected:
     struct libmnt_context* mnt_cxt = nullptr;
     struct libmnt_table* mnt_table = nullptr;
@@ -42,7 +53,9 @@ protected:
     struct libmnt_fs* findFS();
     struct libmnt_fs* getTabEntry();
     struct libmnt_fs* newFS();
-    void umountRecursive(libmnt_table* umount_table, libmnt_fs* umount_fs);
+    int openDetached();
+    void setPropagation(int fd, const std::filesystem::path& target);
+    bool mountFd(const std::filesystem::path& target);
 };
 
 class BindMount : public Mount
@@ -58,11 +71,54 @@ public:
     PropagatedBindMount(std::filesystem::path mountpoint, unsigned long flags = 0, bool umount = false);
 };
 
+struct MountInfo
+{
+    int id;
+    int parentId;
+    std::string root;
+    std::filesystem::path mountpoint;
+    std::string options;
+    std::string fstype;
+    std::string source;
+};
+
 class MountList
 {
 public:
     MountList() = delete;
-    static std::vector<std::filesystem::path> getList(std::filesystem::path prefix = "/");
+    // Mount points at or below the given directory (except for "/"), each
+    // prefixed with prefix; uses listmount() / statmount() if available and
+    // below isn't "/"
+    static std::vector<std::filesystem::path> getList(std::filesystem::path prefix = "/", std::filesystem::path below = "/");
+    static std::vector<MountInfo> getMountInfo(std::filesystem::path file = "/proc/self/mountinfo");
+    static const MountInfo* findTarget(const std::vector<MountInfo>& mounts, std::filesystem::path target, std::string fstype = "");
+    // Unmounts the topmost mount on target including all mounts below it,
+    // reading mountinfo only once; errors are logged for each mount
+    static void umountTree(std::filesystem::path target);
+};
+
+// Parses fstab and mountinfo only once for any number of lookups, e.g. while
+// setting up a transaction. The mountinfo part is parsed again after tukit
+// itself mounted or unmounted anything.
+class MountTable
+{
+public:
+    MountTable() = default;
+    MountTable(const MountTable&) = delete;
+    MountTable& operator=(const MountTable&) = delete;
+    // Whether fstab has an entry for the mount point, same as Mount::isMount
+    bool isMount(const std::filesystem::path& mountpoint);
+    const std::vector<MountInfo>& getMountInfo();
+    // Same as MountList::getList; only uses the cached mountinfo if it is still valid
+    std::vector<std::filesystem::path> getList(std::filesystem::path prefix = "/", std::filesystem::path below = "/");
+    // Has to be called after every change of the mount namespace
+    static void invalidate();
+private:
+    bool fstabParsed = false;
+    std::unordered_set<std::string> fstabTargets;
+    std::vector<MountInfo> mountInfo;
+    unsigned long mountInfoGeneration = 0;
+    static std::atomic<unsigned long> generation;
 };
 
 } // namespace TransactionalUpdate
@@ -0,0 +1,901 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Reads images from a local OCI image layout directory or an oci-archive and
+  applies their layer tarballs
+
+  Layers are streamed directly into the target file system; compressed layers
+  are piped through gzip or zstd. The digests of all blobs are checked before
+  their content is used. All file system modifications are done
+  relative to directory file descriptors opened with O_NOFOLLOW, so symlinks
+  in a layer can't redirect later entries outside of the root directory.
+ */
+
+#include "OciImage.hpp"
+#include "Json.hpp"
+#include "Log.hpp"
+#include "TarReader.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+#include <unordered_set>
+
+namespace TransactionalUpdate {
+
+static const std::string WHITEOUT_PREFIX = ".wh.";
+static const std::string OPAQUE_WHITEOUT = ".wh..wh..opq";
+
+static std::runtime_error fileError(const std::string& action, const std::string& path, int err = errno) {
+    return std::runtime_error{action + " '" + path + "' failed: " + std::string(strerror(err))};
+}
+
+// Relative path without "." components or trailing slashes; ".." is rejected
+static std::string normalize(const std::string& name) {
+    std::filesystem::path path = std::filesystem::path{name}.lexically_normal().relative_path();
+    for (auto& component: path) {
+        if (component == "..")
+            throw std::runtime_error{"Invalid path '" + name + "' in OCI image."};
+    }
+    std::string rel = path;
+    while (!rel.empty() && rel.back() == '/')
+        rel.pop_back();
+    return rel == "." ? "" : rel;
+}
+
+// Layer entries and hard link targets must be relative, absolute ones are rejected
+static std::string layerPath(const std::string& name) {
+    if (!name.empty() && name[0] == '/')
+        throw std::runtime_error{"Invalid path '" + name + "' in OCI image."};
+    return normalize(name);
+}
+
+// Whether rel is dir or below dir
+static bool isBelow(const std::string& rel, const std::string& dir) {
+    return dir.empty() || rel == dir || (rel.rfind(dir, 0) == 0 && rel[dir.length()] == '/');
+}
+
+static bool isBelowAny(const std::string& rel, const std::vector<std::string>& dirs) {
+    for (auto& dir: dirs) {
+        if (isBelow(rel, dir))
+            return true;
+    }
+    return false;
+}
+
+// Whether removing rel would also remove one of the paths
+static bool containsAny(const std::string& rel, const std::vector<std::string>& paths) {
+    for (auto& path: paths) {
+        if (isBelow(path, rel))
+            return true;
+    }
+    return false;
+}
+
+static std::vector<std::string> normalizeAll(const std::vector<std::filesystem::path>& paths) {
+    std::vector<std::string> result;
+    for (auto& path: paths)
+        result.push_back(normalize(path));
+    return result;
+}
+
+// Removes a directory tree without following symlinks
+static void removeAt(int dir, const std::string& name) {
+    struct stat st;
+    if (fstatat(dir, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) < 0) {
+        if (errno == ENOENT)
+            return;
+        throw fileError("Reading", name);
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        if (unlinkat(dir, name.c_str(), 0) < 0 && errno != ENOENT)
+            throw fileError("Deleting", name);
+        return;
+    }
+    int fd = openat(dir, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR* d = fd < 0 ? nullptr : fdopendir(fd);
+    if (d == nullptr) {
+        if (fd >= 0)
+            close(fd);
+        throw fileError("Opening", name);
+    }
+    std::vector<std::string> children;
+    while (struct dirent* entry = readdir(d)) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+            children.push_back(entry->d_name);
+    }
+    try {
+        for (auto& child: children)
+            removeAt(dirfd(d), child);
+    } catch (const std::exception &e) {
+        closedir(d);
+        throw;
+    }
+    closedir(d);
+    if (unlinkat(dir, name.c_str(), AT_REMOVEDIR) < 0 && errno != ENOENT)
+        throw fileError("Deleting", name);
+}
+
+// Opens the directory rel below root without following symlinks; returns -1 with errno set on failure
+static int openDir(int root, const std::string& rel, bool create) {
+    int fd = fcntl(root, F_DUPFD_CLOEXEC, 0);
+    for (auto& component: std::filesystem::path{rel}) {
+        if (fd < 0)
+            return -1;
+        int next = openat(fd, component.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (next < 0 && errno == ENOENT && create) {
+            if (mkdirat(fd, component.c_str(), 0755) < 0 && errno != EEXIST) {
+                int err = errno;
+                close(fd);
+                errno = err;
+                return -1;
+            }
+            next = openat(fd, component.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        }
+        int err = errno;
+        close(fd);
+        errno = err;
+        fd = next;
+    }
+    return fd;
+}
+
+static std::vector<std::string> listDir(int fd, const std::string& rel) {
+    std::vector<std::string> names;
+    int dupFd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    DIR* dir = dupFd < 0 ? nullptr : fdopendir(dupFd);
+    if (dir == nullptr) {
+        if (dupFd >= 0)
+            close(dupFd);
+        throw fileError("Reading directory", rel);
+    }
+    while (struct dirent* entry = readdir(dir)) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+            names.push_back(entry->d_name);
+    }
+    closedir(dir);
+    return names;
+}
+
+// Applies the entries of a single layer
+class LayerWriter {
+public:
+    LayerWriter(const std::filesystem::path& root, std::vector<std::string> keep, std::vector<std::string> merge,
+                std::vector<Sync::Change>* changes)
+        : root{root}, keep{std::move(keep)}, merge{std::move(merge)}, changes{changes}
+    {
+        rootFd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (rootFd < 0)
+            throw fileError("Opening", root);
+    }
+    ~LayerWriter() {
+        if (parentFd >= 0)
+            close(parentFd);
+        close(rootFd);
+    }
+
+    void apply(TarReader& reader) {
+        TarReader::Entry entry;
+        while (reader.next(entry))
+            applyEntry(reader, entry);
+
+        // Creating entries changed the directories' timestamps
+        for (auto it = dirTimes.rbegin(); it != dirTimes.rend(); it++) {
+            int dir = getParent(it->first, false);
+            if (dir < 0)
+                continue;
+            struct timespec times[2] = {it->second, it->second};
+            std::string name = std::filesystem::path{it->first}.filename();
+            if (utimensat(dir, name.c_str(), times, AT_SYMLINK_NOFOLLOW) < 0 && errno != ENOENT)
+                throw fileError("Setting timestamps of", root / it->first);
+        }
+    }
+private:
+    std::filesystem::path root;
+    std::vector<std::string> keep;
+    std::vector<std::string> merge;
+    std::vector<Sync::Change>* changes;
+    // Directories created by this layer, their contents don't have to be recorded as changes
+    std::unordered_set<std::string> newDirs;
+    int rootFd = -1;
+    // Entries are usually grouped by directory, so the last parent is kept open
+    int parentFd = -1;
+    std::string parentRel;
+    // Entries of the current layer, which opaque whiteouts must not remove
+    std::unordered_set<std::string> created;
+    std::vector<std::pair<std::string, struct timespec>> dirTimes;
+
+    // Missing parent directories are created unless create is false, in which case -1 is returned
+    int getParent(const std::string& rel, bool create = true) {
+        std::string dirRel = std::filesystem::path{rel}.parent_path();
+        if (parentFd >= 0 && dirRel == parentRel)
+            return parentFd;
+        invalidateParent();
+        parentFd = openDir(rootFd, dirRel, create);
+        if (parentFd < 0 && !create)
+            return -1;
+        if (parentFd < 0)
+            throw fileError("Opening", root / dirRel);
+        parentRel = dirRel;
+        return parentFd;
+    }
+
+    void invalidateParent() {
+        if (parentFd >= 0)
+            close(parentFd);
+        parentFd = -1;
+    }
+
+    // dir may be the cached parent, so it's only closed afterwards
+    void remove(int dir, const std::string& name) {
+        removeAt(dir, name);
+        invalidateParent();
+    }
+
+    void removeWhiteout(const std::string& rel) {
+        if (containsAny(rel, keep)) {
+            tulog.debug("Not removing protected path /", rel);
+            return;
+        }
+        int dir = openDir(rootFd, std::filesystem::path{rel}.parent_path(), false);
+        if (dir < 0)
+            return;
+        try {
+            remove(dir, std::filesystem::path{rel}.filename());
+        } catch (const std::exception &e) {
+            close(dir);
+            throw;
+        }
+        close(dir);
+    }
+
+    // Removes the directory's contents from lower layers
+    void clearDir(const std::string& dirRel) {
+        int dir = openDir(rootFd, dirRel, false);
+        if (dir < 0)
+            return;
+        try {
+            for (auto& name: listDir(dir, dirRel)) {
+                std::string rel = dirRel.empty() ? name : dirRel + "/" + name;
+                if (created.count(rel))
+                    continue;
+                if (containsAny(rel, keep)) {
+                    tulog.debug("Not removing protected path /", rel);
+                    continue;
+                }
+                remove(dir, name);
+            }
+        } catch (const std::exception &e) {
+            close(dir);
+            throw;
+        }
+        close(dir);
+    }
+
+    void applyEntry(TarReader& reader, const TarReader::Entry& entry) {
+        std::string rel = layerPath(entry.path);
+        if (rel.empty())
+            return;
+        bool mergeOnly = false;
+        if (isBelowAny(rel, keep)) {
+            if (!isBelowAny(rel, merge))
+                return;
+            mergeOnly = true;
+        }
+
+        std::filesystem::path relPath{rel};
+        std::string name = relPath.filename();
+        if (name.rfind(WHITEOUT_PREFIX, 0) == 0) {
+            if (mergeOnly)
+                return;
+            if (name == OPAQUE_WHITEOUT)
+                clearDir(relPath.parent_path());
+            else
+                removeWhiteout(relPath.parent_path() / name.substr(WHITEOUT_PREFIX.length()));
+            return;
+        }
+
+        int dir = getParent(rel);
+        struct stat st;
+        bool exists = fstatat(dir, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0;
+        if (!exists && errno != ENOENT)
+            throw fileError("Reading", root / rel);
+        if (mergeOnly && exists)
+            return;
+        if (exists && !(S_ISDIR(st.st_mode) && entry.type == TarReader::Type::Directory)) {
+            remove(dir, name);
+            dir = getParent(rel);
+            exists = false;
+        }
+        created.insert(rel);
+        if (changes) {
+            bool inNewDir = newDirs.count(relPath.parent_path());
+            bool newDir = !exists && entry.type == TarReader::Type::Directory;
+            if (newDir)
+                newDirs.insert(rel);
+            if (!inNewDir)
+                changes->push_back({rel, newDir});
+        }
+
+        switch (entry.type) {
+        case TarReader::Type::Directory:
+            if (!exists && mkdirat(dir, name.c_str(), 0700) < 0)
+                throw fileError("Creating", root / rel);
+            dirTimes.emplace_back(rel, entry.mtime);
+            break;
+        case TarReader::Type::Regular: {
+            int out = openat(dir, name.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+            if (out < 0)
+                throw fileError("Creating", root / rel);
+            try {
+                reader.copyData(out);
+            } catch (const std::exception &e) {
+                close(out);
+                throw;
+            }
+            if (close(out) < 0)
+                throw fileError("Writing", root / rel);
+            break;
+        }
+        case TarReader::Type::HardLink: {
+            // Shares the inode and thus all attributes with the link target
+            std::filesystem::path target{layerPath(entry.linkTarget)};
+            int targetDir = openDir(rootFd, target.parent_path(), false);
+            if (targetDir < 0)
+                throw fileError("Opening", root / target.parent_path());
+            int rc = linkat(targetDir, target.filename().c_str(), dir, name.c_str(), 0);
+            int err = errno;
+            close(targetDir);
+            if (rc < 0)
+                throw fileError("Linking", root / rel, err);
+            return;
+        }
+        case TarReader::Type::Symlink:
+            if (symlinkat(entry.linkTarget.c_str(), dir, name.c_str()) < 0)
+                throw fileError("Creating link", root / rel);
+            break;
+        case TarReader::Type::CharDevice:
+        case TarReader::Type::BlockDevice:
+        case TarReader::Type::Fifo: {
+            mode_t type = entry.type == TarReader::Type::CharDevice ? S_IFCHR :
+                          entry.type == TarReader::Type::BlockDevice ? S_IFBLK : S_IFIFO;
+            if (mknodat(dir, name.c_str(), type | 0600, makedev(entry.devMajor, entry.devMinor)) < 0)
+                throw fileError("Creating", root / rel);
+            break;
+        }
+        }
+
+        // Ownership first, as changing it resets setuid bits and file capabilities
+        if (fchownat(dir, name.c_str(), entry.uid, entry.gid, AT_SYMLINK_NOFOLLOW) < 0)
+            throw fileError("Changing owner of", root / rel);
+        if (entry.type != TarReader::Type::Symlink && fchmodat(dir, name.c_str(), entry.mode, 0) < 0)
+            throw fileError("Changing permissions of", root / rel);
+        // Includes ACLs (system.posix_acl_*) and SELinux labels (security.selinux)
+        std::string procPath = "/proc/self/fd/" + std::to_string(dir) + "/" + name;
+        for (auto& [key, value]: entry.xattrs) {
+            if (lsetxattr(procPath.c_str(), key.c_str(), value.data(), value.size(), 0) < 0)
+                throw fileError("Setting extended attribute " + key + " of", root / rel);
+        }
+        if (entry.type != TarReader::Type::Directory) {
+            struct timespec times[2] = {entry.mtime, entry.mtime};
+            if (utimensat(dir, name.c_str(), times, AT_SYMLINK_NOFOLLOW) < 0)
+                throw fileError("Setting timestamps of", root / rel);
+        }
+    }
+};
+
+static std::string readFile(std::filesystem::path file) {
+    std::ifstream in{file, std::ios::binary};
+    if (!in)
+        throw std::runtime_error{"Could not open '" + file.string() + "'."};
+    std::stringstream content;
+    content << in.rdbuf();
+    return content.str();
+}
+
+// Maps the kernel's machine name to the GOARCH names used in OCI image indexes
+static std::string hostArchitecture() {
+    struct utsname name;
+    if (uname(&name) < 0)
+        return "";
+    std::string machine = name.machine;
+    if (machine == "x86_64")
+        return "amd64";
+    if (machine == "aarch64")
+        return "arm64";
+    if (machine == "i386" || machine == "i586" || machine == "i686")
+        return "386";
+    if (machine.rfind("arm", 0) == 0)
+        return "arm";
+    return machine;
+}
+
+static bool isIndex(const std::string& mediaType) {
+    return mediaType == "application/vnd.oci.image.index.v1+json"
+        || mediaType == "application/vnd.docker.distribution.manifest.list.v2+json";
+}
+
+// SHA-256 (FIPS 180-4) for checking the digests of blobs
+class Sha256
+{
+public:
+    void update(const unsigned char* data, size_t len) {
+        length += len;
+        if (buffered > 0) {
+            size_t fill = std::min(len, sizeof(buffer) - buffered);
+            std::memcpy(buffer + buffered, data, fill);
+            buffered += fill;
+            data += fill;
+            len -= fill;
+            if (buffered < sizeof(buffer))
+                return;
+            transform(buffer);
+            buffered = 0;
+        }
+        for (; len >= sizeof(buffer); data += sizeof(buffer), len -= sizeof(buffer))
+            transform(data);
+        std::memcpy(buffer, data, len);
+        buffered = len;
+    }
+    std::string hexDigest() {
+        uint64_t bits = length * 8;
+        unsigned char pad[sizeof(buffer) + 8] = {0x80};
+        size_t padLen = (buffered < 56 ? 56 : 120) - buffered;
+        for (int i = 0; i < 8; i++)
+            pad[padLen + i] = bits >> (56 - 8 * i);
+        update(pad, padLen + 8);
+        static const char hex[] = "0123456789abcdef";
+        std::string result;
+        for (uint32_t word: state) {
+            for (int shift = 28; shift >= 0; shift -= 4)
+                result += hex[(word >> shift) & 0xf];
+        }
+        return result;
+    }
+private:
+    uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                         0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    unsigned char buffer[64];
+    size_t buffered = 0;
+    uint64_t length = 0;
+
+    static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+    void transform(const unsigned char* block) {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++)
+            w[i] = uint32_t(block[4 * i]) << 24 | uint32_t(block[4 * i + 1]) << 16
+                | uint32_t(block[4 * i + 2]) << 8 | block[4 * i + 3];
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+};
+
+static void checkDigest(const std::string& digest, Sha256& hash) {
+    if (digest.rfind("sha256:", 0) != 0)
+        throw std::runtime_error{"Unsupported digest algorithm in '" + digest + "'."};
+    std::string actual = "sha256:" + hash.hexDigest();
+    if (actual != digest)
+        throw std::runtime_error{"Blob " + digest + " is corrupted, its digest is " + actual + "."};
+}
+
+static std::string blobPath(const std::string& digest) {
+    size_t colon = digest.find(':');
+    if (colon == std::string::npos || colon == 0 || colon + 1 == digest.length()
+            || digest.find_first_of("/.", 0) != std::string::npos)
+        throw std::runtime_error{"Invalid digest '" + digest + "'."};
+    return "blobs/" + digest.substr(0, colon) + "/" + digest.substr(colon + 1);
+}
+
+OciImage::OciImage(std::filesystem::path location, std::string tag, bool archive): location{location}, archive{archive} {
+    if (archive) {
+        // The archive is an uncompressed tar file of an OCI layout
+        int fd = open(location.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            throw std::runtime_error{"Could not open '" + location.string() + "': " + strerror(errno)};
+        try {
+            TarReader reader{fd};
+            TarReader::Entry entry;
+            while (reader.next(entry)) {
+                if (entry.type == TarReader::Type::Regular)
+                    members[normalize(entry.path)] = {reader.getDataOffset(), entry.size};
+            }
+        } catch (const std::exception &e) {
+            close(fd);
+            throw;
+        }
+        close(fd);
+    }
+
+    Json index = Json::parse(readFile("index.json"));
+    std::string arch = hostArchitecture();
+
+    // Nested indexes (e.g. multi-arch images) are resolved by platform
+    for (int level = 0; level < 4; level++) {
+        const Json* selected = nullptr;
+        for (auto& descriptor: index["manifests"].asArray()) {
+            if (level == 0 && !tag.empty()) {
+                const Json& annotations = descriptor["annotations"];
+                if (annotations.isNull())
+                    continue;
+                const Json& ref = annotations["org.opencontainers.image.ref.name"];
+                if (ref.isNull())
+                    continue;
+                const std::string& name = ref.asString();
+                if (name != tag && (name.length() <= tag.length()
+                        || name.compare(name.length() - tag.length() - 1, std::string::npos, ":" + tag) != 0))
+                    continue;
+            } else {
+                const Json& platform = descriptor["platform"];
+                if (!platform.isNull() && !platform["architecture"].isNull()
+                        && platform["architecture"].asString() != arch)
+                    continue;
+            }
+            selected = &descriptor;
+            break;
+        }
+        if (selected == nullptr)
+            throw std::runtime_error{"No matching image found in OCI image '" + location.string()
+                + (tag.empty() ? "" : ":" + tag) + "'."};
+
+        std::string descriptorDigest = (*selected)["digest"].asString();
+        const Json& mediaType = (*selected)["mediaType"];
+        std::string data = readFile(blobPath(descriptorDigest));
+        Sha256 hash;
+        hash.update(reinterpret_cast<const unsigned char*>(data.data()), data.length());
+        checkDigest(descriptorDigest, hash);
+        Json content = Json::parse(data);
+        if ((!mediaType.isNull() && isIndex(mediaType.asString())) || content.has("manifests")) {
+            index = std::move(content);
+            continue;
+        }
+
+        digest = descriptorDigest;
+        for (auto& layer: content["layers"].asArray()) {
+            layers.push_back({layer["digest"].asString(),
+                layer["mediaType"].isNull() ? "" : layer["mediaType"].asString()});
+        }
+        return;
+    }
+    throw std::runtime_error{"OCI image index in '" + location.string() + "' is nested too deeply."};
+}
+
+bool OciImage::isReference(const std::string& reference) {
+    return reference.rfind("oci:", 0) == 0 || reference.rfind("oci-archive:", 0) == 0;
+}
+
+OciImage OciImage::fromReference(const std::string& reference) {
+    bool archive = reference.rfind("oci-archive:", 0) == 0;
+    std::string location = reference.substr(reference.find(':') + 1);
+    size_t colon = location.rfind(':');
+    if (colon == std::string::npos || location.find('/', colon) != std::string::npos)
+        return OciImage{location, "", archive};
+    return OciImage{location.substr(0, colon), location.substr(colon + 1), archive};
+}
+
+const std::string& OciImage::getDigest() const {
+    return digest;
+}
+
+const std::vector<OciImage::Layer>& OciImage::getLayers() const {
+    return layers;
+}
+
+std::string OciImage::readFile(const std::string& rel) const {
+    if (!archive)
+        return TransactionalUpdate::readFile(location / rel);
+    auto member = members.find(rel);
+    if (member == members.end())
+        throw std::runtime_error{"'" + rel + "' not found in '" + location.string() + "'."};
+    int fd = open(location.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw fileError("Opening", location);
+    std::string content(member->second.second, '\0');
+    ssize_t len = pread(fd, content.data(), content.size(), member->second.first);
+    int err = errno;
+    close(fd);
+    if (len < 0 || static_cast<size_t>(len) != content.size())
+        throw fileError("Reading", location / rel, len < 0 ? err : EIO);
+    return content;
+}
+
+// Checks the size bytes at the fd's current position against the digest
+static void verifyBlob(int fd, uint64_t size, const std::string& digest) {
+    Sha256 hash;
+    std::vector<unsigned char> buf(1024 * 1024);
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    while (size > 0) {
+        ssize_t len = pread(fd, buf.data(), std::min<uint64_t>(size, buf.size()), offset);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            throw fileError("Reading blob", digest, len < 0 ? errno : EIO);
+        hash.update(buf.data(), len);
+        offset += len;
+        size -= len;
+    }
+    checkDigest(digest, hash);
+}
+
+int OciImage::openBlob(const std::string& digest, uint64_t& size) const {
+    std::string rel = blobPath(digest);
+    std::filesystem::path file = archive ? location : location / rel;
+    int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw fileError("Opening", file);
+    if (!archive) {
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            int err = errno;
+            close(fd);
+            throw fileError("Reading", file, err);
+        }
+        size = st.st_size;
+        return fd;
+    }
+    auto member = members.find(rel);
+    if (member == members.end()) {
+        close(fd);
+        throw std::runtime_error{"'" + rel + "' not found in '" + location.string() + "'."};
+    }
+    if (lseek(fd, member->second.first, SEEK_SET) < 0) {
+        int err = errno;
+        close(fd);
+        throw fileError("Reading", file, err);
+    }
+    size = member->second.second;
+    return fd;
+}
+
+static int waitChild(pid_t pid) {
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR)
+            return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+void OciImage::applyLayer(const Layer& layer, std::filesystem::path root,
+                          const std::vector<std::filesystem::path>& keep,
+                          const std::vector<std::filesystem::path>& merge,
+                          std::vector<Sync::Change>* changes) const {
+    LayerWriter writer{root, normalizeAll(keep), normalizeAll(merge), changes};
+    uint64_t size;
+    int blob = openBlob(layer.digest, size);
+
+    // Layer data is streamed without ever passing user space, so the digest has to be
+    // checked up front; nothing of a corrupted layer may be applied
+    unsigned char magic[4] = {};
+    try {
+        verifyBlob(blob, size, layer.digest);
+        if (pread(blob, magic, sizeof(magic), lseek(blob, 0, SEEK_CUR)) < 0)
+            throw fileError("Reading layer", layer.digest);
+    } catch (const std::exception &e) {
+        close(blob);
+        throw;
+    }
+
+    // Compression is detected by its magic number, the media types aren't reliable
+    const char* decompressor = nullptr;
+    if (magic[0] == 0x1f && magic[1] == 0x8b)
+        decompressor = "gzip";
+    else if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+        decompressor = "zstd";
+
+    if (decompressor == nullptr) {
+        try {
+            TarReader reader{blob, size};
+            writer.apply(reader);
+        } catch (const std::exception &e) {
+            close(blob);
+            throw;
+        }
+        close(blob);
+        return;
+    }
+
+    // Archive members are passed on by a separate process, which only
+    // forwards the member's bytes
+    int input = blob;
+    pid_t feeder = 0;
+    if (archive) {
+        int feed[2];
+        if (pipe2(feed, O_CLOEXEC) < 0) {
+            close(blob);
+            throw std::runtime_error{"Error opening pipe for layer data: " + std::string(strerror(errno))};
+        }
+        feeder = fork();
+        if (feeder < 0) {
+            close(blob);
+            close(feed[0]);
+            close(feed[1]);
+            throw std::runtime_error{"fork() failed: " + std::string(strerror(errno))};
+        } else if (feeder == 0) {
+            uint64_t remaining = size;
+            while (remaining > 0) {
+                ssize_t len = splice(blob, nullptr, feed[1], nullptr, remaining, 0);
+                if (len < 0 && errno == EINTR)
+                    continue;
+                if (len <= 0)
+                    _exit(1);
+                remaining -= len;
+            }
+            _exit(0);
+        }
+        close(feed[1]);
+        close(blob);
+        input = feed[0];
+    }
+
+    int output[2];
+    if (pipe2(output, O_CLOEXEC) < 0) {
+        close(input);
+        throw std::runtime_error{"Error opening pipe for layer data: " + std::string(strerror(errno))};
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(input);
+        close(output[0]);
+        close(output[1]);
+        throw std::runtime_error{"fork() failed: " + std::string(strerror(errno))};
+    } else if (pid == 0) {
+        if (dup2(input, STDIN_FILENO) < 0 || dup2(output[1], STDOUT_FILENO) < 0)
+            _exit(errno);
+        execlp(decompressor, decompressor, "-dc", nullptr);
+        tulog.error("Calling " + std::string(decompressor) + " failed: " + std::string(strerror(errno)));
+        _exit(errno);
+    }
+    close(input);
+    close(output[1]);
+
+    try {
+        TarReader reader{output[0]};
+        writer.apply(reader);
+        // Consume the remaining padding, so the decompressor can exit cleanly
+        char buf[4096];
+        while (read(output[0], buf, sizeof(buf)) > 0) {}
+    } catch (const std::exception &e) {
+        close(output[0]);
+        kill(pid, SIGTERM);
+        waitChild(pid);
+        if (feeder > 0) {
+            kill(feeder, SIGTERM);
+            waitChild(feeder);
+        }
+        throw;
+    }
+    close(output[0]);
+    int rc = waitChild(pid);
+    if (feeder > 0 && waitChild(feeder) != 0)
+        throw std::runtime_error{"Reading layer " + layer.digest + " from '" + location.string() + "' failed."};
+    if (rc != 0)
+        throw std::runtime_error{"Decompressing layer " + layer.digest + " with " + decompressor + " failed."};
+}
+
+bool OciImage::apply(std::filesystem::path root, const std::vector<std::string>& applied,
+                     const std::vector<std::filesystem::path>& keep, std::vector<Sync::Change>& changes) const {
+    size_t common = 0;
+    while (common < applied.size() && common < layers.size() && applied[common] == layers[common].digest)
+        common++;
+    bool incremental = !applied.empty() && common == applied.size();
+    if (incremental) {
+        tulog.info("Applying ", layers.size() - common, " of ", layers.size(), " layers.");
+    } else {
+        common = 0;
+        tulog.info("Applying all ", layers.size(), " layers.");
+        clear(root, keep);
+        changes.push_back({"", true});
+    }
+    for (size_t i = common; i < layers.size(); i++) {
+        tulog.debug("Applying layer ", layers[i].digest);
+        applyLayer(layers[i], root, keep, {"etc"}, incremental ? &changes : nullptr);
+    }
+    return incremental;
+}
+
+static void clearExcept(int dir, const std::string& rel, const std::vector<std::string>& keep) {
+    for (auto& name: listDir(dir, rel)) {
+        std::string childRel = rel.empty() ? name : rel + "/" + name;
+        if (!containsAny(childRel, keep)) {
+            removeAt(dir, name);
+            continue;
+        }
+        if (isBelowAny(childRel, keep))
+            continue;
+        // A parent of a kept path
+        int child = openat(dir, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (child < 0)
+            throw fileError("Opening", childRel);
+        try {
+            clearExcept(child, childRel, keep);
+        } catch (const std::exception &e) {
+            close(child);
+            throw;
+        }
+        close(child);
+    }
+}
+
+void OciImage::clear(std::filesystem::path root, const std::vector<std::filesystem::path>& keep) {
+    int fd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        throw fileError("Opening", root);
+    try {
+        clearExcept(fd, "", normalizeAll(keep));
+    } catch (const std::exception &e) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+}
+
+OciImage::Record OciImage::getRecord() const {
+    Record record;
+    record.manifest = digest;
+    for (auto& layer: layers)
+        record.layers.push_back(layer.digest);
+    return record;
+}
+
+OciImage::Record OciImage::readRecord(std::filesystem::path file) {
+    Record record;
+    std::ifstream in{file};
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.rfind("manifest ", 0) == 0)
+            record.manifest = line.substr(9);
+        else if (line.rfind("layer ", 0) == 0)
+            record.layers.push_back(line.substr(6));
+    }
+    return record;
+}
+
+void OciImage::writeRecord(std::filesystem::path file, const Record& record) {
+    std::filesystem::path tmp = file;
+    tmp += ".tmp";
+    {
+        std::ofstream out{tmp, std::ios::trunc};
+        out << "manifest " << record.manifest << "\n";
+        for (auto& layer: record.layers)
+            out << "layer " << layer << "\n";
+        if (!out)
+            throw std::runtime_error{"Could not write '" + tmp.string() + "'."};
+    }
+    std::filesystem::rename(tmp, file);
+}
+
+} // namespace TransactionalUpdate
@@ -0,0 +1,78 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Reads images from a local OCI image layout directory or an oci-archive
+  and streams their layer tarballs (including whiteouts) onto a root file
+  system.
+ */
+
+#ifndef T_U_OCIIMAGE_H
+#define T_U_OCIIMAGE_H
+
+#include "Sync.hpp"
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace TransactionalUpdate {
+
+class OciImage
+{
+public:
+    struct Layer {
+        std::string digest;
+        std::string mediaType;
+    };
+    // Manifest and layer digests applied to a snapshot
+    struct Record {
+        std::string manifest;
+        std::vector<std::string> layers;
+    };
+    // Selects the manifest by its "org.opencontainers.image.ref.name"
+    // annotation, or the first one for the host architecture if tag is empty
+    OciImage(std::filesystem::path location, std::string tag = "", bool archive = false);
+    // Parses "oci:<layout directory>[:<tag>]" and "oci-archive:<file>[:<tag>]" references
+    static OciImage fromReference(const std::string& reference);
+    static bool isReference(const std::string& reference);
+    const std::string& getDigest() const;
+    const std::vector<Layer>& getLayers() const;
+    // Streams the layer's files into root and applies its whiteouts. Entries
+    // below paths in keep are skipped, unless they are also below a path in
+    // merge; those are only created if they don't exist yet.
+    // The written entries are appended to changes if given.
+    void applyLayer(const Layer& layer, std::filesystem::path root,
+                    const std::vector<std::filesystem::path>& keep = {},
+                    const std::vector<std::filesystem::path>& merge = {},
+                    std::vector<Sync::Change>* changes = nullptr) const;
+    // Applies the image to root, which was built from the applied layers: if
+    // those are still the image's bottom layers only the layers on top are
+    // applied, otherwise root is cleared first. Paths in keep are handled as
+    // for applyLayer, with new files being merged into /etc.
+    // The written entries are appended to changes; returns false if all
+    // layers had to be applied.
+    bool apply(std::filesystem::path root, const std::vector<std::string>& applied,
+               const std::vector<std::filesystem::path>& keep, std::vector<Sync::Change>& changes) const;
+    // Removes everything from root except the paths in keep
+    static void clear(std::filesystem::path root, const std::vector<std::filesystem::path>& keep = {});
+    Record getRecord() const;
+    static Record readRecord(std::filesystem::path file);
+    static void writeRecord(std::filesystem::path file, const Record& record);
+private:
+    std::filesystem::path location;
+    bool archive;
+    // Offset and size of the archive's members
+    std::map<std::string, std::pair<uint64_t, uint64_t>> members;
+    std::string digest;
+    std::vector<Layer> layers;
+    std::string readFile(const std::string& rel) const;
+    // Returns a file descriptor positioned at the start of the blob
+    int openBlob(const std::string& digest, uint64_t& size) const;
+};
+
+} // namespace TransactionalUpdate
+
+#endif // T_U_OCIIMAGE_H
@@ -10,6 +10,8 @@
 #define T_U_SNAPSHOT_H
 
 #include <filesystem>
+#include <map>
+#include <optional>
 #include <string>
 
 namespace TransactionalUpdate {
@@ -25,6 +27,10 @@ public:
     virtual bool isReadOnly() = 0;
     virtual void setDefault() = 0;
     virtual void setReadOnly(bool readonly) = 0;
+    // Changes the description (if not empty), userdata and cleanup algorithm (if set, an empty
+    // value disables the cleanup); userdata keys with an empty value are removed
+    virtual void modify(std::string description, std::map<std::string, std::string> userdata,
+                        std::optional<std::string> cleanup = std::nullopt) = 0;
     std::string getUid() { return snapshotId; }
 protected:
     std::string snapshotId;
@@ -0,0 +1,408 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Native btrfs backend for snapshot handling
+ */
+
+#include "Btrfs.hpp"
+#include "Snapper.hpp"
+#include "Log.hpp"
+#include "SnapshotPool.hpp"
+#include "SnapshotUsage.hpp"
+#include "Subvolume.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <pwd.h>
+#include <sstream>
+#include <sys/stat.h>
+
+namespace TransactionalUpdate {
+
+static const std::filesystem::path snapshotsDir{"/.snapshots"};
+
+/* SnapshotManager methods */
+
+std::unique_ptr<Snapshot> Btrfs::create(std::string base, std::string description) {
+    if (! std::filesystem::exists(snapshotsDir / base / "snapshot"))
+        throw std::invalid_argument{"Base snapshot '" + base + "' does not exist."};
+
+    // Use the next free number after the highest existing snapshot, just as snapper does
+    auto ids = getSnapshotIds();
+    unsigned long number = ids.empty() ? 1 : std::stoul(ids.back()) + 1;
+    while (mkdir((snapshotsDir / std::to_string(number)).c_str(), 0755) != 0) {
+        if (errno != EEXIST)
+            throw std::runtime_error{"Creating snapshot directory for #" + std::to_string(number) + " failed: " + std::string(strerror(errno))};
+        number++;
+    }
+    std::string id = std::to_string(number);
+    std::filesystem::path root = snapshotsDir / id / "snapshot";
+
+    char date[20];
+    time_t now = time(nullptr);
+    struct tm tm;
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", gmtime_r(&now, &tm));
+
+    Info info;
+    info.num = id;
+    info.date = date;
+    info.description = description;
+    info.cleanup = "number";
+    info.userdata["transactional-update-in-progress"] = "yes";
+
+    try {
+        Subvolume{snapshotsDir / base / "snapshot"}.snapshot(root);
+        writeInfo(info);
+    } catch (const std::exception &e) {
+        if (std::filesystem::exists(root))
+            Subvolume::remove(root);
+        std::filesystem::remove_all(snapshotsDir / id);
+        throw;
+    }
+    return std::make_unique<Btrfs>(id);
+}
+
+std::unique_ptr<Snapshot> Btrfs::open(std::string id) {
+    if (! std::filesystem::exists(snapshotsDir / id / "snapshot"))
+        throw std::invalid_argument{"Snapshot " + id + " does not exist."};
+    return std::make_unique<Btrfs>(id);
+}
+
+SnapshotTable Btrfs::getList(std::string columns) {
+    if (columns.empty())
+        columns="number,date,description";
+    std::string requested = columns;
+    columns = SnapshotUsage::getBaseColumns(requested);
+    std::vector<std::string> fields;
+    std::stringstream columnsStream(columns);
+    for (std::string field; std::getline(columnsStream, field, ','); ) {
+        static const std::vector<std::string> supported = {"number", "type", "pre-number", "date", "user",
+            "cleanup", "description", "userdata", "default", "active", "read-only"};
+        if (std::find(supported.begin(), supported.end(), field) == supported.end())
+            throw std::invalid_argument{"Column '" + field + "' is not supported by the btrfs snapshot manager."};
+        fields.push_back(field);
+    }
+    SnapshotTable snapshotList{fields};
+
+    std::string defaultId, currentId;
+    if (std::find(fields.begin(), fields.end(), "default") != fields.end())
+        defaultId = getDefault();
+    if (std::find(fields.begin(), fields.end(), "active") != fields.end())
+        currentId = getCurrent();
+
+    // Snapper always lists the current file system as snapshot 0
+    auto ids = getSnapshotIds();
+    ids.insert(ids.begin(), "0");
+    for (auto& id: ids) {
+        Info info;
+        if (id == "0") {
+            info.num = id;
+            info.description = "current";
+            info.uid = "0";
+        } else {
+            try {
+                info = readInfo(id);
+            } catch (const std::exception &e) {
+                tulog.debug("Skipping snapshot ", id, ": ", e.what());
+                continue;
+            }
+        }
+
+        for (auto& field: fields) {
+            std::string value;
+            if (field == "number") {
+                value = info.num;
+            } else if (field == "type") {
+                value = info.type;
+            } else if (field == "pre-number") {
+                value = info.preNum;
+            } else if (field == "date") {
+                value = info.date;
+            } else if (field == "user") {
+                struct passwd* pw = getpwuid(info.uid.empty() ? 0 : std::stoul(info.uid));
+                value = pw ? pw->pw_name : info.uid;
+            } else if (field == "cleanup") {
+                value = info.cleanup;
+            } else if (field == "description") {
+                value = info.description;
+            } else if (field == "userdata") {
+                for (auto& [key, val]: info.userdata) {
+                    if (!value.empty())
+                        value += ", ";
+                    value += key + "=" + val;
+                }
+            } else if (field == "default") {
+                value = (id == defaultId) ? "yes" : "no";
+            } else if (field == "active") {
+                value = (id == currentId) ? "yes" : "no";
+            } else if (field == "read-only") {
+                value = (id != "0" && Subvolume{snapshotsDir / id / "snapshot"}.isReadOnly()) ? "yes" : "no";
+            }
+            snapshotList.append(value);
+        }
+    }
+    return SnapshotUsage::addColumns(std::move(snapshotList), requested, snapshotsDir);
+}
+
+std::string Btrfs::getCurrent() {
+    // The snapshot layout is the same as snapper's, and so is the way to find the running one
+    return Snapper{}.getCurrent();
+}
+
+std::string Btrfs::getDefault() {
+    uint64_t defaultId = Subvolume::getDefaultId(snapshotsDir);
+    for (auto& id: getSnapshotIds()) {
+        try {
+            if (Subvolume{snapshotsDir / id / "snapshot"}.getId() == defaultId)
+                return id;
+        } catch (const std::exception &e) {
+            tulog.debug("Skipping snapshot ", id, ": ", e.what());
+        }
+    }
+    throw std::runtime_error{"Couldn't determine default snapshot number"};
+}
+
+void Btrfs::deleteSnap(std::string id) {
+    deleteSnaps({id});
+}
+
+void Btrfs::deleteSnaps(std::vector<std::string> ids, bool wait) {
+    if (ids.empty())
+        return;
+    std::string defaultId = getDefault();
+    std::string currentId = getCurrent();
+    for (auto& id: ids) {
+        if (id == defaultId)
+            throw std::invalid_argument{"Cannot delete snapshot " + id + " as it is the default snapshot."};
+        if (id == currentId)
+            throw std::invalid_argument{"Cannot delete snapshot " + id + " as it is the currently mounted snapshot."};
+        if (id.empty() || ! std::all_of(id.begin(), id.end(), ::isdigit) || ! std::filesystem::exists(snapshotsDir / id / "snapshot"))
+            throw std::invalid_argument{"Snapshot " + id + " does not exist."};
+    }
+
+    for (auto& id: ids) {
+        Subvolume::remove(snapshotsDir / id / "snapshot");
+        std::filesystem::remove_all(snapshotsDir / id);
+    }
+    if (wait)
+        Subvolume::waitForCleanup(snapshotsDir);
+}
+
+bool Btrfs::isCleanupPending(bool wait) {
+    if (wait)
+        Subvolume::waitForCleanup(snapshotsDir);
+    return !Subvolume::getDeletedIds(snapshotsDir).empty();
+}
+
+std::string Btrfs::rollbackTo(std::string id) {
+    if (! std::filesystem::exists(snapshotsDir / id / "snapshot"))
+        throw std::invalid_argument{"Snapshot " + id + " does not exist."};
+    if (SnapshotPool::getSize(*this) > 0 && SnapshotPool{*this}.isEntry(id))
+        throw std::invalid_argument{"Snapshot " + id + " is part of the snapshot pool and cannot be used for a rollback."};
+
+    // On read-only systems the snapshot can be booted directly, otherwise boot into a
+    // writable copy to keep the original snapshot intact
+    std::string newDefault = id;
+    Btrfs defaultSnap{getDefault()};
+    if (defaultSnap.isReadOnly()) {
+        Btrfs{id}.setDefault();
+    } else {
+        std::unique_ptr<Snapshot> snap = create(id, "Rollback to snapshot " + id);
+        snap->close();
+        snap->setDefault();
+        newDefault = snap->getUid();
+    }
+
+    if (SnapshotPool::getSize(*this) > 0)
+        SnapshotPool{*this}.updateInBackground(newDefault);
+    return newDefault;
+}
+
+/* Snapshot methods */
+
+void Btrfs::close() {
+    modify("", {{"transactional-update-in-progress", ""}});
+}
+
+void Btrfs::abort() {
+    Subvolume::remove(getRoot());
+    std::filesystem::remove_all(snapshotsDir / snapshotId);
+}
+
+std::filesystem::path Btrfs::getRoot() {
+    return snapshotsDir / snapshotId / "snapshot";
+}
+
+bool Btrfs::isInProgress() {
+    Info info = readInfo(snapshotId);
+    auto it = info.userdata.find("transactional-update-in-progress");
+    return it != info.userdata.end() && it->second == "yes";
+}
+
+bool Btrfs::isReadOnly() {
+    return Subvolume{getRoot()}.isReadOnly();
+}
+
+void Btrfs::setDefault() {
+    Subvolume{getRoot()}.setDefault();
+}
+
+void Btrfs::setReadOnly(bool readonly) {
+    Subvolume{getRoot()}.setReadOnly(readonly);
+}
+
+void Btrfs::modify(std::string description, std::map<std::string, std::string> userdata,
+                   std::optional<std::string> cleanup) {
+    Info info = readInfo(snapshotId);
+    if (!description.empty())
+        info.description = description;
+    if (cleanup)
+        info.cleanup = *cleanup;
+    for (auto& [key, value]: userdata) {
+        if (value.empty())
+            info.userdata.erase(key);
+        else
+            info.userdata[key] = value;
+    }
+    writeInfo(info);
+}
+
+/* Helper methods */
+
+static std::string xmlEscape(const std::string& s) {
+    std::string escaped;
+    for (char c: s) {
+        switch (c) {
+        case '&': escaped += "&amp;"; break;
+        case '<': escaped += "&lt;"; break;
+        case '>': escaped += "&gt;"; break;
+        case '"': escaped += "&quot;"; break;
+        case '\'': escaped += "&apos;"; break;
+        default: escaped += c;
+        }
+    }
+    return escaped;
+}
+
+static std::string xmlUnescape(const std::string& s) {
+    static const std::vector<std::pair<std::string, char>> entities = {
+        {"&amp;", '&'}, {"&lt;", '<'}, {"&gt;", '>'}, {"&quot;", '"'}, {"&apos;", '\''}
+    };
+    std::string unescaped;
+    for (size_t i = 0; i < s.length(); i++) {
+        bool replaced = false;
+        if (s[i] == '&') {
+            for (auto& [entity, c]: entities) {
+                if (s.compare(i, entity.length(), entity) == 0) {
+                    unescaped += c;
+                    i += entity.length() - 1;
+                    replaced = true;
+                    break;
+                }
+            }
+        }
+        if (!replaced)
+            unescaped += s[i];
+    }
+    return unescaped;
+}
+
+// Returns the content of the next <tag> element within [pos, end) and moves pos behind it
+static std::string xmlElement(const std::string& xml, const std::string& tag, size_t& pos, size_t end = std::string::npos) {
+    size_t start = xml.find("<" + tag + ">", pos);
+    if (start == std::string::npos || start >= end)
+        return "";
+    start += tag.length() + 2;
+    size_t stop = xml.find("</" + tag + ">", start);
+    if (stop == std::string::npos || stop > end)
+        throw std::runtime_error{"Unterminated element <" + tag + ">."};
+    pos = stop + tag.length() + 3;
+    return xmlUnescape(xml.substr(start, stop - start));
+}
+
+Btrfs::Info Btrfs::readInfo(std::string id) {
+    std::ifstream file(snapshotsDir / id / "info.xml");
+    if (!file)
+        throw std::runtime_error{"Reading info.xml of snapshot " + id + " failed."};
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    std::string xml = buffer.str();
+
+    Info info;
+    size_t pos = 0;
+    info.type = xmlElement(xml, "type", pos = 0);
+    info.num = xmlElement(xml, "num", pos = 0);
+    info.date = xmlElement(xml, "date", pos = 0);
+    info.uid = xmlElement(xml, "uid", pos = 0);
+    info.preNum = xmlElement(xml, "pre_num", pos = 0);
+    info.description = xmlElement(xml, "description", pos = 0);
+    info.cleanup = xmlElement(xml, "cleanup", pos = 0);
+    for (pos = xml.find("<userdata>"); pos != std::string::npos; pos = xml.find("<userdata>", pos)) {
+        size_t end = xml.find("</userdata>", pos);
+        if (end == std::string::npos)
+            throw std::runtime_error{"Unterminated userdata in info.xml of snapshot " + id + "."};
+        std::string key = xmlElement(xml, "key", pos, end);
+        std::string value = xmlElement(xml, "value", pos, end);
+        if (!key.empty())
+            info.userdata[key] = value;
+        pos = end;
+    }
+    if (info.num != id)
+        throw std::runtime_error{"info.xml of snapshot " + id + " belongs to snapshot '" + info.num + "'."};
+    return info;
+}
+
+void Btrfs::writeInfo(const Info& info) {
+    std::stringstream xml;
+    xml << "<?xml version=\"1.0\"?>\n";
+    xml << "<snapshot>\n";
+    xml << "  <type>" << xmlEscape(info.type) << "</type>\n";
+    xml << "  <num>" << xmlEscape(info.num) << "</num>\n";
+    if (!info.preNum.empty())
+        xml << "  <pre_num>" << xmlEscape(info.preNum) << "</pre_num>\n";
+    xml << "  <date>" << xmlEscape(info.date) << "</date>\n";
+    if (!info.uid.empty())
+        xml << "  <uid>" << xmlEscape(info.uid) << "</uid>\n";
+    if (!info.description.empty())
+        xml << "  <description>" << xmlEscape(info.description) << "</description>\n";
+    if (!info.cleanup.empty())
+        xml << "  <cleanup>" << xmlEscape(info.cleanup) << "</cleanup>\n";
+    for (auto& [key, value]: info.userdata) {
+        xml << "  <userdata>\n";
+        xml << "    <key>" << xmlEscape(key) << "</key>\n";
+        xml << "    <value>" << xmlEscape(value) << "</value>\n";
+        xml << "  </userdata>\n";
+    }
+    xml << "</snapshot>\n";
+
+    // Write atomically, snapper must never see a partial file
+    std::filesystem::path target = snapshotsDir / info.num / "info.xml";
+    std::filesystem::path tmp = target;
+    tmp += ".tmp";
+    std::ofstream file(tmp);
+    file << xml.str();
+    file.close();
+    if (!file)
+        throw std::runtime_error{"Writing " + tmp.native() + " failed."};
+    std::filesystem::rename(tmp, target);
+}
+
+std::vector<std::string> Btrfs::getSnapshotIds() {
+    std::vector<unsigned long> numbers;
+    for (auto& entry: std::filesystem::directory_iterator(snapshotsDir)) {
+        std::string name = entry.path().filename();
+        if (!name.empty() && std::all_of(name.begin(), name.end(), ::isdigit) && entry.is_directory())
+            numbers.push_back(std::stoul(name));
+    }
+    std::sort(numbers.begin(), numbers.end());
+
+    std::vector<std::string> ids;
+    for (auto number: numbers)
+        ids.push_back(std::to_string(number));
+    return ids;
+}
+
+} // namespace TransactionalUpdate
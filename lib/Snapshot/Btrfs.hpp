@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Native btrfs backend for snapshot handling; uses the snapper directory
+  layout and info.xml files, but creates and modifies the subvolumes directly
+  without requiring snapper to be installed.
+ */
+
+#ifndef T_U_BTRFS_H
+#define T_U_BTRFS_H
+
+#include "SnapshotManager.hpp"
+#include "Snapshot.hpp"
+#include <filesystem>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace TransactionalUpdate {
+
+class Btrfs: public SnapshotManager, public Snapshot {
+public:
+    ~Btrfs() = default;
+
+    // Snapshot
+    Btrfs(std::string snap): Snapshot(snap) {};
+    void close() override;
+    void abort() override;
+    std::filesystem::path getRoot() override;
+    bool isInProgress() override;
+    bool isReadOnly() override;
+    void setDefault() override;
+    void setReadOnly(bool readonly) override;
+    void modify(std::string description, std::map<std::string, std::string> userdata,
+                std::optional<std::string> cleanup = std::nullopt) override;
+
+    // SnapshotManager
+    Btrfs(): Snapshot("") {};
+    std::unique_ptr<Snapshot> create(std::string base, std::string description) override;
+    std::unique_ptr<Snapshot> open(std::string id) override;
+    SnapshotTable getList(std::string columns) override;
+    std::string getCurrent() override;
+    std::string getDefault() override;
+    void deleteSnap(std::string id) override;
+    void deleteSnaps(std::vector<std::string> ids, bool wait = false) override;
+    bool isCleanupPending(bool wait = false) override;
+    std::string rollbackTo(std::string id) override;
+private:
+    struct Info {
+        std::string type = "single";
+        std::string num;
+        std::string date;
+        std::string description;
+        std::string cleanup;
+        std::string uid;
+        std::string preNum;
+        std::map<std::string, std::string> userdata;
+    };
+    static Info readInfo(std::string id);
+    static void writeInfo(const Info& info);
+    static std::vector<std::string> getSnapshotIds();
+};
+
+} // namespace TransactionalUpdate
+
+#endif // T_U_BTRFS_H
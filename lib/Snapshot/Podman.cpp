@@ -10,11 +10,27 @@
 #include "Exceptions.hpp"
 #include "Log.hpp"
 #include "Mount.hpp"
+#include "OciImage.hpp"
+#include "Sync.hpp"
 #include "Util.hpp"
-#include <regex>
+#include <cerrno>
+#include <cstdarg>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <selinux/restorecon.h>
+#include <selinux/selinux.h>
+#include <set>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
 
 namespace TransactionalUpdate {
 
+// Image digest (and for OCI layouts also the layer digests) the snapshot was
+// built from, relative to the snapshot root
+static const std::filesystem::path OCI_RECORD = "usr/lib/sysimage/tukit/oci-layers";
+
 /* SnapshotManager methods */
 
 std::unique_ptr<Snapshot> Podman::create(std::string base, std::string description) {
@@ -23,26 +39,229 @@ std::unique_ptr<Snapshot> Podman::create(std::string base, std::string descripti
     std::string oci_target = config.get("OCI_TARGET");
 
     try {
-        tulog.info("Pulling image from: " + oci_target);
-        Util::exec("podman image pull " + oci_target);
-        std::string ocimount = Util::exec("podman image mount " + oci_target);
-        Util::rtrim(ocimount);
-        tulog.info("Writing contents of " + oci_target + " to snapshot directory " + getRoot().string() + "...");
-        std::string excludes;
-        for (auto path: MountList::getList()) {
-            excludes += " --exclude ";
-            excludes += path.string();
+        // The record is inherited from the base snapshot
+        OciImage::Record applied = OciImage::readRecord(getRoot() / OCI_RECORD);
+        std::vector<Sync::Change> changes;
+        bool changed;
+        if (OciImage::isReference(oci_target))
+            changed = applyLayout(oci_target, applied, changes);
+        else
+            changed = pullImage(oci_target, applied, changes);
+        if (changed && !relabel(changes)) {
+            tulog.info("Relabelling will be done on next boot.");
+            Util::exec("touch " + getRoot().string() + "/.autorelabel");
         }
-        Util::exec("rsync --delete --archive --hard-links --xattrs --acls --inplace --one-file-system " + excludes + " " + ocimount + "/ " + getRoot().string() + "/");
-        Util::exec("rsync --archive --hard-links --xattrs --acls --inplace --one-file-system --ignore-existing " + ocimount + "/etc/ " + getRoot().string() + "/etc/");
-        tulog.info("Merging /etc from container image into existing snapshot, preserving existing configuration...");
-        Util::exec("podman image unmount " + oci_target);
-        Util::exec("touch " + getRoot().string() + "/.autorelabel");
-        return std::make_unique<Podman>(snapshotId);
+        return std::make_unique<Podman>(snapshotId, dbus);
     } catch (const std::exception &e) {
+        tulog.error("ERROR: ", e.what());
         Snapper::deleteSnap(snap.get()->getUid());
         throw std::runtime_error{"Syncing podman image failed."};
     }
 }
 
+// Returns true if the image digest differs from the applied one
+static bool compareDigest(const std::string& image, const std::string& digest, const OciImage::Record& applied) {
+    if (applied.manifest.empty()) {
+        tulog.info("Image ", image, " has digest ", digest, ".");
+        return true;
+    }
+    if (applied.manifest == digest) {
+        tulog.info("Image ", image, " is unchanged (", digest, "), skipping synchronization.");
+        return false;
+    }
+    tulog.info("Image ", image, " changed from ", applied.manifest, " to ", digest, ".");
+    return true;
+}
+
+std::string Podman::getRemoteDigest(std::string image) {
+    std::string ref = image.find("://") == std::string::npos ? "docker://" + image : image;
+    try {
+        std::string digest = Util::exec("skopeo inspect --format '{{.Digest}}' " + ref + " 2>/dev/null");
+        Util::trim(digest);
+        return digest;
+    } catch (const std::exception &e) {
+        tulog.debug("Could not inspect ", ref, " with skopeo, pulling image to determine its digest.");
+        return "";
+    }
+}
+
+bool Podman::pullImage(std::string image, const OciImage::Record& applied, std::vector<Sync::Change>& changes) {
+    // Prefer asking the registry, so an unchanged image doesn't even have to be pulled
+    std::string digest = getRemoteDigest(image);
+    if (!digest.empty() && !compareDigest(image, digest, applied))
+        return false;
+
+    tulog.info("Pulling image from: " + image);
+    Util::exec("podman image pull " + image);
+    if (digest.empty()) {
+        digest = Util::exec("podman image inspect --format '{{.Digest}}' " + image);
+        Util::trim(digest);
+        if (!compareDigest(image, digest, applied))
+            return false;
+    }
+
+    std::string ocimount = Util::exec("podman image mount " + image);
+    Util::rtrim(ocimount);
+    tulog.info("Writing contents of " + image + " to snapshot directory " + getRoot().string() + "...");
+    syncImage(ocimount, true, changes);
+    Util::exec("podman image unmount " + image);
+
+    std::filesystem::create_directories((getRoot() / OCI_RECORD).parent_path());
+    OciImage::writeRecord(getRoot() / OCI_RECORD, {digest, {}});
+    changes.push_back({OCI_RECORD.parent_path(), true});
+    return true;
+}
+
+bool Podman::applyLayout(std::string reference, const OciImage::Record& applied, std::vector<Sync::Change>& changes) {
+    OciImage image = OciImage::fromReference(reference);
+    if (!compareDigest(reference, image.getDigest(), applied))
+        return false;
+
+    // Mounted directories are skipped, except for /etc, where new files from the image are added
+    tulog.info("Writing ", reference, " to snapshot directory ", getRoot().string(), "...");
+    image.apply(getRoot(), applied.layers, MountList::getList(), changes);
+
+    std::filesystem::create_directories((getRoot() / OCI_RECORD).parent_path());
+    OciImage::writeRecord(getRoot() / OCI_RECORD, image.getRecord());
+    changes.push_back({OCI_RECORD.parent_path(), true});
+    return true;
+}
+
+void Podman::syncImage(std::filesystem::path source, bool del, std::vector<Sync::Change>& changes) {
+    Sync imageSync{source, getRoot()};
+    imageSync.setDelete(del);
+    imageSync.setOneFileSystem(true);
+    imageSync.setRecordChanges(true);
+    for (auto path: MountList::getList()) {
+        imageSync.exclude(path);
+    }
+    imageSync.run();
+    changes.insert(changes.end(), imageSync.getChanges().begin(), imageSync.getChanges().end());
+    if (!std::filesystem::exists(source / "etc"))
+        return;
+    tulog.info("Merging /etc from container image into existing snapshot, preserving existing configuration...");
+    Sync etcSync{source / "etc", getRoot() / "etc"};
+    etcSync.setOneFileSystem(true);
+    etcSync.setIgnoreExisting(true);
+    etcSync.setRecordChanges(true);
+    etcSync.run();
+    for (auto& change: etcSync.getChanges()) {
+        changes.push_back({change.path.empty() ? "etc" : "etc/" + change.path, change.created});
+    }
+}
+
+static int selinuxLog(int type, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    char buf[1024];
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    std::string msg = buf;
+    Util::rtrim(msg);
+    if (type == SELINUX_ERROR)
+        tulog.error("SELinux: ", msg);
+    else
+        tulog.debug("SELinux: ", msg);
+    return 0;
+}
+
+// The policy type configured in the snapshot, e.g. "targeted"
+static std::string getPolicyType(std::filesystem::path config) {
+    std::ifstream in{config};
+    std::string line, type;
+    while (std::getline(in, line)) {
+        Util::trim(line);
+        if (line.rfind("SELINUXTYPE=", 0) == 0)
+            type = line.substr(12);
+    }
+    Util::trim(type);
+    return type;
+}
+
+bool Podman::relabel(const std::vector<Sync::Change>& changes) {
+    std::string policyType = getPolicyType(getRoot() / "etc/selinux/config");
+    if (policyType.empty()) {
+        tulog.debug("No SELinux policy configured in the snapshot, skipping relabelling.");
+        return true;
+    }
+    if (is_selinux_enabled() <= 0)
+        return false;
+
+    // Directories created by the sync are relabelled recursively, entries
+    // within them don't have to be listed separately.
+    std::set<std::filesystem::path> trees;
+    for (auto& change: changes) {
+        if (change.created)
+            trees.insert(change.path);
+    }
+    auto inTree = [&trees](std::filesystem::path path) {
+        for (;; path = path.parent_path()) {
+            if (trees.count(path))
+                return true;
+            if (path.empty())
+                return false;
+        }
+    };
+    std::vector<std::string> recursive;
+    std::set<std::string> single;
+    for (auto& tree: trees) {
+        if (tree.empty() || !inTree(tree.parent_path()))
+            recursive.push_back("/" + tree.native());
+    }
+    for (auto& change: changes) {
+        if (!change.created && !inTree(change.path))
+            single.insert("/" + change.path);
+    }
+    tulog.info("Relabelling ", recursive.size(), " new directories and ", single.size(),
+               " changed files of snapshot ", getRoot().string(), "...");
+
+    // The labels are looked up in the snapshot's own file_contexts; the
+    // library keeps the handle open, so do it in a child process
+    pid_t childPid = fork();
+    if (childPid < 0) {
+        throw std::runtime_error{"Forking for SELinux relabelling failed: " + std::string(strerror(errno))};
+    } else if (childPid == 0) {
+        if (chroot(getRoot().c_str()) < 0 || chdir("/") < 0) {
+            tulog.error("Chrooting to " + getRoot().native() + " for SELinux relabelling failed: " + std::string(strerror(errno)));
+            _exit(errno);
+        }
+        union selinux_callback se_callback;
+        se_callback.func_log = selinuxLog;
+        selinux_set_callback(SELINUX_CB_LOG, se_callback);
+        if (selinux_set_policy_root(("/etc/selinux/" + policyType).c_str()) < 0) {
+            tulog.error("Setting SELinux policy root failed: " + std::string(strerror(errno)));
+            _exit(errno);
+        }
+
+        // Don't descend into nested subvolumes or mounts, they are not part of the image
+        unsigned int options = SELINUX_RESTORECON_IGNORE_DIGEST | SELINUX_RESTORECON_XDEV;
+        for (auto& path: recursive) {
+#ifdef HAVE_RESTORECON_PARALLEL
+            // 0 threads: one per CPU
+            int rc = selinux_restorecon_parallel(path.c_str(), options | SELINUX_RESTORECON_RECURSE, 0);
+#else
+            int rc = selinux_restorecon(path.c_str(), options | SELINUX_RESTORECON_RECURSE);
+#endif
+            if (rc < 0) {
+                tulog.error("Relabelling of " + path + " failed: " + std::string(strerror(errno)));
+                _exit(errno);
+            }
+        }
+        for (auto& path: single) {
+            if (selinux_restorecon(path.c_str(), options) < 0 && errno != ENOENT) {
+                tulog.error("Relabelling of " + path + " failed: " + std::string(strerror(errno)));
+                _exit(errno);
+            }
+        }
+        _exit(0);
+    }
+    int status;
+    waitpid(childPid, &status, 0);
+    if ((WIFEXITED(status) && WEXITSTATUS(status) != 0) || WIFSIGNALED(status)) {
+        tulog.error("SELinux relabelling of snapshot failed.");
+        return false;
+    }
+    return true;
+}
+
 } // namespace TransactionalUpdate
@@ -2,13 +2,20 @@
 /* SPDX-FileCopyrightText: Copyright SUSE LLC */
 
 /*
-  Podman backend for snapshot handling
+  Podman backend for snapshot handling; OCI_TARGET may either be an image
+  reference pulled via podman or a local OCI image ("oci:<dir>[:<tag>]" or
+  "oci-archive:<file>[:<tag>]"), of which only the layers changed since the
+  base snapshot are streamed into the new snapshot.
+  If the image digest didn't change the new snapshot is left as a plain copy
+  of the base snapshot, otherwise the written files are relabelled with the
+  snapshot's SELinux policy right away.
  */
 
 #ifndef T_U_PODMAN_H
 #define T_U_PODMAN_H
 
 #include "Snapper.hpp"
+#include "OciImage.hpp"
 
 namespace TransactionalUpdate {
 
@@ -17,11 +24,21 @@ public:
     ~Podman() = default;
 
     // Snapshot
-    Podman(std::string snap): Snapper(snap) {};
+    Podman(std::string snap, std::shared_ptr<SnapperDBus> dbus = nullptr): Snapper(snap, dbus) {};
 
     // SnapshotManager
     Podman(): Snapper("") {};
     std::unique_ptr<Snapshot> create(std::string base, std::string description) override;
+private:
+    // Both return false if the image is unchanged and nothing was synchronized;
+    // the entries written to the snapshot are appended to changes
+    bool pullImage(std::string image, const OciImage::Record& applied, std::vector<Sync::Change>& changes);
+    bool applyLayout(std::string reference, const OciImage::Record& applied, std::vector<Sync::Change>& changes);
+    static std::string getRemoteDigest(std::string image);
+    void syncImage(std::filesystem::path source, bool del, std::vector<Sync::Change>& changes);
+    // Labels the changed entries according to the snapshot's SELinux policy;
+    // returns false if that wasn't possible
+    bool relabel(const std::vector<Sync::Change>& changes);
 };
 
 } // namespace TransactionalUpdate
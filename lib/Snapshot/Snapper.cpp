@@ -6,9 +6,17 @@
  */
 
 #include "Snapper.hpp"
+#include "SnapperDBus.hpp"
 #include "Exceptions.hpp"
+#include "Log.hpp"
+#include "Mount.hpp"
+#include "SnapshotPool.hpp"
+#include "SnapshotUsage.hpp"
+#include "Subvolume.hpp"
 #include "Util.hpp"
-#include <regex>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 
 namespace TransactionalUpdate {
 
@@ -17,21 +25,25 @@ namespace TransactionalUpdate {
 std::unique_ptr<Snapshot> Snapper::create(std::string base, std::string description) {
     if (! std::filesystem::exists("/.snapshots/" + base + "/snapshot"))
         throw std::invalid_argument{"Base snapshot '" + base + "' does not exist."};
-    snapshotId = callSnapper("create --from " + base + " --read-write --cleanup-algorithm number --print-number --description '" + description + "' --userdata 'transactional-update-in-progress=yes'");
-    Util::rtrim(snapshotId);
-    return std::make_unique<Snapper>(snapshotId);
+    if (!tryDBus([&](SnapperDBus& bus) {
+            snapshotId = std::to_string(bus.createSnapshot(std::stoul(base), false, description, "number",
+                                                           {{"transactional-update-in-progress", "yes"}}));
+        })) {
+        snapshotId = callSnapper("create --from " + base + " --read-write --cleanup-algorithm number --print-number --description '" + description + "' --userdata 'transactional-update-in-progress=yes'");
+        Util::rtrim(snapshotId);
+    }
+    cache->invalidate();
+    return std::make_unique<Snapper>(snapshotId, dbus, cache);
 }
 
 std::unique_ptr<Snapshot> Snapper::open(std::string id) {
     snapshotId = id;
     if (! std::filesystem::exists(getRoot()))
         throw std::invalid_argument{"Snapshot " + id + " does not exist."};
-    return std::make_unique<Snapper>(snapshotId);
+    return std::make_unique<Snapper>(snapshotId, dbus, cache);
 }
 
-std::deque<std::map<std::string, std::string>> Snapper::getList(std::string columns) {
-    std::deque<std::map<std::string, std::string>> snapshotList;
-
+SnapshotTable Snapper::getList(std::string columns) {
     // Sanitize user input
     if (! std::all_of(columns.begin(), columns.end(), [](char c) {
            return (std::isalpha(c) || c == ',');
@@ -41,62 +53,18 @@ std::deque<std::map<std::string, std::string>> Snapper::getList(std::string colu
 
     if (columns.empty())
         columns="number,date,description";
-    std::string snapshots = callSnapper("--utc --iso --csvout list --columns " + columns);
-    std::stringstream snapshotsStream(snapshots);
-
-    // Headers
-    std::vector<std::string> headers;
-    std::string line;
-    std::getline(snapshotsStream, line);
-    std::stringstream fieldsStream(line);
-    for (std::string field; std::getline(fieldsStream, field, ','); ) {
-        headers.push_back(field);
-    }
-
-    // Lines
-    for (std::string line; std::getline(snapshotsStream, line); ) {
-        std::map<std::string, std::string> snapshot;
-        auto header = headers.begin();
-        std::stringstream fieldsStream(line, std::stringstream::out | std::stringstream::in | std::stringstream::app);
-        std::string field;
-        // This is a simple CSV parser
-        while (std::getline(fieldsStream, field, ',')) {
-            if (field[0] == '"') {
-                while (field[field.length() - 1] != '"') {
-                    std::string continuation;
-                    if (fieldsStream.eof()) { // newline character
-                        fieldsStream.clear();
-                        std::getline(snapshotsStream, line);
-                        fieldsStream << line;
-                        std::getline(fieldsStream, continuation, ',');
-                        field += "\n" + continuation;
-                    } else {
-                        std::getline(fieldsStream, continuation, ',');
-                        field += "," + continuation;
-                    }
-                }
-                field = field.substr(1, field.length() - 2);
-                field = std::regex_replace(field, std::regex("\"\""), "\"");
-            }
-            snapshot.emplace(*header, field);
-            header++;
-        }
-        if (line.back() == ',') {
-            snapshot.emplace(*header, "");
-        }
-        snapshotList.push_back(snapshot);
-    }
-    return snapshotList;
+    return SnapshotUsage::addColumns(
+        parseList(callSnapper("--utc --iso --csvout list --columns " + SnapshotUsage::getBaseColumns(columns))), columns);
 }
 
 /* Snapshot methods */
 
 void Snapper::close() {
-    callSnapper("modify --userdata 'transactional-update-in-progress=' " + snapshotId);
+    modify("", {{"transactional-update-in-progress", ""}});
 }
 
 void Snapper::abort() {
-    callSnapper("delete " + snapshotId);
+    deleteSnap(snapshotId);
 }
 
 std::filesystem::path Snapper::getRoot() {
@@ -104,82 +72,312 @@ std::filesystem::path Snapper::getRoot() {
 }
 
 std::string Snapper::getCurrent() {
-    std::smatch match;
-
-    // snapper doesn't support the `apply` command for now, so use findmnt directly.
-    std::string id = Util::exec("findmnt --target /usr --raw --noheadings --output FSROOT --first-only --direction backward --types btrfs");
-    bool found = std::regex_search(id, match, std::regex(".*.snapshots/(.*)/snapshot.*"));
-    if (!found) {
-        id = Util::exec("findmnt --target / --raw --noheadings --output FSROOT --first-only --direction backward --types btrfs");
-        found = std::regex_search(id, match, std::regex(".*.snapshots/(.*)/snapshot.*"));
-        if (!found)
-            throw std::runtime_error{"Couldn't determine current snapshot number"};
+    // snapper doesn't support the `apply` command for now, so look at the mount table directly:
+    // the btrfs subvolume backing /usr (or / if /usr isn't a btrfs mount) is the current snapshot.
+    auto mounts = MountList::getMountInfo();
+    for (auto target: {"/usr", "/"}) {
+        const MountInfo* mount = MountList::findTarget(mounts, target, "btrfs");
+        if (!mount)
+            continue;
+        size_t start = mount->root.rfind(".snapshots/");
+        if (start == std::string::npos)
+            continue;
+        start += std::strlen(".snapshots/");
+        size_t end = mount->root.find("/snapshot", start);
+        if (end == std::string::npos || end == start)
+            continue;
+        return mount->root.substr(start, end - start);
     }
-    return match[1].str();
+    throw std::runtime_error{"Couldn't determine current snapshot number"};
 }
 
 std::string Snapper::getDefault() {
-    std::string id = callSnapper("--csvout list --columns default,number");
-    std::smatch match;
-    bool found = std::regex_search(id, match, std::regex("yes,([0-9]+)"));
-    if (!found)
+    if (!cache->valid)
+        loadMetadata();
+    if (cache->defaultId.empty())
         throw std::runtime_error{"Couldn't determine default snapshot number"};
-    return match[1].str();
+    return cache->defaultId;
 }
 
 void Snapper::deleteSnap(std::string id) {
-    callSnapper("delete " + id);
+    deleteSnaps({id});
+}
+
+void Snapper::deleteSnaps(std::vector<std::string> ids, bool wait) {
+    if (ids.empty())
+        return;
+    std::vector<unsigned int> numbers;
+    std::string list;
+    for (auto& id: ids) {
+        // Sanitize user input
+        if (id.empty() || ! std::all_of(id.begin(), id.end(), ::isdigit))
+            throw std::invalid_argument{"Invalid snapshot number '" + id + "'."};
+        numbers.push_back(std::stoul(id));
+        list += " " + id;
+    }
+
+    if (tryDBus([&](SnapperDBus& bus) {
+            bus.deleteSnapshots(numbers);
+        })) {
+        if (wait)
+            Subvolume::waitForCleanup("/.snapshots");
+    } else {
+        callSnapper(std::string("delete") + (wait ? " --sync" : "") + list);
+    }
+    cache->invalidate();
+}
+
+bool Snapper::isCleanupPending(bool wait) {
+    if (wait)
+        Subvolume::waitForCleanup("/.snapshots");
+    return !Subvolume::getDeletedIds("/.snapshots").empty();
 }
 
 std::string Snapper::rollbackTo(std::string id) {
+    if (SnapshotPool::getSize(*this) > 0 && SnapshotPool{*this}.isEntry(id))
+        throw std::invalid_argument{"Snapshot " + id + " is part of the snapshot pool and cannot be used for a rollback."};
+
     snapshotId = callSnapper("rollback --print-number " + id);
+    cache->invalidate();
     snapshotId = snapshotId.substr(snapshotId.rfind(' ') + 1); // [gh#openSUSE/snapper#1154]
     snapshotId = snapshotId.substr(0, snapshotId.rfind('.'));
     Util::rtrim(snapshotId);
-    return snapshotId;
+
+    std::string newDefault = snapshotId;
+    if (SnapshotPool::getSize(*this) > 0)
+        SnapshotPool{*this}.updateInBackground(newDefault);
+    return newDefault;
 }
 
 bool Snapper::isInProgress() {
-    std::string desc = callSnapper("--csvout list --columns number,userdata");
-    std::smatch match;
-    return std::regex_search(desc, match, std::regex("(^|\n)" + snapshotId + ",.*transactional-update-in-progress=yes"));
+    auto metadata = getMetadata(snapshotId);
+    return metadata && metadata->inProgress;
 }
 
 bool Snapper::isReadOnly() {
-    std::string ro = callSnapper("--csvout list --columns number,read-only");
-    std::smatch match;
-    bool found = std::regex_search(ro, match, std::regex(snapshotId + ",(.*)"));
-    if (!found)
+    auto metadata = getMetadata(snapshotId);
+    if (metadata && !metadata->readOnly) {
+        if (!tryDBus([&](SnapperDBus& bus) {
+                metadata->readOnly = bus.isSnapshotReadOnly(std::stoul(snapshotId));
+            })) {
+            loadMetadata(false);
+            metadata = getMetadata(snapshotId);
+        }
+    }
+    if (!metadata || !metadata->readOnly)
         throw std::runtime_error{"Couldn't determine read-only state"};
-    if (match[1].str() == "yes")
-        return true;
-    else
-        return false;
+    return metadata->readOnly.value();
+}
+
+void Snapper::modify(std::string description, std::map<std::string, std::string> userdata,
+                     std::optional<std::string> cleanup) {
+    if (!tryDBus([&](SnapperDBus& bus) {
+            auto snapshot = bus.getSnapshot(std::stoul(snapshotId));
+            if (!description.empty())
+                snapshot.description = description;
+            if (cleanup)
+                snapshot.cleanup = *cleanup;
+            for (auto& [key, value]: userdata) {
+                if (value.empty())
+                    snapshot.userdata.erase(key);
+                else
+                    snapshot.userdata[key] = value;
+            }
+            bus.setSnapshot(snapshot);
+        })) {
+        std::string opts = "modify";
+        if (!description.empty())
+            opts += " --description '" + description + "'";
+        if (cleanup)
+            opts += " --cleanup-algorithm '" + *cleanup + "'";
+        std::string data;
+        for (auto& [key, value]: userdata) {
+            data += (data.empty() ? "" : ",") + key + "=" + value;
+        }
+        if (!data.empty())
+            opts += " --userdata '" + data + "'";
+        callSnapper(opts + " " + snapshotId);
+    }
+    cache->invalidate();
 }
 
 void Snapper::setDefault() {
-    try {
-        callSnapper("modify --default " + snapshotId + " 2>&1");
-    } catch (const VersionException &e) {
-        Util::exec("btrfs subvolume set-default " + std::string(getRoot()));
+    if (!tryDBus([&](SnapperDBus& bus) {
+            bus.setDefaultSnapshot(std::stoul(snapshotId));
+        })) {
+        try {
+            callSnapper("modify --default " + snapshotId + " 2>&1");
+        } catch (const VersionException &e) {
+            Util::exec("btrfs subvolume set-default " + std::string(getRoot()));
+        }
     }
+    cache->invalidate();
 }
 
 void Snapper::setReadOnly(bool readonly) {
-    try {
-        if (readonly == true)
-            callSnapper("modify --read-only " + snapshotId + " 2>&1");
-        else
-            callSnapper("modify --read-write " + snapshotId + " 2>&1");
-    } catch (const VersionException &e) {
-        Util::exec("btrfs property set " + std::string(getRoot()) + " ro " + (readonly ? "true" : "false"));
+    if (!tryDBus([&](SnapperDBus& bus) {
+            bus.setSnapshotReadOnly(std::stoul(snapshotId), readonly);
+        })) {
+        try {
+            if (readonly == true)
+                callSnapper("modify --read-only " + snapshotId + " 2>&1");
+            else
+                callSnapper("modify --read-write " + snapshotId + " 2>&1");
+        } catch (const VersionException &e) {
+            Util::exec("btrfs property set " + std::string(getRoot()) + " ro " + (readonly ? "true" : "false"));
+        }
     }
+    cache->invalidate();
 }
 
 /* Helper methods */
 
+// Returns the cached metadata of the given snapshot, listing all snapshots once if the cache
+// is empty; the list is refreshed once if the snapshot has been created by someone else since.
+SnapperCache::Entry* Snapper::getMetadata(const std::string& id) {
+    bool reloaded = false;
+    if (!cache->valid) {
+        loadMetadata();
+        reloaded = true;
+    }
+    auto it = cache->snapshots.find(id);
+    if (it == cache->snapshots.end() && !reloaded) {
+        loadMetadata();
+        it = cache->snapshots.find(id);
+    }
+    return it == cache->snapshots.end() ? nullptr : &it->second;
+}
+
+void Snapper::loadMetadata(bool useDBus) {
+    cache->invalidate();
+    if (useDBus && tryDBus([&](SnapperDBus& bus) {
+            for (auto& snapshot: bus.listSnapshots()) {
+                auto inProgress = snapshot.userdata.find("transactional-update-in-progress");
+                cache->snapshots[std::to_string(snapshot.number)].inProgress =
+                    (inProgress != snapshot.userdata.end() && inProgress->second == "yes");
+            }
+            cache->defaultId = std::to_string(bus.getDefaultSnapshot());
+        })) {
+        cache->valid = true;
+        return;
+    }
+
+    // The read-only state is only available via snapper list, so fetch everything in one go
+    cache->invalidate();
+    SnapshotTable list = parseList(callSnapper("--csvout list --columns number,default,read-only,userdata"));
+    for (size_t row = 0; row < list.rows(); row++) {
+        std::string number{list.get(row, "number")};
+        auto& entry = cache->snapshots[number];
+        entry.inProgress = list.get(row, "userdata").find("transactional-update-in-progress=yes") != std::string_view::npos;
+        entry.readOnly = (list.get(row, "read-only") == "yes");
+        if (list.get(row, "default") == "yes")
+            cache->defaultId = number;
+    }
+    cache->valid = true;
+}
+
+// Single pass parser for snapper's CSV output; quoted fields may contain separators,
+// newlines and doubled quotes.
+SnapshotTable Snapper::parseList(std::string_view csv) {
+    std::vector<std::string> headers;
+    SnapshotTable table;
+    bool inHeader = true;
+    size_t fieldCount = 0;
+    std::string unescaped;
+
+    size_t pos = 0;
+    while (pos < csv.size()) {
+        std::string_view value;
+        if (csv[pos] == '"') {
+            size_t start = ++pos;
+            bool escaped = false;
+            for (;;) {
+                size_t quote = csv.find('"', pos);
+                if (quote == std::string_view::npos)
+                    throw std::runtime_error{"Unterminated quoted field in snapper output."};
+                if (quote + 1 < csv.size() && csv[quote + 1] == '"') {
+                    escaped = true;
+                    pos = quote + 2;
+                    continue;
+                }
+                value = csv.substr(start, quote - start);
+                pos = quote + 1;
+                break;
+            }
+            if (escaped) {
+                unescaped.clear();
+                for (size_t i = 0; i < value.size(); i++) {
+                    unescaped += value[i];
+                    if (value[i] == '"')
+                        i++;
+                }
+                value = unescaped;
+            }
+        } else {
+            size_t end = csv.find_first_of(",\n", pos);
+            if (end == std::string_view::npos)
+                end = csv.size();
+            value = csv.substr(pos, end - pos);
+            pos = end;
+        }
+
+        if (inHeader) {
+            headers.emplace_back(value);
+        } else {
+            if (++fieldCount > table.getColumns().size())
+                throw std::runtime_error{"Snapper output contains more fields than columns."};
+            table.append(value);
+        }
+
+        bool endOfLine = (pos >= csv.size() || csv[pos] == '\n');
+        if (!endOfLine && csv[pos] != ',')
+            throw std::runtime_error{"Unexpected character after quoted field in snapper output."};
+        pos++;
+        if (!endOfLine && pos == csv.size()) {
+            // Trailing separator: the last field is empty
+            if (!inHeader)
+                table.append("");
+            endOfLine = true;
+        }
+        if (endOfLine) {
+            if (inHeader) {
+                table = SnapshotTable{std::move(headers)};
+                inHeader = false;
+            } else {
+                table.finishRow();
+            }
+            fieldCount = 0;
+        }
+    }
+    return table;
+}
+
+// Runs the given operation on snapperd, sharing one bus connection between the snapshot manager
+// and all snapshots opened by it. Returns false if snapperd or the required method is not
+// available, in which case the caller has to fall back to the snapper command line client.
+bool Snapper::tryDBus(const std::function<void(SnapperDBus&)>& call) {
+    if (!dbus) {
+        if (!std::filesystem::exists("/run/dbus/system_bus_socket"))
+            return false;
+        try {
+            dbus = std::make_shared<SnapperDBus>();
+        } catch (const std::exception &e) {
+            tulog.debug("Not using snapperd: ", e.what());
+            return false;
+        }
+    }
+    try {
+        call(*dbus);
+    } catch (const VersionException &e) {
+        tulog.debug("Falling back to snapper command line client: ", e.what());
+        return false;
+    }
+    return true;
+}
+
 std::string Snapper::callSnapper(std::string opts) {
     std::string output;
+    auto start = std::chrono::steady_clock::now();
     try {
         if (std::filesystem::exists("/run/dbus/system_bus_socket")) {
             output = Util::exec("snapper " + opts);
@@ -195,6 +393,8 @@ std::string Snapper::callSnapper(std::string opts) {
             throw;
         }
     }
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+    tulog.debug("snapper: `", opts, "` took ", duration.count() / 1000.0, " ms");
     return output;
 }
 
@@ -11,16 +11,42 @@
 #include "SnapshotManager.hpp"
 #include "Snapshot.hpp"
 #include <filesystem>
+#include <functional>
+#include <memory>
+#include <optional>
 #include <string>
+#include <unordered_map>
 
 namespace TransactionalUpdate {
 
+class SnapperDBus;
+
+/*
+  Snapshot metadata of one transaction, shared between the snapshot manager and all snapshots
+  opened by it; filled by a single snapshot listing and invalidated by every modifying call.
+ */
+struct SnapperCache {
+    struct Entry {
+        bool inProgress = false;
+        std::optional<bool> readOnly;
+    };
+    bool valid = false;
+    std::string defaultId;
+    std::unordered_map<std::string, Entry> snapshots;
+    void invalidate() {
+        valid = false;
+        defaultId.clear();
+        snapshots.clear();
+    }
+};
+
 class Snapper: public SnapshotManager, public Snapshot {
 public:
     ~Snapper() = default;
 
     // Snapshot
-    Snapper(std::string snap): Snapshot(snap) {};
+    Snapper(std::string snap, std::shared_ptr<SnapperDBus> dbus = nullptr, std::shared_ptr<SnapperCache> cache = nullptr)
+        : Snapshot(snap), dbus{dbus}, cache{cache ? cache : std::make_shared<SnapperCache>()} {};
     void close() override;
     void abort() override;
     std::filesystem::path getRoot() override;
@@ -28,18 +54,29 @@ public:
     bool isReadOnly() override;
     void setDefault() override;
     void setReadOnly(bool readonly) override;
+    void modify(std::string description, std::map<std::string, std::string> userdata,
+                std::optional<std::string> cleanup = std::nullopt) override;
 
     // SnapshotManager
-    Snapper(): Snapshot("") {};
+    Snapper(): Snapshot(""), cache{std::make_shared<SnapperCache>()} {};
     std::unique_ptr<Snapshot> create(std::string base, std::string description) override;
     virtual std::unique_ptr<Snapshot> open(std::string id) override;
-    std::deque<std::map<std::string, std::string>> getList(std::string columns) override;
+    SnapshotTable getList(std::string columns) override;
     std::string getCurrent() override;
     std::string getDefault() override;
     void deleteSnap(std::string id) override;
+    void deleteSnaps(std::vector<std::string> ids, bool wait = false) override;
+    bool isCleanupPending(bool wait = false) override;
     std::string rollbackTo(std::string id) override;
+protected:
+    std::shared_ptr<SnapperDBus> dbus;
+    std::shared_ptr<SnapperCache> cache;
+    bool tryDBus(const std::function<void(SnapperDBus&)>& call);
+    SnapperCache::Entry* getMetadata(const std::string& id);
 private:
     std::string callSnapper(std::string);
+    void loadMetadata(bool useDBus = true);
+    static SnapshotTable parseList(std::string_view csv);
 };
 
 } // namespace TransactionalUpdate
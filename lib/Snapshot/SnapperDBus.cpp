@@ -0,0 +1,248 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Client for snapperd's D-Bus interface (org.opensuse.Snapper)
+ */
+
+#include "SnapperDBus.hpp"
+#include "Exceptions.hpp"
+#include "Log.hpp"
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <systemd/sd-bus.h>
+
+namespace TransactionalUpdate {
+
+static const char* snapperService = "org.opensuse.Snapper";
+static const char* snapperPath = "/org/opensuse/Snapper";
+static const char* snapperInterface = "org.opensuse.Snapper";
+
+SnapperDBus::SnapperDBus(std::string config): config{std::move(config)} {
+    int rc;
+    if ((rc = sd_bus_open_system(&bus)) < 0)
+        throw std::runtime_error{"Connecting to system bus failed: " + std::string(strerror(-rc))};
+}
+
+SnapperDBus::~SnapperDBus() {
+    sd_bus_flush_close_unref(bus);
+}
+
+sd_bus_message* SnapperDBus::newCall(const char* method) {
+    sd_bus_message* message = nullptr;
+    int rc;
+    if ((rc = sd_bus_message_new_method_call(bus, &message, snapperService, snapperPath, snapperInterface, method)) < 0)
+        throw std::runtime_error{"Creating snapperd call " + std::string(method) + " failed: " + std::string(strerror(-rc))};
+    if ((rc = sd_bus_message_append(message, "s", config.c_str())) < 0) {
+        sd_bus_message_unref(message);
+        throw std::runtime_error{"Appending snapper config to " + std::string(method) + " failed: " + std::string(strerror(-rc))};
+    }
+    return message;
+}
+
+// Sends the message and takes ownership of it; the reply has to be unref'ed by the caller.
+// Errors indicating that snapperd or the method is not available are reported as
+// VersionException, so callers can fall back to the snapper command line client.
+sd_bus_message* SnapperDBus::call(sd_bus_message* message, const char* method) {
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message* reply = nullptr;
+
+    auto start = std::chrono::steady_clock::now();
+    int rc = sd_bus_call(bus, message, UINT64_MAX, &error, &reply);
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+    sd_bus_message_unref(message);
+    tulog.debug("snapperd: ", method, " took ", duration.count() / 1000.0, " ms");
+
+    if (rc < 0) {
+        std::string name = error.name ? error.name : "";
+        std::string reason = "snapperd: " + std::string(method) + " failed: " +
+            (error.message ? std::string(error.message) : name.empty() ? std::string(strerror(-rc)) : name);
+        sd_bus_error_free(&error);
+        if (name == "org.freedesktop.DBus.Error.UnknownMethod" ||
+                name == "org.freedesktop.DBus.Error.ServiceUnknown" ||
+                name == "org.freedesktop.DBus.Error.NameHasNoOwner" ||
+                name == "org.freedesktop.DBus.Error.AccessDenied" ||
+                rc == -ENOTCONN || rc == -ECONNRESET)
+            throw VersionException{reason};
+        throw std::runtime_error{reason};
+    }
+    sd_bus_error_free(&error);
+    return reply;
+}
+
+void SnapperDBus::appendUserdata(sd_bus_message* message, const std::map<std::string, std::string>& userdata) {
+    int rc;
+    if ((rc = sd_bus_message_open_container(message, 'a', "{ss}")) < 0)
+        throw std::runtime_error{"Creating userdata container failed: " + std::string(strerror(-rc))};
+    for (auto& [key, value]: userdata) {
+        if ((rc = sd_bus_message_append(message, "{ss}", key.c_str(), value.c_str())) < 0)
+            throw std::runtime_error{"Appending userdata '" + key + "' failed: " + std::string(strerror(-rc))};
+    }
+    if ((rc = sd_bus_message_close_container(message)) < 0)
+        throw std::runtime_error{"Closing userdata container failed: " + std::string(strerror(-rc))};
+}
+
+SnapperDBus::SnapshotInfo SnapperDBus::readSnapshot(sd_bus_message* message) {
+    SnapshotInfo snapshot;
+    const char* description;
+    const char* cleanup;
+    int rc;
+
+    if ((rc = sd_bus_message_read(message, "uquxuss", &snapshot.number, &snapshot.type, &snapshot.preNumber,
+            &snapshot.date, &snapshot.uid, &description, &cleanup)) < 0)
+        throw std::runtime_error{"Reading snapshot data failed: " + std::string(strerror(-rc))};
+    snapshot.description = description;
+    snapshot.cleanup = cleanup;
+
+    if ((rc = sd_bus_message_enter_container(message, 'a', "{ss}")) < 0)
+        throw std::runtime_error{"Reading snapshot userdata failed: " + std::string(strerror(-rc))};
+    const char* key;
+    const char* value;
+    while ((rc = sd_bus_message_read(message, "{ss}", &key, &value)) > 0) {
+        snapshot.userdata.emplace(key, value);
+    }
+    if (rc < 0)
+        throw std::runtime_error{"Reading snapshot userdata failed: " + std::string(strerror(-rc))};
+    sd_bus_message_exit_container(message);
+
+    return snapshot;
+}
+
+unsigned int SnapperDBus::createSnapshot(unsigned int parent, bool readOnly, const std::string& description,
+                                         const std::string& cleanup, const std::map<std::string, std::string>& userdata) {
+    sd_bus_message* message = newCall("CreateSingleSnapshotV2");
+    try {
+        int rc;
+        if ((rc = sd_bus_message_append(message, "ubss", parent, readOnly, description.c_str(), cleanup.c_str())) < 0)
+            throw std::runtime_error{"Appending snapshot parameters failed: " + std::string(strerror(-rc))};
+        appendUserdata(message, userdata);
+    } catch (const std::exception &e) {
+        sd_bus_message_unref(message);
+        throw;
+    }
+
+    sd_bus_message* reply = call(message, "CreateSingleSnapshotV2");
+    unsigned int number;
+    int rc = sd_bus_message_read(reply, "u", &number);
+    sd_bus_message_unref(reply);
+    if (rc < 0)
+        throw std::runtime_error{"Reading number of new snapshot failed: " + std::string(strerror(-rc))};
+    return number;
+}
+
+std::vector<SnapperDBus::SnapshotInfo> SnapperDBus::listSnapshots() {
+    std::vector<SnapshotInfo> snapshots;
+    sd_bus_message* reply = call(newCall("ListSnapshots"), "ListSnapshots");
+    try {
+        int rc;
+        if ((rc = sd_bus_message_enter_container(reply, 'a', "(uquxussa{ss})")) < 0)
+            throw std::runtime_error{"Reading snapshot list failed: " + std::string(strerror(-rc))};
+        while ((rc = sd_bus_message_enter_container(reply, 'r', "uquxussa{ss}")) > 0) {
+            snapshots.push_back(readSnapshot(reply));
+            sd_bus_message_exit_container(reply);
+        }
+        if (rc < 0)
+            throw std::runtime_error{"Reading snapshot list failed: " + std::string(strerror(-rc))};
+    } catch (const std::exception &e) {
+        sd_bus_message_unref(reply);
+        throw;
+    }
+    sd_bus_message_unref(reply);
+    return snapshots;
+}
+
+SnapperDBus::SnapshotInfo SnapperDBus::getSnapshot(unsigned int number) {
+    sd_bus_message* message = newCall("GetSnapshot");
+    int rc;
+    if ((rc = sd_bus_message_append(message, "u", number)) < 0) {
+        sd_bus_message_unref(message);
+        throw std::runtime_error{"Appending snapshot number failed: " + std::string(strerror(-rc))};
+    }
+
+    sd_bus_message* reply = call(message, "GetSnapshot");
+    SnapshotInfo snapshot;
+    try {
+        if ((rc = sd_bus_message_enter_container(reply, 'r', "uquxussa{ss}")) < 0)
+            throw std::runtime_error{"Reading snapshot " + std::to_string(number) + " failed: " + std::string(strerror(-rc))};
+        snapshot = readSnapshot(reply);
+    } catch (const std::exception &e) {
+        sd_bus_message_unref(reply);
+        throw;
+    }
+    sd_bus_message_unref(reply);
+    return snapshot;
+}
+
+void SnapperDBus::setSnapshot(const SnapshotInfo& snapshot) {
+    sd_bus_message* message = newCall("SetSnapshot");
+    try {
+        int rc;
+        if ((rc = sd_bus_message_append(message, "uss", snapshot.number, snapshot.description.c_str(), snapshot.cleanup.c_str())) < 0)
+            throw std::runtime_error{"Appending snapshot parameters failed: " + std::string(strerror(-rc))};
+        appendUserdata(message, snapshot.userdata);
+    } catch (const std::exception &e) {
+        sd_bus_message_unref(message);
+        throw;
+    }
+    sd_bus_message_unref(call(message, "SetSnapshot"));
+}
+
+void SnapperDBus::deleteSnapshots(const std::vector<unsigned int>& numbers) {
+    sd_bus_message* message = newCall("DeleteSnapshots");
+    int rc;
+    if ((rc = sd_bus_message_append_array(message, 'u', numbers.data(), numbers.size() * sizeof(unsigned int))) < 0) {
+        sd_bus_message_unref(message);
+        throw std::runtime_error{"Appending snapshot numbers failed: " + std::string(strerror(-rc))};
+    }
+    sd_bus_message_unref(call(message, "DeleteSnapshots"));
+}
+
+unsigned int SnapperDBus::getDefaultSnapshot() {
+    sd_bus_message* reply = call(newCall("GetDefaultSnapshot"), "GetDefaultSnapshot");
+    int valid;
+    unsigned int number;
+    int rc = sd_bus_message_read(reply, "bu", &valid, &number);
+    sd_bus_message_unref(reply);
+    if (rc < 0 || !valid)
+        throw std::runtime_error{"Couldn't determine default snapshot number"};
+    return number;
+}
+
+void SnapperDBus::setDefaultSnapshot(unsigned int number) {
+    sd_bus_message* message = newCall("SetDefaultSnapshot");
+    int rc;
+    if ((rc = sd_bus_message_append(message, "u", number)) < 0) {
+        sd_bus_message_unref(message);
+        throw std::runtime_error{"Appending snapshot number failed: " + std::string(strerror(-rc))};
+    }
+    sd_bus_message_unref(call(message, "SetDefaultSnapshot"));
+}
+
+bool SnapperDBus::isSnapshotReadOnly(unsigned int number) {
+    sd_bus_message* message = newCall("IsSnapshotReadOnly");
+    int rc;
+    if ((rc = sd_bus_message_append(message, "u", number)) < 0) {
+        sd_bus_message_unref(message);
+        throw std::runtime_error{"Appending snapshot number failed: " + std::string(strerror(-rc))};
+    }
+    sd_bus_message* reply = call(message, "IsSnapshotReadOnly");
+    int readOnly;
+    rc = sd_bus_message_read(reply, "b", &readOnly);
+    sd_bus_message_unref(reply);
+    if (rc < 0)
+        throw std::runtime_error{"Couldn't determine read-only state"};
+    return readOnly;
+}
+
+void SnapperDBus::setSnapshotReadOnly(unsigned int number, bool readOnly) {
+    sd_bus_message* message = newCall("SetSnapshotReadOnly");
+    int rc;
+    if ((rc = sd_bus_message_append(message, "ub", number, readOnly)) < 0) {
+        sd_bus_message_unref(message);
+        throw std::runtime_error{"Appending snapshot parameters failed: " + std::string(strerror(-rc))};
+    }
+    sd_bus_message_unref(call(message, "SetSnapshotReadOnly"));
+}
+
+} // namespace TransactionalUpdate
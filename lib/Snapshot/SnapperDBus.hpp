@@ -0,0 +1,62 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Client for snapperd's D-Bus interface (org.opensuse.Snapper); one instance
+  holds a single system bus connection which is shared between the snapshot
+  manager and all snapshots opened by it.
+ */
+
+#ifndef T_U_SNAPPERDBUS_H
+#define T_U_SNAPPERDBUS_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+typedef struct sd_bus sd_bus;
+typedef struct sd_bus_message sd_bus_message;
+
+namespace TransactionalUpdate {
+
+class SnapperDBus {
+public:
+    struct SnapshotInfo {
+        unsigned int number = 0;
+        uint16_t type = 0;
+        unsigned int preNumber = 0;
+        int64_t date = 0;
+        unsigned int uid = 0;
+        std::string description;
+        std::string cleanup;
+        std::map<std::string, std::string> userdata;
+    };
+
+    SnapperDBus(std::string config = "root");
+    virtual ~SnapperDBus();
+    SnapperDBus(const SnapperDBus&) = delete;
+    void operator=(const SnapperDBus&) = delete;
+
+    unsigned int createSnapshot(unsigned int parent, bool readOnly, const std::string& description,
+                                const std::string& cleanup, const std::map<std::string, std::string>& userdata);
+    std::vector<SnapshotInfo> listSnapshots();
+    SnapshotInfo getSnapshot(unsigned int number);
+    void setSnapshot(const SnapshotInfo& snapshot);
+    void deleteSnapshots(const std::vector<unsigned int>& numbers);
+    unsigned int getDefaultSnapshot();
+    void setDefaultSnapshot(unsigned int number);
+    bool isSnapshotReadOnly(unsigned int number);
+    void setSnapshotReadOnly(unsigned int number, bool readOnly);
+private:
+    sd_bus* bus = nullptr;
+    std::string config;
+    sd_bus_message* newCall(const char* method);
+    sd_bus_message* call(sd_bus_message* message, const char* method);
+    static void appendUserdata(sd_bus_message* message, const std::map<std::string, std::string>& userdata);
+    static SnapshotInfo readSnapshot(sd_bus_message* message);
+};
+
+} // namespace TransactionalUpdate
+
+#endif // T_U_SNAPPERDBUS_H
@@ -10,6 +10,8 @@
 #include "Log.hpp"
 #include "Snapshot/Snapper.hpp"
 #include "Snapshot/Podman.hpp"
+#include "Snapshot/Btrfs.hpp"
+#include "Subvolume.hpp"
 using namespace std;
 
 namespace TransactionalUpdate {
@@ -21,6 +23,8 @@ unique_ptr<SnapshotManager> SnapshotFactory::get() {
             sm = "snapper";
         else if (filesystem::exists("/usr/bin/podman"))
             sm = "podman";
+        else if (filesystem::exists("/.snapshots") && Subvolume::isBtrfs("/.snapshots"))
+            sm = "btrfs";
         else
             throw runtime_error{"No snapshot manager found using 'auto'."};
     }
@@ -30,9 +34,68 @@ unique_ptr<SnapshotManager> SnapshotFactory::get() {
         return make_unique<Snapper>();
     } else if (sm == "podman") {
         return make_unique<Podman>();
+    } else if (sm == "btrfs") {
+        return make_unique<Btrfs>();
     } else {
         throw runtime_error{"Unsupported snapshot manager '" + sm + "'."};
     }
 }
 
+SnapshotTable::SnapshotTable(vector<string> columns)
+    : columns{std::move(columns)}, cells(this->columns.size())
+{
+}
+
+size_t SnapshotTable::rows() const {
+    return cells.empty() ? 0 : cells.back().size();
+}
+
+const vector<string>& SnapshotTable::getColumns() const {
+    return columns;
+}
+
+size_t SnapshotTable::columnIndex(string_view column) const {
+    for (size_t i = 0; i < columns.size(); i++) {
+        if (columns[i] == column)
+            return i;
+    }
+    return columns.size();
+}
+
+string_view SnapshotTable::get(size_t row, size_t column) const {
+    if (row >= rows())
+        throw out_of_range{"Snapshot list has no row " + to_string(row) + "."};
+    if (column >= columns.size())
+        return {};
+    const Cell& cell = cells[column][row];
+    return string_view{arena}.substr(cell.offset, cell.length);
+}
+
+string_view SnapshotTable::get(size_t row, string_view column) const {
+    return get(row, columnIndex(column));
+}
+
+const char* SnapshotTable::c_str(size_t row, string_view column) const {
+    size_t index = columnIndex(column);
+    if (row >= rows())
+        throw out_of_range{"Snapshot list has no row " + to_string(row) + "."};
+    if (index >= columns.size())
+        return "";
+    return arena.c_str() + cells[index][row].offset;
+}
+
+void SnapshotTable::append(string_view value) {
+    if (columns.empty())
+        throw logic_error{"Cannot add values to a snapshot list without columns."};
+    cells[nextColumn].push_back({arena.size(), value.size()});
+    arena.append(value);
+    arena.push_back('\0');
+    nextColumn = (nextColumn + 1) % columns.size();
+}
+
+void SnapshotTable::finishRow() {
+    while (nextColumn != 0)
+        append("");
+}
+
 } // namespace TransactionalUpdate
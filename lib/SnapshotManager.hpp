@@ -12,14 +12,15 @@
 #ifndef T_U_SNAPSHOTMANAGER_H
 #define T_U_SNAPSHOTMANAGER_H
 
-#include <deque>
-#include <map>
 #include <memory>
 #include <string>
+#include <string_view>
+#include <vector>
 
 namespace TransactionalUpdate {
 
 class Snapshot;
+struct SnapshotTable;
 
 /**
  * @brief The SnapshotManager class is an abstract class and may return different implementations, though
@@ -43,7 +44,7 @@ public:
      * used as a default.
      * @return The list of snapshots with the processed columns.
      */
-    virtual std::deque<std::map<std::string, std::string>> getList(std::string columns) = 0;
+    virtual SnapshotTable getList(std::string columns) = 0;
 
     /**
      * @brief getCurrent
@@ -65,6 +66,23 @@ public:
      */
     virtual void deleteSnap(std::string id) = 0;
 
+    /**
+     * @brief deleteSnaps Deletes all given snapshots with a single backend operation; the same
+     * restrictions as for deleteSnap() apply.
+     * @param ids IDs of the snapshots to be deleted.
+     * @param wait If false the method returns as soon as the snapshots are gone from the
+     * snapshot list, while the space is still being reclaimed by the btrfs cleaner in the
+     * background; use isCleanupPending() to check for or wait for completion in that case.
+     */
+    virtual void deleteSnaps(std::vector<std::string> ids, bool wait = false) = 0;
+
+    /**
+     * @brief isCleanupPending
+     * @param wait If true block until the cleanup of all snapshots deleted so far has finished.
+     * @return Whether the space of deleted snapshots is still being reclaimed.
+     */
+    virtual bool isCleanupPending(bool wait = false) = 0;
+
     /**
      * @brief Set the given snapshot ID as the default snapshot ID
      * @param id ID of the snapshot to be rolled back to.
@@ -84,8 +102,60 @@ public:
     static std::unique_ptr<SnapshotManager> get();
 };
 
+/**
+ * @brief The SnapshotTable struct holds the result of SnapshotManager::getList in columnar form:
+ * all values are stored in a single string arena (each one NUL terminated), and each column
+ * holds the position of its values in that arena.
+ */
 struct SnapshotTable {
+    SnapshotTable() = default;
+    explicit SnapshotTable(std::vector<std::string> columns);
+
+    /**
+     * @brief rows
+     * @return Number of (complete) rows in the table.
+     */
+    size_t rows() const;
 
+    /**
+     * @brief getColumns
+     * @return The column names in the order they were requested.
+     */
+    const std::vector<std::string>& getColumns() const;
+
+    /**
+     * @brief get Access a single value; the returned view is valid as long as the table is
+     * neither modified nor destroyed.
+     * @param row Row number, throws std::out_of_range if the row does not exist.
+     * @param column Column name; an empty value is returned for unknown columns.
+     */
+    std::string_view get(size_t row, std::string_view column) const;
+    std::string_view get(size_t row, size_t column) const;
+
+    /**
+     * @brief c_str Same as get(), but returns a NUL terminated string.
+     */
+    const char* c_str(size_t row, std::string_view column) const;
+
+    /**
+     * @brief append Appends the value of the next cell, filling the table row by row.
+     */
+    void append(std::string_view value);
+
+    /**
+     * @brief finishRow Fills the remaining cells of an incomplete row with empty values.
+     */
+    void finishRow();
+private:
+    struct Cell {
+        size_t offset;
+        size_t length;
+    };
+    std::vector<std::string> columns;
+    std::vector<std::vector<Cell>> cells;
+    std::string arena;
+    size_t nextColumn = 0;
+    size_t columnIndex(std::string_view column) const;
 };
 
 } // namespace TransactionalUpdate
@@ -0,0 +1,181 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Pool of pre-created snapshots
+ */
+
+#include "SnapshotPool.hpp"
+#include "Configuration.hpp"
+#include "Log.hpp"
+#include "Snapshot.hpp"
+#include "SnapshotManager.hpp"
+#include "Snapshot/Podman.hpp"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/file.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+namespace TransactionalUpdate {
+
+static const std::string poolKey = "transactional-update-pool";
+static const std::string inProgressKey = "transactional-update-in-progress";
+
+SnapshotPool::SnapshotPool(SnapshotManager& snapshotMgr)
+    : snapshotMgr{snapshotMgr}
+{
+    // Serialize all pool operations, so an entry can't be claimed twice
+    lockFd = open("/.snapshots", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (lockFd < 0)
+        throw std::runtime_error{"Opening /.snapshots for locking the snapshot pool failed: " + std::string(strerror(errno))};
+    if (flock(lockFd, LOCK_EX) < 0) {
+        int err = errno;
+        close(lockFd);
+        throw std::runtime_error{"Locking the snapshot pool failed: " + std::string(strerror(err))};
+    }
+}
+
+SnapshotPool::SnapshotPool(SnapshotManager& snapshotMgr, int lockFd)
+    : snapshotMgr{snapshotMgr}, lockFd{lockFd}
+{
+}
+
+SnapshotPool::~SnapshotPool() {
+    if (lockFd >= 0)
+        close(lockFd);
+}
+
+size_t SnapshotPool::getSize(SnapshotManager& snapshotMgr) {
+    // Podman snapshots aren't plain copies of their base, but contain the pulled image
+    if (dynamic_cast<Podman*>(&snapshotMgr))
+        return 0;
+    try {
+        return std::stoul(config.get("POOL_SIZE"));
+    } catch (const std::logic_error &e) {
+        throw std::invalid_argument{"Invalid value '" + config.get("POOL_SIZE") + "' for POOL_SIZE."};
+    }
+}
+
+std::map<std::string, std::string> SnapshotPool::getEntries() {
+    std::map<std::string, std::string> entries;
+    SnapshotTable list = snapshotMgr.getList("number,userdata");
+    for (size_t row = 0; row < list.rows(); row++) {
+        // Userdata is formatted as "key1=value1, key2=value2"
+        std::string_view userdata = list.get(row, "userdata");
+        size_t pos = userdata.find(poolKey + "=");
+        if (pos == std::string_view::npos || (pos > 0 && userdata[pos - 1] != ' ' && userdata[pos - 1] != ','))
+            continue;
+        std::string_view base = userdata.substr(pos + poolKey.length() + 1);
+        base = base.substr(0, base.find(','));
+        entries.emplace(list.get(row, "number"), base);
+    }
+    return entries;
+}
+
+bool SnapshotPool::isEntry(const std::string& id) {
+    return getEntries().count(id) > 0;
+}
+
+std::unique_ptr<Snapshot> SnapshotPool::claim(std::string base, std::string description) {
+    for (auto& [id, entryBase]: getEntries()) {
+        if (entryBase != base)
+            continue;
+        std::unique_ptr<Snapshot> snapshot = snapshotMgr.open(id);
+        snapshot->modify(description, {{poolKey, ""}, {inProgressKey, "yes"}}, "number");
+        tulog.debug("Claimed snapshot ", id, " from the snapshot pool.");
+        return snapshot;
+    }
+    tulog.debug("Snapshot pool for base ", base, " is empty.");
+    return nullptr;
+}
+
+void SnapshotPool::refill(std::string base) {
+    size_t available = 0;
+    for (auto& [id, entryBase]: getEntries()) {
+        if (entryBase == base)
+            available++;
+    }
+    for (size_t size = getSize(snapshotMgr); available < size; available++) {
+        // Until tagged the snapshot is marked as in progress, so an interrupted refill will be
+        // cleaned up just as any other aborted transaction; entries must not be removed by
+        // snapper's number cleanup, so it is only set once the entry is claimed
+        std::unique_ptr<Snapshot> snapshot = snapshotMgr.create(base, "Snapshot pool entry for #" + base);
+        snapshot->modify("", {{inProgressKey, ""}, {poolKey, base}}, "");
+        tulog.info("Added snapshot " + snapshot->getUid() + " to the snapshot pool.");
+    }
+}
+
+void SnapshotPool::prune(std::string base) {
+    std::vector<std::string> stale;
+    for (auto& [id, entryBase]: getEntries()) {
+        if (entryBase != base)
+            stale.push_back(id);
+    }
+    if (stale.empty())
+        return;
+    tulog.info("Removing ", stale.size(), " outdated snapshot(s) from the snapshot pool.");
+    snapshotMgr.deleteSnaps(stale);
+}
+
+// To be called whenever the default snapshot changed: entries based on other snapshots
+// are outdated and will be removed; the pool is only refilled if the new base is
+// read-only, as entries of a writable base could miss later changes.
+void SnapshotPool::update(std::string base) {
+    prune(base);
+    if (getSize(snapshotMgr) == 0)
+        return;
+    if (!snapshotMgr.open(base)->isReadOnly()) {
+        tulog.info("Snapshot " + base + " is writable, not filling the snapshot pool.");
+        return;
+    }
+    refill(base);
+}
+
+void SnapshotPool::updateInBackground(std::string base) {
+    pid_t pid = fork();
+    if (pid < 0)
+        throw std::runtime_error{"Forking for the snapshot pool update failed: " + std::string(strerror(errno))};
+    if (pid == 0) {
+        // Fork again, so long running callers such as tukitd don't have to reap the worker
+        pid_t worker = fork();
+        if (worker != 0)
+            _exit(worker < 0 ? 1 : 0);
+        setsid();
+        // The caller's output may be read from a pipe and tukitd's clients wait for their
+        // connection to be closed, so don't keep any of the inherited descriptors open
+        for (long fd = STDERR_FILENO + 1; fd < sysconf(_SC_OPEN_MAX); fd++) {
+            if (fd != lockFd)
+                close(static_cast<int>(fd));
+        }
+        int devNull = open("/dev/null", O_RDWR);
+        if (devNull >= 0) {
+            dup2(devNull, STDIN_FILENO);
+            dup2(devNull, STDOUT_FILENO);
+            dup2(devNull, STDERR_FILENO);
+            if (devNull > STDERR_FILENO)
+                close(devNull);
+        }
+        tulog.setLogOutput("syslog");
+        int rc = 0;
+        try {
+            // Use a new snapshot manager, connections such as snapper's D-Bus one can't be
+            // shared with the parent process; the inherited lock is kept until the worker exits
+            std::unique_ptr<SnapshotManager> workerMgr = SnapshotFactory::get();
+            SnapshotPool{*workerMgr, lockFd}.update(base);
+        } catch (const std::exception &e) {
+            tulog.error("Updating the snapshot pool failed: ", e.what());
+            rc = 1;
+        }
+        _exit(rc);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        throw std::runtime_error{"Starting the snapshot pool update failed."};
+    tulog.info("Updating the snapshot pool in the background.");
+}
+
+} // namespace TransactionalUpdate
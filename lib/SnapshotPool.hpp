@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Pool of pre-created snapshots, so new transactions don't have to wait for
+  the snapshot creation. Pool entries are regular snapshots tagged with the
+  "transactional-update-pool" userdata key, its value being the ID of the
+  base snapshot.
+ */
+
+#ifndef T_U_SNAPSHOTPOOL_H
+#define T_U_SNAPSHOTPOOL_H
+
+#include <map>
+#include <memory>
+#include <string>
+
+namespace TransactionalUpdate {
+
+class Snapshot;
+class SnapshotManager;
+
+class SnapshotPool
+{
+public:
+    SnapshotPool(SnapshotManager& snapshotMgr);
+    virtual ~SnapshotPool();
+    SnapshotPool(const SnapshotPool&) = delete;
+    void operator=(const SnapshotPool&) = delete;
+    // Pool entries, mapping the snapshot ID to the ID of its base snapshot
+    std::map<std::string, std::string> getEntries();
+    bool isEntry(const std::string& id);
+    std::unique_ptr<Snapshot> claim(std::string base, std::string description);
+    void refill(std::string base);
+    void prune(std::string base);
+    void update(std::string base);
+    // Runs update() in a detached process, so the caller doesn't have to wait for the
+    // new entries; that process takes over the lock until it is done
+    void updateInBackground(std::string base);
+    // The configured pool size; always 0 for snapshot managers which can't use a pool
+    static size_t getSize(SnapshotManager& snapshotMgr);
+private:
+    // Uses a lock file descriptor already holding the pool lock
+    SnapshotPool(SnapshotManager& snapshotMgr, int lockFd);
+    SnapshotManager& snapshotMgr;
+    int lockFd = -1;
+};
+
+} // namespace TransactionalUpdate
+
+#endif // T_U_SNAPSHOTPOOL_H
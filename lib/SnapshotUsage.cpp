@@ -0,0 +1,111 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Computed space accounting columns for snapshot lists
+ */
+
+#include "SnapshotUsage.hpp"
+#include "Log.hpp"
+#include "Subvolume.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+namespace TransactionalUpdate {
+
+static const std::array<std::string, 3> usageColumns = {"referenced", "exclusive", "changed"};
+
+static bool isUsageColumn(const std::string& column) {
+    return std::find(usageColumns.begin(), usageColumns.end(), column) != usageColumns.end();
+}
+
+static std::vector<std::string> splitColumns(const std::string& columns) {
+    std::vector<std::string> fields;
+    std::stringstream columnsStream(columns);
+    for (std::string field; std::getline(columnsStream, field, ','); ) {
+        fields.push_back(field);
+    }
+    return fields;
+}
+
+// Returns the columns to be queried from the snapshot backend, i.e. without the computed
+// columns, but including the snapshot number if it is required for computing them
+std::string SnapshotUsage::getBaseColumns(const std::string& columns) {
+    std::vector<std::string> fields = splitColumns(columns);
+    if (std::none_of(fields.begin(), fields.end(), isUsageColumn))
+        return columns;
+
+    std::string base;
+    bool hasNumber = false;
+    for (auto& field: fields) {
+        if (isUsageColumn(field))
+            continue;
+        hasNumber |= (field == "number");
+        base += (base.empty() ? "" : ",") + field;
+    }
+    if (!hasNumber)
+        base = "number" + (base.empty() ? "" : "," + base);
+    return base;
+}
+
+// Adds the computed columns to a list retrieved with getBaseColumns(); the values are
+// determined in parallel, as especially the changed bytes require a full tree search
+SnapshotTable SnapshotUsage::addColumns(SnapshotTable list, const std::string& columns, std::filesystem::path snapshotsDir) {
+    std::vector<std::string> fields = splitColumns(columns);
+    if (std::none_of(fields.begin(), fields.end(), isUsageColumn))
+        return list;
+
+    bool wantQgroup = std::find(fields.begin(), fields.end(), "referenced") != fields.end() ||
+        std::find(fields.begin(), fields.end(), "exclusive") != fields.end();
+    bool wantChanged = std::find(fields.begin(), fields.end(), "changed") != fields.end();
+
+    std::vector<std::array<std::string, 3>> values(list.rows());
+    std::atomic<size_t> nextRow{0};
+    auto worker = [&]() {
+        for (size_t row = nextRow++; row < list.rows(); row = nextRow++) {
+            std::string number{list.get(row, "number")};
+            if (number == "0")
+                continue; // the current file system, not a snapshot
+            try {
+                Subvolume subvolume{snapshotsDir / number / "snapshot"};
+                if (wantQgroup) {
+                    if (auto usage = subvolume.getQgroupUsage()) {
+                        values[row][0] = std::to_string(usage->referenced);
+                        values[row][1] = std::to_string(usage->exclusive);
+                    }
+                }
+                if (wantChanged)
+                    values[row][2] = std::to_string(subvolume.getChangedBytes());
+            } catch (const std::exception &e) {
+                tulog.debug("Cannot determine space usage of snapshot ", number, ": ", e.what());
+            }
+        }
+    };
+    size_t threadCount = std::min<size_t>(std::max(std::thread::hardware_concurrency(), 1u), list.rows());
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < threadCount; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread: threads) {
+        thread.join();
+    }
+
+    SnapshotTable result{fields};
+    for (size_t row = 0; row < list.rows(); row++) {
+        for (auto& field: fields) {
+            auto usageColumn = std::find(usageColumns.begin(), usageColumns.end(), field);
+            if (usageColumn != usageColumns.end())
+                result.append(values[row][usageColumn - usageColumns.begin()]);
+            else
+                result.append(list.get(row, field));
+        }
+    }
+    return result;
+}
+
+} // namespace TransactionalUpdate
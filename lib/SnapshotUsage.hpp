@@ -0,0 +1,28 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Computed space accounting columns ("referenced", "exclusive" and "changed")
+  for snapshot lists, determined via btrfs ioctls.
+ */
+
+#ifndef T_U_SNAPSHOTUSAGE_H
+#define T_U_SNAPSHOTUSAGE_H
+
+#include "SnapshotManager.hpp"
+#include <filesystem>
+#include <string>
+
+namespace TransactionalUpdate {
+
+class SnapshotUsage
+{
+public:
+    SnapshotUsage() = delete;
+    static std::string getBaseColumns(const std::string& columns);
+    static SnapshotTable addColumns(SnapshotTable list, const std::string& columns, std::filesystem::path snapshotsDir = "/.snapshots");
+};
+
+} // namespace TransactionalUpdate
+
+#endif // T_U_SNAPSHOTUSAGE_H
@@ -0,0 +1,384 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Wrapper for btrfs subvolume ioctls
+ */
+
+#include "Subvolume.hpp"
+#include "Log.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <endian.h>
+#include <fcntl.h>
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
+#include <linux/magic.h>
+#include <stdexcept>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+namespace TransactionalUpdate {
+
+Subvolume::Subvolume(std::filesystem::path path)
+    : path{std::move(path)}
+{
+    fd = open(this->path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        throw std::runtime_error{"Opening subvolume '" + this->path.native() + "' failed: " + std::string(strerror(errno))};
+}
+
+Subvolume::Subvolume(Subvolume&& other) noexcept
+{
+    std::swap(path, other.path);
+    std::swap(fd, other.fd);
+}
+
+Subvolume::~Subvolume() {
+    if (fd >= 0)
+        close(fd);
+}
+
+uint64_t Subvolume::getId() {
+    struct btrfs_ioctl_ino_lookup_args args{};
+    args.treeid = 0;
+    args.objectid = BTRFS_FIRST_FREE_OBJECTID;
+    if (ioctl(fd, BTRFS_IOC_INO_LOOKUP, &args) < 0)
+        throw std::runtime_error{"Determining subvolume id of '" + path.native() + "' failed: " + std::string(strerror(errno))};
+    return args.treeid;
+}
+
+uint64_t Subvolume::getFlags() {
+    uint64_t flags;
+    if (ioctl(fd, BTRFS_IOC_SUBVOL_GETFLAGS, &flags) < 0)
+        throw std::runtime_error{"Reading subvolume flags of '" + path.native() + "' failed: " + std::string(strerror(errno))};
+    return flags;
+}
+
+bool Subvolume::isReadOnly() {
+    return getFlags() & BTRFS_SUBVOL_RDONLY;
+}
+
+void Subvolume::setReadOnly(bool readonly) {
+    uint64_t flags = getFlags();
+    if (readonly)
+        flags |= BTRFS_SUBVOL_RDONLY;
+    else
+        flags &= ~BTRFS_SUBVOL_RDONLY;
+    if (ioctl(fd, BTRFS_IOC_SUBVOL_SETFLAGS, &flags) < 0)
+        throw std::runtime_error{"Setting subvolume '" + path.native() + "' " + (readonly ? "read-only" : "read-write") + " failed: " + std::string(strerror(errno))};
+}
+
+void Subvolume::setDefault() {
+    uint64_t id = getId();
+    if (ioctl(fd, BTRFS_IOC_DEFAULT_SUBVOL, &id) < 0)
+        throw std::runtime_error{"Setting '" + path.native() + "' as default subvolume failed: " + std::string(strerror(errno))};
+}
+
+// Reads the level 0 qgroup of the subvolume; only available if quotas are enabled
+std::optional<Subvolume::QgroupUsage> Subvolume::getQgroupUsage() {
+    std::optional<QgroupUsage> usage;
+    struct btrfs_ioctl_search_key key{};
+    key.tree_id = BTRFS_QUOTA_TREE_OBJECTID;
+    key.min_type = key.max_type = BTRFS_QGROUP_INFO_KEY;
+    key.min_offset = key.max_offset = getId();
+    key.max_transid = UINT64_MAX;
+    int err = treeSearch(fd, key, [&](const struct btrfs_ioctl_search_header& header, const char* data) {
+        if (header.type != BTRFS_QGROUP_INFO_KEY || header.len < sizeof(struct btrfs_qgroup_info_item))
+            return;
+        auto item = reinterpret_cast<const struct btrfs_qgroup_info_item*>(data);
+        usage = QgroupUsage{le64toh(item->rfer), le64toh(item->excl)};
+    });
+    if (err == ENOENT)
+        return std::nullopt;
+    if (err)
+        throw std::runtime_error{"Reading qgroup of '" + path.native() + "' failed: " + std::string(strerror(err))};
+    return usage;
+}
+
+// Sums up the size of all file extents written since the subvolume was created, i.e. the
+// data changed compared to the snapshot's parent
+uint64_t Subvolume::getChangedBytes() {
+    struct btrfs_ioctl_get_subvol_info_args info{};
+    if (ioctl(fd, BTRFS_IOC_GET_SUBVOL_INFO, &info) < 0)
+        throw std::runtime_error{"Reading subvolume information of '" + path.native() + "' failed: " + std::string(strerror(errno))};
+
+    uint64_t changed = 0;
+    struct btrfs_ioctl_search_key key{};
+    key.tree_id = info.treeid;
+    key.max_objectid = UINT64_MAX;
+    key.min_type = key.max_type = BTRFS_EXTENT_DATA_KEY;
+    key.max_offset = UINT64_MAX;
+    key.min_transid = info.otransid + 1;
+    key.max_transid = UINT64_MAX;
+    int err = treeSearch(fd, key, [&](const struct btrfs_ioctl_search_header& header, const char* data) {
+        // The transid filter works on tree blocks, so the items have to be checked individually
+        if (header.type != BTRFS_EXTENT_DATA_KEY || header.len < offsetof(struct btrfs_file_extent_item, disk_bytenr))
+            return;
+        auto item = reinterpret_cast<const struct btrfs_file_extent_item*>(data);
+        if (le64toh(item->generation) <= info.otransid)
+            return;
+        if (item->type == BTRFS_FILE_EXTENT_INLINE)
+            changed += le64toh(item->ram_bytes);
+        else if (header.len >= sizeof(struct btrfs_file_extent_item) && item->disk_bytenr != 0)
+            changed += le64toh(item->num_bytes);
+    });
+    if (err)
+        throw std::runtime_error{"Searching changes in '" + path.native() + "' failed: " + std::string(strerror(err))};
+    return changed;
+}
+
+uint64_t Subvolume::getGeneration() {
+    // The generation is only updated when the btrfs transaction is committed
+    if (syncfs(fd) < 0)
+        throw std::runtime_error{"Syncing '" + path.native() + "' failed: " + std::string(strerror(errno))};
+    struct btrfs_ioctl_get_subvol_info_args info{};
+    if (ioctl(fd, BTRFS_IOC_GET_SUBVOL_INFO, &info) < 0)
+        throw std::runtime_error{"Reading subvolume information of '" + path.native() + "' failed: " + std::string(strerror(errno))};
+    return info.generation;
+}
+
+// Inode items are rewritten whenever an inode changes, so together with the transid filter of the
+// tree search only the tree blocks modified since the snapshot was taken have to be read
+std::vector<Subvolume::ChangedInode> Subvolume::getChangedInodes() {
+    struct btrfs_ioctl_get_subvol_info_args info{};
+    if (ioctl(fd, BTRFS_IOC_GET_SUBVOL_INFO, &info) < 0)
+        throw std::runtime_error{"Reading subvolume information of '" + path.native() + "' failed: " + std::string(strerror(errno))};
+
+    std::vector<ChangedInode> inodes;
+    struct btrfs_ioctl_search_key key{};
+    key.tree_id = info.treeid;
+    key.min_objectid = BTRFS_FIRST_FREE_OBJECTID;
+    key.max_objectid = BTRFS_LAST_FREE_OBJECTID;
+    key.min_type = key.max_type = BTRFS_INODE_ITEM_KEY;
+    key.max_offset = UINT64_MAX;
+    key.min_transid = info.otransid + 1;
+    key.max_transid = UINT64_MAX;
+    int err = treeSearch(fd, key, [&](const struct btrfs_ioctl_search_header& header, const char* data) {
+        if (header.type != BTRFS_INODE_ITEM_KEY || header.len < sizeof(struct btrfs_inode_item))
+            return;
+        auto item = reinterpret_cast<const struct btrfs_inode_item*>(data);
+        if (le64toh(item->transid) <= info.otransid)
+            return;
+        inodes.push_back({header.objectid, le64toh(item->generation) > info.otransid});
+    });
+    if (err)
+        throw std::runtime_error{"Searching changes in '" + path.native() + "' failed: " + std::string(strerror(err))};
+    return inodes;
+}
+
+std::vector<std::string> Subvolume::getInodePaths(uint64_t inode) {
+    // The subvolume's root directory has no back reference
+    if (inode == BTRFS_FIRST_FREE_OBJECTID)
+        return {""};
+
+    // The kernel limits the result to 4 KiB; files with more hard links are reported partially
+    std::vector<uint64_t> buf(4096 / sizeof(uint64_t));
+    struct btrfs_ioctl_ino_path_args args{};
+    args.inum = inode;
+    args.size = buf.size() * sizeof(uint64_t);
+    args.fspath = reinterpret_cast<uintptr_t>(buf.data());
+    if (ioctl(fd, BTRFS_IOC_INO_PATHS, &args) < 0) {
+        if (errno == ENOENT)
+            return {};
+        throw std::runtime_error{"Resolving inode " + std::to_string(inode) + " in '" + path.native() + "' failed: " + std::string(strerror(errno))};
+    }
+    auto container = reinterpret_cast<const struct btrfs_data_container*>(buf.data());
+    std::vector<std::string> paths;
+    for (uint32_t i = 0; i < container->elem_cnt; i++)
+        paths.push_back(reinterpret_cast<const char*>(container->val) + container->val[i]);
+    return paths;
+}
+
+static std::string formatUuid(const uint8_t* uuid) {
+    static const char hex[] = "0123456789abcdef";
+    std::string result;
+    for (int i = 0; i < BTRFS_UUID_SIZE; i++) {
+        if (i == 4 || i == 6 || i == 8 || i == 10)
+            result += '-';
+        result += hex[uuid[i] >> 4];
+        result += hex[uuid[i] & 0xf];
+    }
+    return result;
+}
+
+std::string Subvolume::getUuid() {
+    struct btrfs_ioctl_get_subvol_info_args info{};
+    if (ioctl(fd, BTRFS_IOC_GET_SUBVOL_INFO, &info) < 0)
+        throw std::runtime_error{"Reading subvolume information of '" + path.native() + "' failed: " + std::string(strerror(errno))};
+    return formatUuid(info.uuid);
+}
+
+std::string Subvolume::getParentUuid() {
+    struct btrfs_ioctl_get_subvol_info_args info{};
+    if (ioctl(fd, BTRFS_IOC_GET_SUBVOL_INFO, &info) < 0)
+        throw std::runtime_error{"Reading subvolume information of '" + path.native() + "' failed: " + std::string(strerror(errno))};
+    if (std::all_of(info.parent_uuid, info.parent_uuid + BTRFS_UUID_SIZE, [](uint8_t c) { return c == 0; }))
+        return {};
+    return formatUuid(info.parent_uuid);
+}
+
+Subvolume Subvolume::snapshot(std::filesystem::path target, bool readonly) {
+    tulog.debug("Creating snapshot of ", path, " in ", target, "...");
+
+    std::string name = target.filename();
+    if (name.empty() || name.length() > BTRFS_SUBVOL_NAME_MAX)
+        throw std::invalid_argument{"Invalid snapshot name '" + target.native() + "'."};
+
+    int parentFd = open(target.parent_path().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (parentFd < 0)
+        throw std::runtime_error{"Opening '" + target.parent_path().native() + "' failed: " + std::string(strerror(errno))};
+
+    struct btrfs_ioctl_vol_args_v2 args{};
+    args.fd = fd;
+    args.flags = readonly ? BTRFS_SUBVOL_RDONLY : 0;
+    strncpy(args.name, name.c_str(), BTRFS_SUBVOL_NAME_MAX);
+    int rc = ioctl(parentFd, BTRFS_IOC_SNAP_CREATE_V2, &args);
+    int err = errno;
+    close(parentFd);
+    if (rc < 0)
+        throw std::runtime_error{"Creating snapshot of '" + path.native() + "' in '" + target.native() + "' failed: " + std::string(strerror(err))};
+
+    return Subvolume{target};
+}
+
+void Subvolume::remove(std::filesystem::path path) {
+    tulog.debug("Deleting subvolume ", path, "...");
+
+    std::string name = path.filename();
+    if (name.empty() || name.length() > BTRFS_SUBVOL_NAME_MAX)
+        throw std::invalid_argument{"Invalid subvolume name '" + path.native() + "'."};
+
+    int parentFd = open(path.parent_path().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (parentFd < 0)
+        throw std::runtime_error{"Opening '" + path.parent_path().native() + "' failed: " + std::string(strerror(errno))};
+
+    struct btrfs_ioctl_vol_args_v2 args{};
+    strncpy(args.name, name.c_str(), BTRFS_SUBVOL_NAME_MAX);
+    int rc = ioctl(parentFd, BTRFS_IOC_SNAP_DESTROY_V2, &args);
+    int err = errno;
+    close(parentFd);
+    if (rc < 0)
+        throw std::runtime_error{"Deleting subvolume '" + path.native() + "' failed: " + std::string(strerror(err))};
+}
+
+uint64_t Subvolume::getDefaultId(std::filesystem::path fs) {
+    int fsFd = open(fs.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fsFd < 0)
+        throw std::runtime_error{"Opening '" + fs.native() + "' failed: " + std::string(strerror(errno))};
+
+    // The default subvolume is stored as the "default" directory item of the root tree directory
+    struct btrfs_ioctl_search_args args{};
+    args.key.tree_id = BTRFS_ROOT_TREE_OBJECTID;
+    args.key.min_objectid = args.key.max_objectid = BTRFS_ROOT_TREE_DIR_OBJECTID;
+    args.key.min_type = args.key.max_type = BTRFS_DIR_ITEM_KEY;
+    args.key.max_offset = UINT64_MAX;
+    args.key.max_transid = UINT64_MAX;
+    args.key.nr_items = 1;
+    int rc = ioctl(fsFd, BTRFS_IOC_TREE_SEARCH, &args);
+    int err = errno;
+    close(fsFd);
+    if (rc < 0)
+        throw std::runtime_error{"Searching default subvolume of '" + fs.native() + "' failed: " + std::string(strerror(err))};
+    if (args.key.nr_items == 0)
+        return BTRFS_FS_TREE_OBJECTID;
+
+    auto dirItem = reinterpret_cast<struct btrfs_dir_item*>(args.buf + sizeof(struct btrfs_ioctl_search_header));
+    return le64toh(dirItem->location.objectid);
+}
+
+bool Subvolume::isBtrfs(std::filesystem::path path) {
+    struct statfs buf;
+    if (statfs(path.c_str(), &buf) < 0)
+        return false;
+    return buf.f_type == BTRFS_SUPER_MAGIC;
+}
+
+bool Subvolume::isSubvolume(std::filesystem::path path) {
+    struct stat st;
+    return isBtrfs(path) && stat(path.c_str(), &st) == 0 && st.st_ino == BTRFS_FIRST_FREE_OBJECTID;
+}
+
+// Deleted subvolumes are only unlinked immediately; until the btrfs cleaner thread has freed
+// their extents they are tracked as orphan items in the root tree.
+std::vector<uint64_t> Subvolume::getDeletedIds(std::filesystem::path fs) {
+    int fsFd = open(fs.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fsFd < 0)
+        throw std::runtime_error{"Opening '" + fs.native() + "' failed: " + std::string(strerror(errno))};
+
+    std::vector<uint64_t> ids;
+    struct btrfs_ioctl_search_key key{};
+    key.tree_id = BTRFS_ROOT_TREE_OBJECTID;
+    key.min_objectid = key.max_objectid = BTRFS_ORPHAN_OBJECTID;
+    key.min_type = key.max_type = BTRFS_ORPHAN_ITEM_KEY;
+    key.max_offset = UINT64_MAX;
+    key.max_transid = UINT64_MAX;
+    int err = treeSearch(fsFd, key, [&](const struct btrfs_ioctl_search_header& header, const char*) {
+        if (header.type == BTRFS_ORPHAN_ITEM_KEY)
+            ids.push_back(header.offset);
+    });
+    close(fsFd);
+    if (err)
+        throw std::runtime_error{"Searching deleted subvolumes of '" + fs.native() + "' failed: " + std::string(strerror(err))};
+    return ids;
+}
+
+void Subvolume::waitForCleanup(std::filesystem::path fs) {
+    std::vector<uint64_t> pending = getDeletedIds(fs);
+    if (pending.empty())
+        return;
+    tulog.info("Waiting for the cleanup of ", pending.size(), " deleted subvolume(s)...");
+    while (!pending.empty()) {
+        sleep(1);
+        std::vector<uint64_t> deleted = getDeletedIds(fs);
+        // Only wait for subvolumes deleted before the call, not for ones deleted meanwhile
+        pending.erase(std::remove_if(pending.begin(), pending.end(), [&](uint64_t id) {
+            return std::find(deleted.begin(), deleted.end(), id) == deleted.end();
+        }), pending.end());
+    }
+}
+
+// Calls the callback for every item matching the search key; returns 0 or an errno value
+int Subvolume::treeSearch(int fd, const struct btrfs_ioctl_search_key& key,
+                          const std::function<void(const struct btrfs_ioctl_search_header&, const char*)>& callback) {
+    struct btrfs_ioctl_search_args args{};
+    args.key = key;
+    for (;;) {
+        args.key.nr_items = 4096;
+        if (ioctl(fd, BTRFS_IOC_TREE_SEARCH, &args) < 0)
+            return errno;
+        if (args.key.nr_items == 0)
+            return 0;
+
+        size_t offset = 0;
+        struct btrfs_ioctl_search_header header{};
+        for (unsigned int i = 0; i < args.key.nr_items; i++) {
+            memcpy(&header, args.buf + offset, sizeof(header));
+            callback(header, args.buf + offset + sizeof(header));
+            offset += sizeof(header) + header.len;
+        }
+
+        // Continue behind the last returned key
+        args.key.min_objectid = header.objectid;
+        args.key.min_type = header.type;
+        args.key.min_offset = header.offset;
+        if (args.key.min_offset < UINT64_MAX) {
+            args.key.min_offset++;
+        } else if (args.key.min_type < UINT8_MAX) {
+            args.key.min_type++;
+            args.key.min_offset = 0;
+        } else if (args.key.min_objectid < UINT64_MAX) {
+            args.key.min_objectid++;
+            args.key.min_type = 0;
+            args.key.min_offset = 0;
+        } else {
+            return 0;
+        }
+    }
+}
+
+} // namespace TransactionalUpdate
@@ -0,0 +1,73 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Wrapper for btrfs subvolume ioctls
+ */
+
+#ifndef T_U_SUBVOLUME_H
+#define T_U_SUBVOLUME_H
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+struct btrfs_ioctl_search_header;
+struct btrfs_ioctl_search_key;
+
+namespace TransactionalUpdate {
+
+class Subvolume
+{
+public:
+    struct QgroupUsage {
+        uint64_t referenced;
+        uint64_t exclusive;
+    };
+    struct ChangedInode {
+        uint64_t inode;
+        // Whether the inode didn't exist in the snapshot's parent yet
+        bool created;
+    };
+    Subvolume(std::filesystem::path path);
+    Subvolume(Subvolume&& other) noexcept;
+    virtual ~Subvolume();
+    Subvolume(const Subvolume&) = delete;
+    void operator=(const Subvolume&) = delete;
+    uint64_t getId();
+    bool isReadOnly();
+    void setReadOnly(bool readonly);
+    void setDefault();
+    Subvolume snapshot(std::filesystem::path target, bool readonly = false);
+    std::optional<QgroupUsage> getQgroupUsage();
+    uint64_t getChangedBytes();
+    // Transaction id of the subvolume's last change; pending changes are committed first
+    uint64_t getGeneration();
+    // Inodes created or modified since the subvolume was created as a snapshot
+    std::vector<ChangedInode> getChangedInodes();
+    // All paths of the inode relative to the subvolume; empty if it doesn't exist any more
+    std::vector<std::string> getInodePaths(uint64_t inode);
+    std::string getUuid();
+    // UUID of the subvolume this one is a snapshot of; empty for plain subvolumes
+    std::string getParentUuid();
+    static void remove(std::filesystem::path path);
+    static uint64_t getDefaultId(std::filesystem::path fs = "/");
+    static bool isBtrfs(std::filesystem::path path);
+    // Whether path is the top directory of a subvolume
+    static bool isSubvolume(std::filesystem::path path);
+    static std::vector<uint64_t> getDeletedIds(std::filesystem::path fs = "/");
+    static void waitForCleanup(std::filesystem::path fs = "/");
+protected:
+    std::filesystem::path path;
+    int fd = -1;
+    uint64_t getFlags();
+    static int treeSearch(int fd, const struct btrfs_ioctl_search_key& key,
+                          const std::function<void(const struct btrfs_ioctl_search_header&, const char*)>& callback);
+};
+
+} // namespace TransactionalUpdate
+
+#endif // T_U_SUBVOLUME_H
@@ -0,0 +1,664 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Synchronizes a directory tree into another one
+
+  Every directory is a job: a walker synchronizes the directory's entries
+  and schedules its subdirectories as new jobs on its own queue. Idle
+  walkers steal jobs from the front of the other walkers' queues, i.e. the
+  ones closest to the root which will most likely yield the most work.
+ */
+
+#include "Sync.hpp"
+#include "Log.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <deque>
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdexcept>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+
+namespace TransactionalUpdate {
+
+struct Sync::Job {
+    std::string rel;
+    // Whether the directory's own attributes have to be synchronized once its entries are done
+    bool attributes = true;
+    bool existed = false;
+    // The directory or one of its parents was created by this run
+    bool created = false;
+    struct statx src;
+    struct statx dst;
+};
+
+struct Sync::Worker {
+    std::mutex mutex;
+    std::deque<Job> jobs;
+    Stats stats;
+    std::vector<Change> changes;
+};
+
+static const unsigned int STATX_FIELDS = STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID |
+    STATX_ATIME | STATX_MTIME | STATX_INO | STATX_SIZE;
+
+static std::runtime_error syncError(const std::string& action, const std::string& path, int err = errno) {
+    return std::runtime_error{action + " '" + path + "' failed: " + std::string(strerror(err))};
+}
+
+// Returns false with errno set if the entry can't be read
+static bool statEntry(int dir, const char* name, struct statx& st, int flags = 0) {
+    return statx(dir, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC | flags, STATX_FIELDS, &st) == 0;
+}
+
+static dev_t getDev(const struct statx& st) {
+    return makedev(st.stx_dev_major, st.stx_dev_minor);
+}
+
+static struct timespec toTimespec(const struct statx_timestamp& ts) {
+    return {ts.tv_sec, ts.tv_nsec};
+}
+
+static bool sameTime(const struct statx_timestamp& a, const struct statx_timestamp& b) {
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+static int openDir(int root, const std::string& rel) {
+    if (rel.empty())
+        return fcntl(root, F_DUPFD_CLOEXEC, 0);
+    return openat(root, rel.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+}
+
+Sync::Sync(std::filesystem::path source, std::filesystem::path target)
+    : source{std::move(source)}, target{std::move(target)}
+{
+}
+
+Sync::~Sync() = default;
+
+void Sync::exclude(std::filesystem::path path) {
+    if (path.native().find('/') == std::string::npos) {
+        excludedNames.insert(path.native());
+        return;
+    }
+    std::string rel = path.lexically_normal().relative_path();
+    while (!rel.empty() && rel.back() == '/')
+        rel.pop_back();
+    excludes.insert(rel);
+}
+
+void Sync::setDelete(bool del) {
+    this->del = del;
+}
+
+void Sync::setIgnoreExisting(bool ignore) {
+    ignoreExisting = ignore;
+}
+
+void Sync::setOneFileSystem(bool oneFs) {
+    this->oneFs = oneFs;
+}
+
+void Sync::setThreads(unsigned int threads) {
+    this->threads = threads;
+}
+
+void Sync::setRecordChanges(bool record) {
+    recordChanges = record;
+}
+
+const Sync::Stats& Sync::getStats() {
+    return stats;
+}
+
+const std::vector<Sync::Change>& Sync::getChanges() {
+    return changes;
+}
+
+void Sync::run() {
+    auto start = std::chrono::steady_clock::now();
+    unsigned int count = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+    tulog.debug("Synchronizing ", source, " to ", target, " using ", count, " threads...");
+
+    sourceFd = open(source.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (sourceFd < 0)
+        throw syncError("Opening", source);
+    if (mkdir(target.c_str(), 0755) < 0 && errno != EEXIST) {
+        int err = errno;
+        close(sourceFd);
+        throw syncError("Creating", target, err);
+    }
+    targetFd = open(target.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (targetFd < 0) {
+        int err = errno;
+        close(sourceFd);
+        throw syncError("Opening", target, err);
+    }
+
+    try {
+        stats = {};
+        changes.clear();
+        hardLinks.clear();
+        pendingLinks.clear();
+        workers.clear();
+        queued = 0;
+        pending = 0;
+        failed = false;
+        error = nullptr;
+
+        Job root;
+        root.attributes = !ignoreExisting;
+        root.existed = true;
+        if (!statEntry(sourceFd, "", root.src, AT_EMPTY_PATH))
+            throw syncError("Reading", source);
+        if (!statEntry(targetFd, "", root.dst, AT_EMPTY_PATH))
+            throw syncError("Reading", target);
+        rootDev = getDev(root.src);
+
+        for (unsigned int i = 0; i < count; i++)
+            workers.push_back(std::make_unique<Worker>());
+        schedule(*workers[0], std::move(root));
+        std::vector<std::thread> walkers;
+        for (unsigned int i = 1; i < count; i++) {
+            try {
+                walkers.emplace_back(&Sync::work, this, std::ref(*workers[i]));
+            } catch (const std::system_error &e) {
+                tulog.debug("Could not start sync thread: ", e.what());
+                break;
+            }
+        }
+        work(*workers[0]);
+        for (auto& walker: walkers)
+            walker.join();
+        if (error)
+            std::rethrow_exception(error);
+
+        for (auto& worker: workers) {
+            stats.files += worker->stats.files;
+            stats.cloned += worker->stats.cloned;
+            stats.copied += worker->stats.copied;
+            stats.bytesCopied += worker->stats.bytesCopied;
+            stats.linked += worker->stats.linked;
+            stats.deleted += worker->stats.deleted;
+            changes.insert(changes.end(), worker->changes.begin(), worker->changes.end());
+        }
+        workers.clear();
+        createLinks();
+    } catch (const std::exception &e) {
+        workers.clear();
+        close(sourceFd);
+        close(targetFd);
+        sourceFd = targetFd = -1;
+        throw;
+    }
+    close(sourceFd);
+    close(targetFd);
+    sourceFd = targetFd = -1;
+
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    tulog.debug("Synchronized ", stats.files, " entries in ", duration.count(), " ms: ", stats.cloned, " files cloned, ",
+                stats.copied, " files copied (", stats.bytesCopied, " bytes), ", stats.linked, " hard links, ",
+                stats.deleted, " deleted");
+}
+
+void Sync::schedule(Worker& worker, Job&& job) {
+    // Count the job first, so it can't be finished by a thief before it was counted
+    {
+        std::lock_guard<std::mutex> lock{queueMutex};
+        queued++;
+        pending++;
+    }
+    {
+        std::lock_guard<std::mutex> lock{worker.mutex};
+        worker.jobs.push_back(std::move(job));
+    }
+    queueCond.notify_one();
+}
+
+bool Sync::nextJob(Worker& worker, Job& job) {
+    for (;;) {
+        // Own jobs are taken depth first, stolen ones from the other end of the queue
+        bool found = false;
+        {
+            std::lock_guard<std::mutex> lock{worker.mutex};
+            if (!worker.jobs.empty()) {
+                job = std::move(worker.jobs.back());
+                worker.jobs.pop_back();
+                found = true;
+            }
+        }
+        for (size_t i = 0; !found && i < workers.size(); i++) {
+            Worker& victim = *workers[i];
+            if (&victim == &worker)
+                continue;
+            std::lock_guard<std::mutex> lock{victim.mutex};
+            if (!victim.jobs.empty()) {
+                job = std::move(victim.jobs.front());
+                victim.jobs.pop_front();
+                found = true;
+            }
+        }
+
+        std::unique_lock<std::mutex> lock{queueMutex};
+        if (found) {
+            queued--;
+            return !failed;
+        }
+        queueCond.wait(lock, [this] { return queued > 0 || pending == 0 || failed; });
+        if (failed || pending == 0)
+            return false;
+    }
+}
+
+void Sync::work(Worker& worker) {
+    Job job;
+    while (nextJob(worker, job)) {
+        try {
+            syncDir(worker, job);
+        } catch (const std::exception &e) {
+            std::lock_guard<std::mutex> lock{queueMutex};
+            if (!error)
+                error = std::current_exception();
+            failed = true;
+        }
+        std::lock_guard<std::mutex> lock{queueMutex};
+        if (--pending == 0 || failed)
+            queueCond.notify_all();
+    }
+}
+
+void Sync::createLinks() {
+    std::set<std::string> parents;
+    for (auto& [rel, first]: pendingLinks) {
+        struct statx firstSt, dst;
+        if (!statEntry(targetFd, first.c_str(), firstSt))
+            throw syncError("Reading", (target / first).native());
+        bool exists = statEntry(targetFd, rel.c_str(), dst);
+        if (!exists && errno != ENOENT)
+            throw syncError("Reading", (target / rel).native());
+        if (exists && getDev(dst) == getDev(firstSt) && dst.stx_ino == firstSt.stx_ino)
+            continue;
+        if (exists && unlinkat(targetFd, rel.c_str(), 0) < 0)
+            throw syncError("Deleting", (target / rel).native());
+        if (linkat(targetFd, first.c_str(), targetFd, rel.c_str(), 0) < 0)
+            throw syncError("Linking", (target / rel).native());
+        stats.linked++;
+        parents.insert(std::filesystem::path{rel}.parent_path());
+    }
+    if (ignoreExisting)
+        return;
+
+    // Creating the links modified the timestamps of their directories
+    for (auto& parent: parents) {
+        struct statx src;
+        if (!statEntry(sourceFd, parent.c_str(), src, parent.empty() ? AT_EMPTY_PATH : 0))
+            throw syncError("Reading", (source / parent).native());
+        struct timespec times[2] = {toTimespec(src.stx_atime), toTimespec(src.stx_mtime)};
+        if (utimensat(AT_FDCWD, (target / parent).c_str(), times, AT_SYMLINK_NOFOLLOW) < 0)
+            throw syncError("Setting timestamps of", (target / parent).native());
+    }
+}
+
+bool Sync::isExcluded(const std::string& rel) {
+    if (excludes.count(rel) > 0)
+        return true;
+    if (excludedNames.empty())
+        return false;
+    size_t slash = rel.rfind('/');
+    return excludedNames.count(slash == std::string::npos ? rel : rel.substr(slash + 1)) > 0;
+}
+
+void Sync::syncDir(Worker& worker, const Job& job) {
+    const std::string& rel = job.rel;
+    int srcFd = openDir(sourceFd, rel);
+    DIR* dir = srcFd < 0 ? nullptr : fdopendir(srcFd);
+    if (dir == nullptr) {
+        int err = errno;
+        if (srcFd >= 0)
+            close(srcFd);
+        throw syncError("Reading directory", (source / rel).native(), err);
+    }
+    int dstFd = openDir(targetFd, rel);
+    if (dstFd < 0) {
+        int err = errno;
+        closedir(dir);
+        throw syncError("Opening", (target / rel).native(), err);
+    }
+
+    std::unordered_set<std::string> names;
+    try {
+        errno = 0;
+        while (struct dirent* entry = readdir(dir)) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+                continue;
+            names.insert(entry->d_name);
+            syncEntry(worker, dirfd(dir), dstFd, rel.empty() ? entry->d_name : rel + "/" + entry->d_name, entry->d_name,
+                      job.created);
+            errno = 0;
+        }
+        if (errno != 0)
+            throw syncError("Reading directory", (source / rel).native());
+        if (del)
+            deleteExtraneous(worker, dstFd, rel, names);
+    } catch (const std::exception &e) {
+        closedir(dir);
+        close(dstFd);
+        throw;
+    }
+    closedir(dir);
+    close(dstFd);
+
+    if (job.attributes) {
+        bool changed;
+        if (rel.empty())
+            changed = syncAttributes(AT_FDCWD, target.c_str(), rel, job.src, job.existed ? &job.dst : nullptr);
+        else
+            changed = syncAttributes(targetFd, rel.c_str(), rel, job.src, job.existed ? &job.dst : nullptr);
+        if (changed && recordChanges && !job.created)
+            worker.changes.push_back({rel, false});
+    }
+}
+
+// inCreated: the parent directory was created by this run, so the entry doesn't have to be recorded
+void Sync::syncEntry(Worker& worker, int srcDir, int dstDir, const std::string& rel, const char* name, bool inCreated) {
+    if (isExcluded(rel))
+        return;
+
+    struct statx src;
+    if (!statEntry(srcDir, name, src))
+        throw syncError("Reading", (source / rel).native());
+    struct statx dst;
+    bool exists = statEntry(dstDir, name, dst);
+    if (!exists && errno != ENOENT)
+        throw syncError("Reading", (target / rel).native());
+    worker.stats.files++;
+
+    bool isDir = S_ISDIR(src.stx_mode);
+    if (exists && ignoreExisting && !(isDir && S_ISDIR(dst.stx_mode)))
+        return;
+    if (exists && (dst.stx_mode & S_IFMT) != (src.stx_mode & S_IFMT)) {
+        std::filesystem::remove_all(target / rel);
+        exists = false;
+    }
+
+    if (!isDir && src.stx_nlink > 1) {
+        std::lock_guard<std::mutex> lock{hardLinkMutex};
+        auto [link, inserted] = hardLinks.try_emplace(std::make_pair(getDev(src), static_cast<ino_t>(src.stx_ino)), rel);
+        if (!inserted) {
+            pendingLinks.emplace_back(rel, link->second);
+            return;
+        }
+    }
+
+    switch (src.stx_mode & S_IFMT) {
+    case S_IFDIR: {
+        if (!exists) {
+            if (mkdirat(dstDir, name, 0700) < 0)
+                throw syncError("Creating", (target / rel).native());
+            if (recordChanges && !inCreated)
+                worker.changes.push_back({rel, true});
+        }
+        if (!oneFs || getDev(src) == rootDev) {
+            Job job;
+            job.rel = rel;
+            job.attributes = !(exists && ignoreExisting);
+            job.existed = exists;
+            job.created = inCreated || !exists;
+            job.src = src;
+            if (exists)
+                job.dst = dst;
+            schedule(worker, std::move(job));
+            return;
+        }
+        if (exists && ignoreExisting)
+            return;
+        // Directories created above were already recorded
+        inCreated = inCreated || !exists;
+        break;
+    }
+    case S_IFREG:
+        // Same quick check as rsync: size and modification time
+        if (exists && dst.stx_size == src.stx_size && sameTime(dst.stx_mtime, src.stx_mtime))
+            break;
+        if (exists && unlinkat(dstDir, name, 0) < 0)
+            throw syncError("Deleting", (target / rel).native());
+        copyFile(worker, srcDir, dstDir, name, rel);
+        exists = false;
+        break;
+    case S_IFLNK: {
+        std::vector<char> buf(src.stx_size + 1);
+        ssize_t len = readlinkat(srcDir, name, buf.data(), buf.size());
+        if (len < 0)
+            throw syncError("Reading link", (source / rel).native());
+        std::string linkTarget{buf.data(), static_cast<size_t>(len)};
+        if (exists) {
+            std::vector<char> dstBuf(dst.stx_size + 1);
+            ssize_t dstLen = readlinkat(dstDir, name, dstBuf.data(), dstBuf.size());
+            if (dstLen >= 0 && std::string{dstBuf.data(), static_cast<size_t>(dstLen)} == linkTarget)
+                break;
+            if (unlinkat(dstDir, name, 0) < 0)
+                throw syncError("Deleting", (target / rel).native());
+        }
+        if (symlinkat(linkTarget.c_str(), dstDir, name) < 0)
+            throw syncError("Creating link", (target / rel).native());
+        exists = false;
+        break;
+    }
+    default: // devices, FIFOs and sockets
+        if (exists && dst.stx_rdev_major == src.stx_rdev_major && dst.stx_rdev_minor == src.stx_rdev_minor)
+            break;
+        if (exists && unlinkat(dstDir, name, 0) < 0)
+            throw syncError("Deleting", (target / rel).native());
+        if (mknodat(dstDir, name, src.stx_mode & S_IFMT, makedev(src.stx_rdev_major, src.stx_rdev_minor)) < 0)
+            throw syncError("Creating", (target / rel).native());
+        exists = false;
+    }
+
+    bool changed = syncAttributes(dstDir, name, rel, src, exists ? &dst : nullptr);
+    if (changed && recordChanges && !inCreated)
+        worker.changes.push_back({rel, false});
+}
+
+// Ownership first, as changing it resets setuid bits and file capabilities, times last.
+// dst is the state of an existing entry or nullptr for a newly created one.
+// Returns true if anything except the timestamps was changed.
+bool Sync::syncAttributes(int dstDir, const char* name, const std::string& rel, const struct statx& src, const struct statx* dst) {
+    bool changed = !dst;
+    bool chowned = false;
+    if (!dst || dst->stx_uid != src.stx_uid || dst->stx_gid != src.stx_gid) {
+        if (fchownat(dstDir, name, src.stx_uid, src.stx_gid, AT_SYMLINK_NOFOLLOW) < 0)
+            throw syncError("Changing owner of", (target / rel).native());
+        chowned = changed = true;
+    }
+    if (!S_ISLNK(src.stx_mode) && (chowned || (dst->stx_mode & 07777) != (src.stx_mode & 07777))) {
+        if (fchmodat(dstDir, name, src.stx_mode & 07777, 0) < 0)
+            throw syncError("Changing permissions of", (target / rel).native());
+        changed = true;
+    }
+    if (syncXattrs(rel))
+        changed = true;
+    if (!dst || !sameTime(dst->stx_mtime, src.stx_mtime) || S_ISDIR(src.stx_mode)) {
+        struct timespec times[2] = {toTimespec(src.stx_atime), toTimespec(src.stx_mtime)};
+        if (utimensat(dstDir, name, times, AT_SYMLINK_NOFOLLOW) < 0)
+            throw syncError("Setting timestamps of", (target / rel).native());
+    }
+    return changed;
+}
+
+static std::vector<std::string> listXattrs(const std::string& path) {
+    std::vector<std::string> names;
+    ssize_t len = llistxattr(path.c_str(), nullptr, 0);
+    if (len < 0 && (errno == ENOTSUP || errno == ENODATA))
+        return names;
+    std::vector<char> buf;
+    while (len > 0) {
+        buf.resize(len);
+        len = llistxattr(path.c_str(), buf.data(), buf.size());
+        if (len >= 0 || errno != ERANGE)
+            break;
+        len = llistxattr(path.c_str(), nullptr, 0);
+    }
+    if (len < 0)
+        throw syncError("Listing extended attributes of", path);
+    for (ssize_t pos = 0; pos < len; pos += strlen(buf.data() + pos) + 1) {
+        names.emplace_back(buf.data() + pos);
+    }
+    return names;
+}
+
+static bool getXattr(const std::string& path, const std::string& name, std::string& value) {
+    ssize_t len = lgetxattr(path.c_str(), name.c_str(), nullptr, 0);
+    while (len >= 0) {
+        value.resize(len);
+        len = lgetxattr(path.c_str(), name.c_str(), value.data(), value.size());
+        if (len >= 0) {
+            value.resize(len);
+            return true;
+        }
+        if (errno != ERANGE)
+            break;
+        len = lgetxattr(path.c_str(), name.c_str(), nullptr, 0);
+    }
+    if (errno == ENODATA || errno == ENOTSUP)
+        return false;
+    throw syncError("Reading extended attribute " + name + " of", path);
+}
+
+// Includes ACLs (system.posix_acl_*) and SELinux labels (security.selinux).
+// Returns true if any attribute was changed.
+bool Sync::syncXattrs(const std::string& rel) {
+    std::string srcPath = source / rel;
+    std::string dstPath = target / rel;
+    bool changed = false;
+
+    std::vector<std::string> srcNames = listXattrs(srcPath);
+    std::string srcValue, dstValue;
+    for (auto& name: srcNames) {
+        if (!getXattr(srcPath, name, srcValue))
+            continue;
+        if (getXattr(dstPath, name, dstValue) && dstValue == srcValue)
+            continue;
+        if (lsetxattr(dstPath.c_str(), name.c_str(), srcValue.data(), srcValue.size(), 0) < 0)
+            throw syncError("Setting extended attribute " + name + " of", dstPath);
+        changed = true;
+    }
+    for (auto& name: listXattrs(dstPath)) {
+        if (std::find(srcNames.begin(), srcNames.end(), name) != srcNames.end())
+            continue;
+        if (lremovexattr(dstPath.c_str(), name.c_str()) < 0 && errno != ENODATA)
+            throw syncError("Removing extended attribute " + name + " of", dstPath);
+        changed = true;
+    }
+    return changed;
+}
+
+void Sync::copyFile(Worker& worker, int srcDir, int dstDir, const char* name, const std::string& rel) {
+    int in = openat(srcDir, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (in < 0)
+        throw syncError("Opening", (source / rel).native());
+    int out = openat(dstDir, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (out < 0) {
+        int err = errno;
+        close(in);
+        throw syncError("Creating", (target / rel).native(), err);
+    }
+
+    try {
+        if (cloneSupported && ioctl(out, FICLONE, in) == 0) {
+            worker.stats.cloned++;
+        } else {
+            // Not on the same file system or not supported by it: don't try again
+            if (cloneSupported && (errno == EXDEV || errno == EOPNOTSUPP || errno == ENOTTY || errno == ENOSYS)) {
+                int err = errno;
+                if (cloneSupported.exchange(false))
+                    tulog.debug("Cloning files from ", source, " to ", target, " is not possible: ", strerror(err));
+            }
+            copyData(worker, in, out, rel);
+            worker.stats.copied++;
+        }
+    } catch (const std::exception &e) {
+        close(in);
+        close(out);
+        throw;
+    }
+    close(in);
+    if (close(out) < 0)
+        throw syncError("Writing", (target / rel).native());
+}
+
+void Sync::copyData(Worker& worker, int in, int out, const std::string& rel) {
+    // copy_file_range may still share extents (e.g. on NFS or XFS) and avoids the userspace
+    // round trip otherwise; both calls continue at the current file offsets
+    while (copyRangeSupported) {
+        ssize_t len = copy_file_range(in, nullptr, out, nullptr, SSIZE_MAX, 0);
+        if (len == 0)
+            return;
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EXDEV && errno != ENOSYS && errno != EOPNOTSUPP && errno != EINVAL)
+                throw syncError("Copying", (target / rel).native());
+            int err = errno;
+            if (copyRangeSupported.exchange(false))
+                tulog.debug("copy_file_range from ", source, " to ", target, " is not possible: ", strerror(err));
+            break;
+        }
+        worker.stats.bytesCopied += len;
+    }
+
+    std::vector<char> buf(1024 * 1024);
+    for (;;) {
+        ssize_t len = read(in, buf.data(), buf.size());
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0)
+            throw syncError("Reading", (source / rel).native());
+        if (len == 0)
+            return;
+        for (ssize_t written = 0; written < len; ) {
+            ssize_t rc = write(out, buf.data() + written, len - written);
+            if (rc < 0 && errno == EINTR)
+                continue;
+            if (rc < 0)
+                throw syncError("Writing", (target / rel).native());
+            written += rc;
+        }
+        worker.stats.bytesCopied += len;
+    }
+}
+
+void Sync::deleteExtraneous(Worker& worker, int dstDir, const std::string& rel, const std::unordered_set<std::string>& names) {
+    int fd = fcntl(dstDir, F_DUPFD_CLOEXEC, 0);
+    DIR* dir = fd < 0 ? nullptr : fdopendir(fd);
+    if (dir == nullptr) {
+        if (fd >= 0)
+            close(fd);
+        throw syncError("Reading directory", (target / rel).native());
+    }
+    std::vector<std::string> extraneous;
+    while (struct dirent* entry = readdir(dir)) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 || names.count(entry->d_name))
+            continue;
+        std::string entryRel = rel.empty() ? entry->d_name : rel + "/" + entry->d_name;
+        if (!isExcluded(entryRel))
+            extraneous.push_back(entryRel);
+    }
+    closedir(dir);
+
+    for (auto& entryRel: extraneous) {
+        std::filesystem::remove_all(target / entryRel);
+        worker.stats.deleted++;
+    }
+}
+
+} // namespace TransactionalUpdate
@@ -0,0 +1,117 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Synchronizes a directory tree into another one, similar to
+  "rsync --archive --hard-links --xattrs --acls"; file contents are cloned
+  (reflinked) where the file system supports it and only copied otherwise.
+  Directories are processed in parallel by a pool of work-stealing walkers.
+ */
+
+#ifndef T_U_SYNC_H
+#define T_U_SYNC_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <sys/stat.h>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace TransactionalUpdate {
+
+class Sync
+{
+public:
+    struct Stats {
+        uint64_t files = 0;
+        uint64_t cloned = 0;
+        uint64_t copied = 0;
+        uint64_t bytesCopied = 0;
+        uint64_t linked = 0;
+        uint64_t deleted = 0;
+    };
+    // Entry created or modified by a run; everything below a directory
+    // created by it is new as well and not listed separately
+    struct Change {
+        std::string path;
+        bool created;
+    };
+    Sync(std::filesystem::path source, std::filesystem::path target);
+    virtual ~Sync();
+    // Path relative to the source directory which should neither be copied nor
+    // deleted; as with rsync's --exclude, a name without a slash matches entries
+    // of that name at any depth
+    void exclude(std::filesystem::path path);
+    // Delete files in the target which don't exist in the source
+    void setDelete(bool del);
+    // Don't touch files which already exist in the target
+    void setIgnoreExisting(bool ignore);
+    // Don't descend into directories on other file systems
+    void setOneFileSystem(bool oneFs);
+    // Number of parallel directory walkers; 0 (the default) uses one per CPU
+    void setThreads(unsigned int threads);
+    // Collect the entries created or modified by run()
+    void setRecordChanges(bool record);
+    void run();
+    const Stats& getStats();
+    const std::vector<Change>& getChanges();
+protected:
+    struct Job;
+    struct Worker;
+    std::filesystem::path source;
+    std::filesystem::path target;
+    std::set<std::string> excludes;
+    std::set<std::string> excludedNames;
+    bool del = false;
+    bool ignoreExisting = false;
+    bool oneFs = false;
+    bool recordChanges = false;
+    unsigned int threads = 0;
+    std::atomic<bool> cloneSupported{true};
+    std::atomic<bool> copyRangeSupported{true};
+    dev_t rootDev = 0;
+    int sourceFd = -1;
+    int targetFd = -1;
+    Stats stats;
+    std::vector<Change> changes;
+
+    // The first occurrence of a hard linked inode is copied, all further
+    // links are created after all walkers have finished
+    std::mutex hardLinkMutex;
+    std::map<std::pair<dev_t, ino_t>, std::string> hardLinks;
+    std::vector<std::pair<std::string, std::string>> pendingLinks;
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::mutex queueMutex;
+    std::condition_variable queueCond;
+    size_t queued = 0;
+    size_t pending = 0;
+    bool failed = false;
+    std::exception_ptr error;
+
+    void schedule(Worker& worker, Job&& job);
+    bool nextJob(Worker& worker, Job& job);
+    void work(Worker& worker);
+    void createLinks();
+    bool isExcluded(const std::string& rel);
+    void syncDir(Worker& worker, const Job& job);
+    void syncEntry(Worker& worker, int srcDir, int dstDir, const std::string& rel, const char* name, bool inCreated);
+    bool syncAttributes(int dstDir, const char* name, const std::string& rel, const struct statx& src, const struct statx* dst);
+    bool syncXattrs(const std::string& rel);
+    void copyFile(Worker& worker, int srcDir, int dstDir, const char* name, const std::string& rel);
+    void copyData(Worker& worker, int in, int out, const std::string& rel);
+    void deleteExtraneous(Worker& worker, int dstDir, const std::string& rel, const std::unordered_set<std::string>& names);
+};
+
+} // namespace TransactionalUpdate
+
+#endif // T_U_SYNC_H
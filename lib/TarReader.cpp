@@ -0,0 +1,294 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Streaming reader for tar archives
+ */
+
+#include "TarReader.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace TransactionalUpdate {
+
+static const size_t BLOCK_SIZE = 512;
+
+static std::runtime_error tarError(const std::string& reason) {
+    return std::runtime_error{"Reading tar archive failed: " + reason};
+}
+
+// Octal, or base-256 (GNU extension) if the highest bit is set
+static uint64_t parseNumber(const char* field, size_t len) {
+    uint64_t value = 0;
+    if (static_cast<unsigned char>(field[0]) & 0x80) {
+        value = static_cast<unsigned char>(field[0]) & 0x7f;
+        for (size_t i = 1; i < len; i++)
+            value = value << 8 | static_cast<unsigned char>(field[i]);
+        return value;
+    }
+    size_t i = 0;
+    while (i < len && field[i] == ' ')
+        i++;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+        value = value * 8 + (field[i] - '0');
+    return value;
+}
+
+static std::string parseString(const char* field, size_t len) {
+    return std::string{field, strnlen(field, len)};
+}
+
+static uint64_t getPadding(uint64_t size) {
+    return (BLOCK_SIZE - size % BLOCK_SIZE) % BLOCK_SIZE;
+}
+
+static bool verifyChecksum(const char* header) {
+    uint64_t expected = parseNumber(header + 148, 8);
+    uint64_t sum = 0;
+    int64_t signedSum = 0;
+    for (size_t i = 0; i < BLOCK_SIZE; i++) {
+        char c = (i >= 148 && i < 156) ? ' ' : header[i];
+        sum += static_cast<unsigned char>(c);
+        signedSum += static_cast<signed char>(c);
+    }
+    return sum == expected || static_cast<uint64_t>(signedSum) == expected;
+}
+
+// PAX extended header records: "<length> <key>=<value>\n"
+static void parsePax(const std::string& data, std::vector<std::pair<std::string, std::string>>& records) {
+    size_t pos = 0;
+    while (pos < data.size()) {
+        size_t space = data.find(' ', pos);
+        if (space == std::string::npos)
+            break;
+        uint64_t len = 0;
+        for (size_t i = pos; i < space; i++) {
+            if (data[i] < '0' || data[i] > '9')
+                throw tarError("invalid PAX header");
+            len = len * 10 + (data[i] - '0');
+        }
+        if (len <= space - pos + 1 || pos + len > data.size() || data[pos + len - 1] != '\n')
+            throw tarError("invalid PAX header");
+        std::string record = data.substr(space + 1, pos + len - space - 2);
+        size_t eq = record.find('=');
+        if (eq == std::string::npos)
+            throw tarError("invalid PAX header");
+        records.emplace_back(record.substr(0, eq), record.substr(eq + 1));
+        pos += len;
+    }
+}
+
+TarReader::TarReader(int fd, uint64_t limit): fd{fd}, limit{limit} {
+    struct stat st;
+    seekable = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+void TarReader::read(char* buf, size_t len) {
+    for (size_t done = 0; done < len; ) {
+        ssize_t rc = ::read(fd, buf + done, len - done);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc < 0)
+            throw tarError(strerror(errno));
+        if (rc == 0)
+            throw tarError("unexpected end of archive");
+        done += rc;
+    }
+    pos += len;
+}
+
+// Returns false at the end of the input
+bool TarReader::readHeader(char* header) {
+    if (limit - pos < BLOCK_SIZE)
+        return false;
+    ssize_t rc;
+    do {
+        rc = ::read(fd, header, BLOCK_SIZE);
+    } while (rc < 0 && errno == EINTR);
+    if (rc < 0)
+        throw tarError(strerror(errno));
+    if (rc == 0)
+        return false;
+    pos += rc;
+    if (static_cast<size_t>(rc) < BLOCK_SIZE)
+        read(header + rc, BLOCK_SIZE - rc);
+    return true;
+}
+
+void TarReader::skip(uint64_t len) {
+    if (len == 0)
+        return;
+    if (seekable) {
+        if (lseek(fd, len, SEEK_CUR) < 0)
+            throw tarError(strerror(errno));
+        pos += len;
+        return;
+    }
+    std::vector<char> buf(std::min<uint64_t>(len, 65536));
+    while (len > 0) {
+        size_t chunk = std::min<uint64_t>(len, buf.size());
+        read(buf.data(), chunk);
+        len -= chunk;
+    }
+}
+
+std::string TarReader::readMember(uint64_t size) {
+    if (size > limit - pos)
+        throw tarError("member exceeds archive size");
+    std::string data(size, '\0');
+    read(data.data(), size);
+    return data;
+}
+
+bool TarReader::next(Entry& entry) {
+    skip(dataRemaining + padding);
+    dataRemaining = padding = 0;
+
+    std::string longName, longLink;
+    std::vector<std::pair<std::string, std::string>> pax;
+    char header[BLOCK_SIZE];
+    for (;;) {
+        if (!readHeader(header))
+            return false;
+        bool empty = true;
+        for (size_t i = 0; i < BLOCK_SIZE && empty; i++)
+            empty = header[i] == '\0';
+        if (empty)
+            return false;
+        if (!verifyChecksum(header))
+            throw tarError("invalid header checksum");
+
+        char type = header[156];
+        uint64_t size = parseNumber(header + 124, 12);
+        if (type == 'L' || type == 'K' || type == 'x' || type == 'g') {
+            std::string data = readMember(size);
+            skip(getPadding(size));
+            if (type == 'L')
+                longName = parseString(data.data(), data.size());
+            else if (type == 'K')
+                longLink = parseString(data.data(), data.size());
+            else if (type == 'x')
+                parsePax(data, pax);
+            continue;
+        }
+
+        entry = {};
+        if (memcmp(header + 257, "ustar\0", 6) == 0 && header[345] != '\0')
+            entry.path = parseString(header + 345, 155) + "/" + parseString(header, 100);
+        else
+            entry.path = parseString(header, 100);
+        if (!longName.empty())
+            entry.path = longName;
+        entry.linkTarget = longLink.empty() ? parseString(header + 157, 100) : longLink;
+        entry.mode = parseNumber(header + 100, 8) & 07777;
+        entry.uid = parseNumber(header + 108, 8);
+        entry.gid = parseNumber(header + 116, 8);
+        entry.mtime = {static_cast<time_t>(parseNumber(header + 136, 12)), 0};
+        entry.devMajor = parseNumber(header + 329, 8);
+        entry.devMinor = parseNumber(header + 337, 8);
+
+        for (auto& [key, value]: pax) {
+            if (key == "path") {
+                entry.path = value;
+            } else if (key == "linkpath") {
+                entry.linkTarget = value;
+            } else if (key == "size") {
+                size = std::stoull(value);
+            } else if (key == "uid") {
+                entry.uid = std::stoul(value);
+            } else if (key == "gid") {
+                entry.gid = std::stoul(value);
+            } else if (key == "mtime") {
+                size_t dot = value.find('.');
+                entry.mtime.tv_sec = std::stoll(value.substr(0, dot));
+                if (dot != std::string::npos) {
+                    std::string fraction = (value.substr(dot + 1) + "000000000").substr(0, 9);
+                    entry.mtime.tv_nsec = std::stol(fraction);
+                }
+            } else if (key.rfind("SCHILY.xattr.", 0) == 0) {
+                entry.xattrs.emplace_back(key.substr(13), value);
+            }
+        }
+
+        switch (type) {
+        case '0':
+        case '\0':
+        case '7':
+            entry.type = (!entry.path.empty() && entry.path.back() == '/') ? Type::Directory : Type::Regular;
+            break;
+        case '1': entry.type = Type::HardLink; break;
+        case '2': entry.type = Type::Symlink; break;
+        case '3': entry.type = Type::CharDevice; break;
+        case '4': entry.type = Type::BlockDevice; break;
+        case '5': entry.type = Type::Directory; break;
+        case '6': entry.type = Type::Fifo; break;
+        default:
+            throw tarError("unsupported entry type '" + std::string(1, type) + "' for " + entry.path);
+        }
+
+        if (size > limit - pos)
+            throw tarError("entry " + entry.path + " exceeds archive size");
+        entry.size = entry.type == Type::Regular ? size : 0;
+        dataOffset = pos;
+        dataRemaining = size;
+        padding = getPadding(size);
+        return true;
+    }
+}
+
+uint64_t TarReader::getDataOffset() const {
+    return dataOffset;
+}
+
+void TarReader::copyData(int out) {
+    std::vector<char> buf;
+    while (dataRemaining > 0) {
+        ssize_t len;
+        if (seekable && copyRangeSupported) {
+            len = copy_file_range(fd, nullptr, out, nullptr, dataRemaining, 0);
+            if (len < 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)) {
+                copyRangeSupported = false;
+                continue;
+            }
+        } else if (!seekable && spliceSupported) {
+            len = splice(fd, nullptr, out, nullptr, dataRemaining, 0);
+            if (len < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                spliceSupported = false;
+                continue;
+            }
+        } else {
+            buf.resize(std::min<uint64_t>(dataRemaining, 1024 * 1024));
+            len = ::read(fd, buf.data(), std::min<uint64_t>(dataRemaining, buf.size()));
+            for (ssize_t written = 0; len > 0 && written < len; ) {
+                ssize_t rc = write(out, buf.data() + written, len - written);
+                if (rc < 0 && errno == EINTR)
+                    continue;
+                if (rc < 0)
+                    throw std::runtime_error{"Writing file contents failed: " + std::string(strerror(errno))};
+                written += rc;
+            }
+        }
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0)
+            throw tarError(strerror(errno));
+        if (len == 0)
+            throw tarError("unexpected end of archive");
+        dataRemaining -= len;
+        pos += len;
+    }
+}
+
+std::string TarReader::readData() {
+    std::string data = readMember(dataRemaining);
+    dataRemaining = 0;
+    return data;
+}
+
+} // namespace TransactionalUpdate
@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Streaming reader for (uncompressed) tar archives in ustar, GNU and PAX
+  format; file contents are passed on with copy_file_range or splice, so they
+  never have to be copied into user space.
+ */
+
+#ifndef T_U_TARREADER_H
+#define T_U_TARREADER_H
+
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <sys/types.h>
+#include <utility>
+#include <vector>
+
+namespace TransactionalUpdate {
+
+class TarReader
+{
+public:
+    enum class Type { Regular, HardLink, Symlink, CharDevice, BlockDevice, Directory, Fifo };
+    struct Entry {
+        std::string path;
+        Type type;
+        mode_t mode;
+        uid_t uid;
+        gid_t gid;
+        struct timespec mtime;
+        uint64_t size;
+        std::string linkTarget;
+        unsigned int devMajor;
+        unsigned int devMinor;
+        std::vector<std::pair<std::string, std::string>> xattrs;
+    };
+    // Reads from the fd's current position, which may be a regular file or a
+    // pipe; at most limit bytes are read
+    TarReader(int fd, uint64_t limit = UINT64_MAX);
+    // Returns false at the end of the archive; the data of the previous entry is skipped if it wasn't read
+    bool next(Entry& entry);
+    // Writes the current entry's data to out
+    void copyData(int out);
+    std::string readData();
+    // Position of the current entry's data relative to the start of the archive
+    uint64_t getDataOffset() const;
+private:
+    int fd;
+    uint64_t limit;
+    bool seekable;
+    bool spliceSupported = true;
+    bool copyRangeSupported = true;
+    uint64_t pos = 0;
+    uint64_t dataOffset = 0;
+    uint64_t dataRemaining = 0;
+    uint64_t padding = 0;
+    bool readHeader(char* header);
+    void read(char* buf, size_t len);
+    void skip(uint64_t len);
+    std::string readMember(uint64_t size);
+};
+
+} // namespace TransactionalUpdate
+
+#endif // T_U_TARREADER_H
@@ -8,18 +8,24 @@
  */
 
 #include "Transaction.hpp"
+#include "ChangeManifest.hpp"
 #include "Configuration.hpp"
 #include "Log.hpp"
 #include "Mount.hpp"
 #include "Plugins.hpp"
 #include "SnapshotManager.hpp"
+#include "SnapshotPool.hpp"
 #include "Snapshot.hpp"
+#include "Subvolume.hpp"
 #include "Supplement.hpp"
+#include "Sync.hpp"
 #include "Util.hpp"
 #include <algorithm>
 #include <cerrno>
+#include <chrono>
 #include <cstdlib>
 #include <cstring>
+#include <fcntl.h>
 #include <fstream>
 #include <ftw.h>
 #include <limits.h>
@@ -28,6 +34,8 @@
 #include <selinux/restorecon.h>
 #include <selinux/selinux.h>
 #include <signal.h>
+#include <stdexcept>
+#include <sys/fanotify.h>
 #include <sys/inotify.h>
 #include <sys/mount.h>
 #include <sys/wait.h>
@@ -39,23 +47,49 @@ namespace fs = std::filesystem;
 static int inotifyFd;
 std::vector<std::filesystem::path> inotifyExcludes;
 
+// Pinned mount namespaces of open transactions, see setPinNamespace()
+static const fs::path PIN_DIR = "/run/tukit";
+
 class Transaction::impl {
 public:
     void addSupplements();
     void snapMount();
+    void pinNamespace();
+    bool enterPinnedNamespace();
+    void releaseNamespace(bool teardown);
     void closeSnapshot(bool aborted=false);
-    int runCommand(char* argv[], bool inChroot, std::string* buffer);
+    int runCommand(char* argv[], bool inChroot, const OutputHandler* handler);
     static int inotifyAdd(const char *pathname, const struct stat *sbuf, int type, struct FTW *ftwb);
     static int selinux_logging_callback(int type, const char *fmt, ...);
     int inotifyRead();
+    bool fanotifyInit();
+    void fanotifyRead();
+    void readOutput(int fd, const OutputHandler& handler);
+    void trackChanges();
+    bool isTrackingChanges();
+    bool hasChanges();
     std::unique_ptr<SnapshotManager> snapshotMgr;
     std::unique_ptr<Snapshot> snapshot;
     fs::path bindDir;
     std::vector<std::unique_ptr<Mount>> dirsToMount;
+    // fstab and mountinfo lookups of this transaction
+    MountTable mountTable;
     Supplements supplements;
     pid_t pidCmd;
     bool keepIfError = false;
     bool discardIfNoChange = false;
+    // Generation of the snapshot's subvolume when the first command was started
+    std::optional<uint64_t> baseGeneration;
+    // File system wide fanotify mark otherwise; closed after the first change
+    // inside of the snapshot
+    int fanotifyFd = -1;
+    int fanotifyRootFd = -1;
+    bool fanotifyChanged = false;
+    bool pinNs = false;
+    // Mount namespace of the caller and pin of the transaction's namespace
+    // while the pinned namespace is entered
+    int hostNs = -1;
+    fs::path pinDir;
 };
 
 Transaction::Transaction() : pImpl{std::make_unique<impl>()} {
@@ -71,7 +105,19 @@ Transaction::~Transaction() {
 
     if (inotifyFd != 0)
         close(inotifyFd);
+    if (pImpl->fanotifyFd >= 0)
+        close(pImpl->fanotifyFd);
+    if (pImpl->fanotifyRootFd >= 0)
+        close(pImpl->fanotifyRootFd);
 
+    // A kept transaction's environment stays mounted in the pinned namespace
+    if (!pImpl->pinDir.empty()) {
+        try {
+            pImpl->releaseNamespace(isInitialized());
+        }  catch (const std::exception &e) {
+            tulog.error("ERROR: ", e.what());
+        }
+    }
     pImpl->dirsToMount.clear();
     if (!pImpl->bindDir.empty()) {
         try {
@@ -135,23 +181,32 @@ int Transaction::impl::selinux_logging_callback(int type, const char *fmt, ...)
 }
 
 void Transaction::impl::snapMount() {
+    if (pinNs && hostNs < 0) {
+        hostNs = open("/proc/self/ns/mnt", O_RDONLY | O_CLOEXEC);
+        if (hostNs < 0)
+            throw std::runtime_error{"Opening mount namespace failed: " + std::string(strerror(errno))};
+    }
     if (unshare(CLONE_NEWNS) < 0) {
         throw std::runtime_error{"Creating new mount namespace failed: " + std::string(strerror(errno))};
     }
+    MountTable::invalidate();
 
     // GRUB needs to have an actual mount point for the root partition, so
     // mount the snapshot directory on a temporary mount point
     char bindTemplate[] = "/tmp/transactional-update-XXXXXX";
     bindDir = mkdtemp(bindTemplate);
-    std::unique_ptr<BindMount> mntBind{new BindMount{bindDir, MS_PRIVATE, true}};
+    // When looking for changes, reading files must not change the snapshot, see trackChanges()
+    unsigned long bindFlags = MS_PRIVATE;
+    if (discardIfNoChange)
+        bindFlags |= MS_NOATIME;
+    std::unique_ptr<BindMount> mntBind{new BindMount{bindDir, bindFlags, true}};
     mntBind->setSource(snapshot->getRoot());
     mntBind->mount();
 
     dirsToMount.push_back(std::make_unique<PropagatedBindMount>("/dev"));
     dirsToMount.push_back(std::make_unique<BindMount>("/var/log"));
 
-    Mount mntVar{"/var"};
-    if (mntVar.isMount()) {
+    if (mountTable.isMount("/var")) {
         if (fs::is_directory("/var/lib/zypp"))
             dirsToMount.push_back(std::make_unique<BindMount>("/var/lib/zypp"));
         dirsToMount.push_back(std::make_unique<BindMount>("/var/lib/ca-certificates"));
@@ -224,23 +279,23 @@ void Transaction::impl::snapMount() {
     if (fs::exists("/boot/grub2")) {
         for (auto& path: fs::directory_iterator("/boot/grub2")) {
             if (fs::is_directory(path)) {
-                if (BindMount{path.path()}.isMount())
+                if (mountTable.isMount(path.path()))
                     dirsToMount.push_back(std::make_unique<BindMount>(path.path()));
             }
         }
     }
-    if (BindMount{"/boot/efi"}.isMount())
+    if (mountTable.isMount("/boot/efi"))
         dirsToMount.push_back(std::make_unique<BindMount>("/boot/efi"));
-    if (BindMount{"/boot/zipl"}.isMount())
+    if (mountTable.isMount("/boot/zipl"))
         dirsToMount.push_back(std::make_unique<BindMount>("/boot/zipl"));
 
     dirsToMount.push_back(std::make_unique<PropagatedBindMount>("/proc"));
     dirsToMount.push_back(std::make_unique<PropagatedBindMount>("/sys"));
 
-    if (BindMount{"/root"}.isMount())
+    if (mountTable.isMount("/root"))
         dirsToMount.push_back(std::make_unique<BindMount>("/root"));
 
-    if (BindMount{"/boot/writable"}.isMount())
+    if (mountTable.isMount("/boot/writable"))
         dirsToMount.push_back(std::make_unique<BindMount>("/boot/writable"));
 
     std::vector<std::string> customDirs = config.getArray("BINDDIRS");
@@ -253,18 +308,139 @@ void Transaction::impl::snapMount() {
 
     dirsToMount.push_back(std::make_unique<BindMount>("/.snapshots"));
 
-    for (auto it = dirsToMount.begin(); it != dirsToMount.end(); ++it) {
-        it->get()->mount(bindDir);
+    // Attach everything at once if the kernel supports mounting onto detached
+    // mount trees, otherwise one mount after the other
+    auto start = std::chrono::steady_clock::now();
+    bool tree = Mount::mountTree(dirsToMount, bindDir);
+    if (!tree) {
+        for (auto it = dirsToMount.begin(); it != dirsToMount.end(); ++it) {
+            it->get()->mount(bindDir);
+        }
     }
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+    tulog.debug("Mounted ", dirsToMount.size(), " directories in ", duration.count(), " us using ",
+                tree ? "a single detached mount tree." : Mount::mountApiSupported() ? "the mount API." : "libmount.");
 
     dirsToMount.push_back(std::move(mntBind));
 }
 
+// Switches to the given mount namespace, keeping the working directory if possible
+static void enterNamespace(int fd) {
+    std::error_code ec;
+    fs::path cwd = fs::current_path(ec);
+    if (setns(fd, CLONE_NEWNS) < 0)
+        throw std::runtime_error{"Entering mount namespace failed: " + std::string(strerror(errno))};
+    MountTable::invalidate();
+    if (!cwd.empty() && chdir(cwd.c_str()) < 0)
+        tulog.debug("Working directory ", cwd, " does not exist in mount namespace.");
+}
+
+// Keeps the environment's mount namespace alive after tukit exited by bind
+// mounting it to /run/tukit/<id>/mnt, so resuming the transaction can just
+// enter it instead of setting up everything again
+void Transaction::impl::pinNamespace() {
+    int ns = open("/proc/self/ns/mnt", O_RDONLY | O_CLOEXEC);
+    if (ns < 0)
+        throw std::runtime_error{"Opening mount namespace failed: " + std::string(strerror(errno))};
+    fs::path dir = PIN_DIR / snapshot->getUid();
+    try {
+        // The pin has to be visible in the caller's namespace; namespace
+        // files may only be mounted below a private mount
+        enterNamespace(hostNs);
+        fs::create_directories(dir);
+        auto& mounts = mountTable.getMountInfo();
+        if (std::none_of(mounts.begin(), mounts.end(), [](const MountInfo& m) { return m.mountpoint == PIN_DIR; })
+                && mount(PIN_DIR.c_str(), PIN_DIR.c_str(), NULL, MS_BIND, NULL) < 0)
+            throw std::runtime_error{"Bind mounting " + PIN_DIR.native() + " failed: " + std::string(strerror(errno))};
+        if (mount("none", PIN_DIR.c_str(), NULL, MS_PRIVATE, NULL) < 0)
+            throw std::runtime_error{"Making " + PIN_DIR.native() + " private failed: " + std::string(strerror(errno))};
+        std::ofstream{dir / "root"} << bindDir.native();
+        std::ofstream{dir / "mnt"};
+        std::string nsPath = "/proc/self/fd/" + std::to_string(ns);
+        if (mount(nsPath.c_str(), (dir / "mnt").c_str(), NULL, MS_BIND, NULL) < 0)
+            throw std::runtime_error{"Pinning mount namespace failed: " + std::string(strerror(errno))};
+        MountTable::invalidate();
+        pinDir = dir;
+        tulog.info("Pinned mount namespace of transaction to ", pinDir, ".");
+    } catch (const std::exception &e) {
+        tulog.info("WARNING: ", e.what(), " - the environment will be set up again for each call.");
+        std::error_code ec;
+        fs::remove_all(dir, ec);
+        close(hostNs);
+        hostNs = -1;
+    }
+    enterNamespace(ns);
+    close(ns);
+}
+
+void Transaction::unpinNamespace(std::string id) {
+    fs::path dir = PIN_DIR / id;
+    if (!fs::exists(dir / "mnt"))
+        return;
+    if (umount2((dir / "mnt").c_str(), MNT_DETACH) < 0 && errno != EINVAL)
+        tulog.error("Unpinning mount namespace ", dir, " failed: ", strerror(errno));
+    else
+        tulog.debug("Unpinned mount namespace ", dir, ".");
+    std::error_code ec;
+    fs::remove_all(dir, ec);
+}
+
+// Returns false if the transaction's namespace isn't pinned
+bool Transaction::impl::enterPinnedNamespace() {
+    fs::path dir = PIN_DIR / snapshot->getUid();
+    int ns = open((dir / "mnt").c_str(), O_RDONLY | O_CLOEXEC);
+    if (ns < 0)
+        return false;
+    std::string root;
+    std::ifstream{dir / "root"} >> root;
+    hostNs = open("/proc/self/ns/mnt", O_RDONLY | O_CLOEXEC);
+    try {
+        if (root.empty() || hostNs < 0)
+            throw std::runtime_error{"Reading pinned namespace failed."};
+        // setns() requires an unshared file system context, e.g. in tukitd's threads
+        if (unshare(CLONE_FS) < 0)
+            throw std::runtime_error{"Unsharing file system attributes failed: " + std::string(strerror(errno))};
+        enterNamespace(ns);
+    } catch (const std::exception &e) {
+        tulog.info("WARNING: ", e.what(), " - setting up a new environment.");
+        close(ns);
+        if (hostNs >= 0)
+            close(hostNs);
+        hostNs = -1;
+        return false;
+    }
+    close(ns);
+    bindDir = root;
+    pinDir = dir;
+    tulog.debug("Entered pinned mount namespace ", pinDir, ".");
+    return true;
+}
+
+// Leaves the pinned namespace; with teardown the environment is unmounted and
+// the namespace unpinned, otherwise it stays as it is for the next resume
+void Transaction::impl::releaseNamespace(bool teardown) {
+    if (pinDir.empty())
+        return;
+    if (teardown) {
+        dirsToMount.clear();
+        MountList::umountTree(bindDir);
+    }
+    enterNamespace(hostNs);
+    close(hostNs);
+    hostNs = -1;
+    if (teardown) {
+        unpinNamespace(snapshot->getUid());
+    } else {
+        // The directory is still in use by the pinned namespace
+        bindDir.clear();
+    }
+    pinDir.clear();
+}
+
 void Transaction::impl::addSupplements() {
     supplements = Supplements(bindDir);
 
-    Mount mntVar{"/var"};
-    if (mntVar.isMount()) {
+    if (mountTable.isMount("/var")) {
         supplements.addDir(fs::path{"/var/tmp"});
         supplements.addLink(fs::path{"/run"}, fs::path{"/var/run"});
     }
@@ -302,11 +478,17 @@ void Transaction::init(std::string base, std::optional<std::string> description)
         base = pImpl->snapshotMgr->getDefault();
     if (!description)
         description = "Snapshot Update of #" + base;
-    pImpl->snapshot = pImpl->snapshotMgr->create(base, description.value());
+    // Pool entries are only up to date if the base snapshot cannot have changed since
+    if (SnapshotPool::getSize(*pImpl->snapshotMgr) > 0 && pImpl->snapshotMgr->open(base)->isReadOnly())
+        pImpl->snapshot = SnapshotPool{*pImpl->snapshotMgr}.claim(base, description.value());
+    if (!pImpl->snapshot)
+        pImpl->snapshot = pImpl->snapshotMgr->create(base, description.value());
 
     tulog.info("Using snapshot " + base + " as base for new snapshot " + pImpl->snapshot->getUid() + ".");
 
     pImpl->snapMount();
+    if (pImpl->pinNs)
+        pImpl->pinNamespace();
     pImpl->addSupplements();
     if (pImpl->discardIfNoChange) {
         std::unique_ptr<Snapshot> prevSnap = pImpl->snapshotMgr->open(base);
@@ -335,11 +517,12 @@ void Transaction::resume(std::string id) {
         pImpl->snapshot.reset();
         throw std::invalid_argument{"Snapshot " + id + " is not an open transaction."};
     }
-    pImpl->snapMount();
-    pImpl->addSupplements();
     if (fs::exists(getRoot() / "discardIfNoChange")) {
         pImpl->discardIfNoChange = true;
     }
+    if (!pImpl->enterPinnedNamespace())
+        pImpl->snapMount();
+    pImpl->addSupplements();
 
     TransactionalUpdate::Plugins plugins_with_transaction{this, pImpl->keepIfError};
     plugins_with_transaction.run("resume-post", nullptr);
@@ -353,6 +536,10 @@ void Transaction::setDiscardIfUnchanged(bool discard) {
     pImpl->discardIfNoChange = discard;
 }
 
+void Transaction::setPinNamespace(bool pin) {
+    pImpl->pinNs = pin;
+}
+
 int Transaction::impl::inotifyRead() {
     const size_t bufLen = sizeof(struct inotify_event) + NAME_MAX + 1;
     char buf[bufLen] __attribute__((aligned(8)));
@@ -374,29 +561,221 @@ int Transaction::impl::inotifyRead() {
     return ret;
 }
 
-int Transaction::impl::runCommand(char* argv[], bool inChroot, std::string* output) {
-    if (discardIfNoChange) {
-        inotifyFd = inotify_init();
-        if (inotifyFd == -1)
-            throw std::runtime_error{"Couldn't initialize inotify."};
+// A single mark for the whole file system containing the snapshot (which is
+// usually a directory on it), so neither directories have to be walked nor
+// watches set up for new directories. Events outside of the snapshot are
+// filtered by fanotifyRead().
+bool Transaction::impl::fanotifyInit() {
+#ifdef FAN_REPORT_DFID_NAME
+    // The mark covers the whole file system, so the queue is drained while the
+    // command is running (see runCommand()); an overflow counts as a change
+    fanotifyFd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK | FAN_REPORT_DFID_NAME, O_RDONLY | O_CLOEXEC);
+    if (fanotifyFd < 0) {
+        tulog.debug("fanotify: Initialization failed: ", strerror(errno));
+        return false;
+    }
+    uint64_t mask = FAN_MODIFY | FAN_ATTRIB | FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_ONDIR;
+    fanotifyRootFd = open(snapshot->getRoot().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fanotifyRootFd < 0
+            || fanotify_mark(fanotifyFd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, mask, fanotifyRootFd, nullptr) < 0) {
+        tulog.debug("fanotify: Marking ", snapshot->getRoot(), " failed: ", strerror(errno));
+        close(fanotifyFd);
+        fanotifyFd = -1;
+        if (fanotifyRootFd >= 0)
+            close(fanotifyRootFd);
+        fanotifyRootFd = -1;
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
 
-        // Recursively register all directories of the root file system
-        inotifyExcludes = MountList::getList(snapshot->getRoot());
+// Reads all queued events until one is found inside of the snapshot. Events that
+// cannot be assigned to a path (e.g. because the directory is gone already) or a
+// queue overflow are counted as changes.
+void Transaction::impl::fanotifyRead() {
+#ifdef FAN_REPORT_DFID_NAME
+    const std::string root = snapshot->getRoot().lexically_normal();
+    char buf[16384] __attribute__((aligned(8)));
+    ssize_t len;
+    while (fanotifyFd >= 0 && !fanotifyChanged) {
+        len = read(fanotifyFd, buf, sizeof(buf));
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0 && errno == EAGAIN)
+            break;
+        if (len <= 0)
+            throw std::runtime_error{"Reading from fanotify fd failed: " + std::string(strerror(errno))};
+
+        auto event = reinterpret_cast<struct fanotify_event_metadata*>(buf);
+        for (; FAN_EVENT_OK(event, len) && !fanotifyChanged; event = FAN_EVENT_NEXT(event, len)) {
+            if (event->vers != FANOTIFY_METADATA_VERSION || (event->mask & FAN_Q_OVERFLOW)) {
+                tulog.debug("fanotify: Queue overflow, assuming changes.");
+                fanotifyChanged = true;
+                break;
+            }
+            // Find the directory record among the event's info records
+            struct fanotify_event_info_fid* info = nullptr;
+            char* end = reinterpret_cast<char*>(event) + event->event_len;
+            for (char* pos = reinterpret_cast<char*>(event) + event->metadata_len;
+                    pos + sizeof(struct fanotify_event_info_header) <= end;) {
+                auto hdr = reinterpret_cast<struct fanotify_event_info_header*>(pos);
+                if (hdr->len < sizeof(struct fanotify_event_info_header) || pos + hdr->len > end)
+                    break;
+                if ((hdr->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME || hdr->info_type == FAN_EVENT_INFO_TYPE_DFID)
+                        && hdr->len >= sizeof(struct fanotify_event_info_fid) + sizeof(struct file_handle)) {
+                    auto candidate = reinterpret_cast<struct fanotify_event_info_fid*>(pos);
+                    auto handle = reinterpret_cast<struct file_handle*>(candidate->handle);
+                    if (sizeof(struct fanotify_event_info_fid) + sizeof(struct file_handle) + handle->handle_bytes <= hdr->len) {
+                        info = candidate;
+                        break;
+                    }
+                }
+                pos += hdr->len;
+            }
+            if (info == nullptr) {
+                tulog.debug("fanotify: Event without directory information, assuming changes.");
+                fanotifyChanged = true;
+                break;
+            }
+            auto handle = reinterpret_cast<struct file_handle*>(info->handle);
+            int fd = open_by_handle_at(fanotifyRootFd, handle, O_PATH | O_CLOEXEC);
+            if (fd < 0) {
+                tulog.debug("fanotify: Cannot resolve changed directory, assuming changes: ", strerror(errno));
+                fanotifyChanged = true;
+                break;
+            }
+            char dir[PATH_MAX];
+            ssize_t dirLen = readlink(("/proc/self/fd/" + std::to_string(fd)).c_str(), dir, sizeof(dir) - 1);
+            close(fd);
+            if (dirLen < 0)
+                continue;
+            fs::path path = std::string(dir, dirLen);
+            if (info->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME) {
+                // The name is NUL terminated and padded up to the end of the record
+                const char* name = reinterpret_cast<char*>(handle->f_handle + handle->handle_bytes);
+                const char* nameEnd = reinterpret_cast<char*>(info) + info->hdr.len;
+                std::string entry{name, strnlen(name, nameEnd - name)};
+                if (!entry.empty() && entry != ".")
+                    path /= entry;
+            }
+            const std::string& changed = path.native();
+            if (changed.compare(0, root.length(), root) == 0
+                    && (changed.length() == root.length() || changed[root.length()] == '/')) {
+                tulog.debug("fanotify: Change of ", changed);
+                fanotifyChanged = true;
+            }
+        }
+    }
+    if (fanotifyChanged && fanotifyFd >= 0) {
+        close(fanotifyFd);
+        fanotifyFd = -1;
+    }
+#endif
+}
 
-        // /usr is always part of the root fs, so never exclude it (e.g. on apply)
-        auto itr = std::find(inotifyExcludes.begin(), inotifyExcludes.end(), (snapshot->getRoot() / "usr"));
-        if (itr != inotifyExcludes.end()) inotifyExcludes.erase(itr);
+// Changes are detected from the start of the first command until the transaction is closed
+// or kept. On btrfs every change of the snapshot's subvolume increases its generation, so
+// comparing that is enough; otherwise the file system is watched with fanotify or, if that
+// is not available, every directory of the root file system is watched with inotify.
+void Transaction::impl::trackChanges() {
+    if (isTrackingChanges())
+        return;
 
-        // On rw systems, /etc may be a separate mount after 'apply', though it's
-        // also part of the root file system
-        std::unique_ptr<Mount> mntEtc{new Mount{"/etc"}};
-        if (! mntEtc->isMount()) {
-            auto itr = std::find(inotifyExcludes.begin(), inotifyExcludes.end(), (snapshot->getRoot() / "etc"));
-            if (itr != inotifyExcludes.end()) inotifyExcludes.erase(itr);
+    if (Subvolume::isSubvolume(snapshot->getRoot())) {
+        try {
+            baseGeneration = Subvolume{snapshot->getRoot()}.getGeneration();
+            tulog.debug("Detecting changes by subvolume generation ", *baseGeneration, ".");
+            return;
+        } catch (const std::exception &e) {
+            tulog.debug(e.what(), "; falling back to fanotify.");
         }
+    }
+    if (fanotifyInit())
+        return;
+
+    inotifyFd = inotify_init();
+    if (inotifyFd == -1)
+        throw std::runtime_error{"Couldn't initialize inotify."};
 
-        nftw(snapshot->getRoot().c_str(), inotifyAdd, 20, FTW_MOUNT | FTW_PHYS);
+    // Recursively register all directories of the root file system
+    inotifyExcludes = mountTable.getList(snapshot->getRoot());
+
+    // /usr is always part of the root fs, so never exclude it (e.g. on apply)
+    auto itr = std::find(inotifyExcludes.begin(), inotifyExcludes.end(), (snapshot->getRoot() / "usr"));
+    if (itr != inotifyExcludes.end()) inotifyExcludes.erase(itr);
+
+    // On rw systems, /etc may be a separate mount after 'apply', though it's
+    // also part of the root file system
+    if (!mountTable.isMount("/etc")) {
+        auto itr = std::find(inotifyExcludes.begin(), inotifyExcludes.end(), (snapshot->getRoot() / "etc"));
+        if (itr != inotifyExcludes.end()) inotifyExcludes.erase(itr);
+    }
+
+    nftw(snapshot->getRoot().c_str(), inotifyAdd, 20, FTW_MOUNT | FTW_PHYS);
+}
+
+bool Transaction::impl::isTrackingChanges() {
+    return baseGeneration || fanotifyFd >= 0 || fanotifyChanged || inotifyFd != 0;
+}
+
+bool Transaction::impl::hasChanges() {
+    if (baseGeneration)
+        return Subvolume{snapshot->getRoot()}.getGeneration() != *baseGeneration;
+    if (fanotifyFd >= 0 || fanotifyChanged) {
+        fanotifyRead();
+        return fanotifyChanged;
     }
+    return inotifyRead() > 0;
+}
+
+// Passes the output on in complete lines as far as possible, so the handler doesn't have to
+// reassemble them, while never buffering more than one chunk. Pending fanotify
+// events are read in between, so the queue doesn't grow while the command runs.
+void Transaction::impl::readOutput(int fd, const OutputHandler& handler) {
+    std::vector<char> buffer(64 * 1024);
+    size_t filled = 0;
+    ssize_t len;
+    for (;;) {
+        struct pollfd pfds[2] = {{fd, POLLIN, 0}, {fanotifyFd, POLLIN, 0}};
+        if (poll(pfds, fanotifyFd >= 0 ? 2 : 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error{"Polling command output failed: " + std::string(strerror(errno))};
+        }
+        if (pfds[1].revents & POLLIN)
+            fanotifyRead();
+        if (pfds[0].revents == 0)
+            continue;
+        len = read(fd, buffer.data() + filled, buffer.size() - filled);
+        if (len == 0)
+            break;
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error{"Reading command output failed: " + std::string(strerror(errno))};
+        }
+        // The data kept from the last read doesn't contain a line break
+        auto lineEnd = static_cast<const char*>(memrchr(buffer.data() + filled, '\n', len));
+        filled += len;
+        size_t complete = lineEnd ? lineEnd - buffer.data() + 1 : 0;
+        if (complete == 0 && filled == buffer.size())
+            complete = filled;
+        if (complete > 0) {
+            handler(buffer.data(), complete);
+            memmove(buffer.data(), buffer.data() + complete, filled - complete);
+            filled -= complete;
+        }
+    }
+    if (filled > 0)
+        handler(buffer.data(), filled);
+}
+
+int Transaction::impl::runCommand(char* argv[], bool inChroot, const OutputHandler* handler) {
+    if (discardIfNoChange)
+        trackChanges();
 
     std::string opts = "Executing `";
     int i = 0;
@@ -422,7 +801,7 @@ int Transaction::impl::runCommand(char* argv[], bool inChroot, std::string* outp
     if (pid < 0) {
         throw std::runtime_error{"fork() failed: " + std::string(strerror(errno))};
     } else if (pid == 0) {
-        if (output != nullptr) {
+        if (handler != nullptr) {
             ret = dup2(pipefd[1], STDOUT_FILENO);
             if (ret < 0) {
                 tulog.error("Redirecting stdout failed: " + std::string(strerror(errno)));
@@ -483,16 +862,30 @@ int Transaction::impl::runCommand(char* argv[], bool inChroot, std::string* outp
         if (ret < 0) {
             throw std::runtime_error{"Closing pipefd failed: " + std::string(strerror(errno))};
         }
-        if (output != nullptr) {
-            char buffer[2048];
-            ssize_t len;
-            while((len = read(pipefd[0], buffer, 2048)) > 0) {
-                output->append(buffer, len);
+        this->pidCmd = pid;
+        if (handler != nullptr) {
+            try {
+                readOutput(pipefd[0], *handler);
+            } catch (...) {
+                // Let the command fail on its next write instead of blocking forever
+                close(pipefd[0]);
+                waitpid(pid, &status, 0);
+                this->pidCmd = 0;
+                throw;
             }
         }
-
-        this->pidCmd = pid;
-        ret = waitpid(pid, &status, 0);
+        close(pipefd[0]);
+
+        // Without output to read only the fanotify queue has to be drained
+        ret = 0;
+        while (ret == 0 && fanotifyFd >= 0) {
+            struct pollfd pfd = {fanotifyFd, POLLIN, 0};
+            if (poll(&pfd, 1, 100) > 0)
+                fanotifyRead();
+            ret = waitpid(pid, &status, WNOHANG);
+        }
+        if (ret == 0)
+            ret = waitpid(pid, &status, 0);
         this->pidCmd = 0;
         if (ret < 0) {
             throw std::runtime_error{"waitpid() failed: " + std::string(strerror(errno))};
@@ -507,36 +900,86 @@ int Transaction::impl::runCommand(char* argv[], bool inChroot, std::string* outp
             }
         }
     }
+    // Events queued after the command's output was closed
+    if (fanotifyFd >= 0)
+        fanotifyRead();
     return ret;
 }
 
 int Transaction::execute(char* argv[], std::string* output) {
+    if (output == nullptr)
+        return execute(argv, OutputHandler{});
+    return execute(argv, [output](const char* data, size_t len) { output->append(data, len); });
+}
+
+int Transaction::execute(char* argv[], const OutputHandler& handler) {
     TransactionalUpdate::Plugins plugins{this, pImpl->keepIfError};
     plugins.run("execute-pre", argv);
-    int status = this->pImpl->runCommand(argv, true, output);
+    int status = this->pImpl->runCommand(argv, true, handler ? &handler : nullptr);
     plugins.run("execute-post", argv);
     return status;
 }
 
+// Replaces all occurrences of {} by the mount directory
+static std::string replaceMountDir(std::string s, const std::string& bindDir) {
+    std::string from = "{}";
+    for(size_t pos = 0;
+        (pos = s.find(from, pos)) != std::string::npos;
+        pos += bindDir.length())
+        s.replace(pos, from.size(), bindDir);
+    return s;
+}
+
 int Transaction::callExt(char* argv[], std::string* output) {
+    if (output == nullptr)
+        return callExt(argv, OutputHandler{});
+    return callExt(argv, [output](const char* data, size_t len) { output->append(data, len); });
+}
+
+int Transaction::callExt(char* argv[], const OutputHandler& handler) {
     for (int i=0; argv[i] != nullptr; i++) {
-        std::string s = std::string(argv[i]);
-        std::string from = "{}";
-        // replacing all {} by bindDir
-        for(size_t pos = 0;
-            (pos = s.find(from, pos)) != std::string::npos;
-            pos += getRoot().string().length())
-            s.replace(pos, from.size(), this->pImpl->bindDir);
-        argv[i] = strdup(s.c_str());
+        argv[i] = strdup(replaceMountDir(argv[i], this->pImpl->bindDir).c_str());
     }
 
     TransactionalUpdate::Plugins plugins{this, pImpl->keepIfError};
     plugins.run("callExt-pre", argv);
-    int status = this->pImpl->runCommand(argv, false, output);
+    int status = this->pImpl->runCommand(argv, false, handler ? &handler : nullptr);
     plugins.run("callExt-post", argv);
     return status;
 }
 
+std::vector<int> Transaction::executeBatch(const std::vector<BatchStep>& steps) {
+    for (auto& step: steps) {
+        if (step.argv.empty())
+            throw std::invalid_argument{"Missing command in batch step."};
+    }
+
+    TransactionalUpdate::Plugins plugins{this, pImpl->keepIfError};
+    std::vector<int> results;
+    for (size_t i = 0; i < steps.size(); i++) {
+        std::vector<std::string> args = steps[i].argv;
+        std::vector<char*> argv;
+        for (auto& arg: args) {
+            if (steps[i].external)
+                arg = replaceMountDir(arg, pImpl->bindDir);
+            argv.push_back(arg.data());
+        }
+        argv.push_back(nullptr);
+
+        std::string stage = steps[i].external ? "callExt" : "execute";
+        tulog.info("Batch step ", i + 1, " of ", steps.size(), ":");
+        plugins.run(stage + "-pre", argv.data());
+        int status = pImpl->runCommand(argv.data(), !steps[i].external, nullptr);
+        plugins.run(stage + "-post", argv.data());
+        results.push_back(status);
+        if (status != 0 && steps[i].stopOnError) {
+            tulog.info("Batch step ", i + 1, " failed, skipping the remaining steps.");
+            break;
+        }
+    }
+    return results;
+}
+
 void Transaction::sendSignal(int signal) {
     if (pImpl->pidCmd != 0) {
         if (kill(pImpl->pidCmd, signal) < 0) {
@@ -548,16 +991,15 @@ void Transaction::sendSignal(int signal) {
 void Transaction::impl::closeSnapshot(bool aborted) {
     sync();
     if (discardIfNoChange &&
-            ((inotifyFd != 0 && inotifyRead() == 0) ||
-            (inotifyFd == 0 && fs::exists(snapshot->getRoot() / "discardIfNoChange")))) {
+            ((isTrackingChanges() && !hasChanges()) ||
+            (!isTrackingChanges() && fs::exists(snapshot->getRoot() / "discardIfNoChange")))) {
         tulog.info("No changes to the root file system - discarding snapshot.");
 
         // Even if the snapshot itself does not contain any changes, /etc may do so. If the new snapshot is a
         // direct descendant of the currently running system, then merge the changes back into the currently
         // running system directly and delete the snapshot. Otherwise merge it back into the previous overlay
-        // (using rsync instead of a plain copy to preserve xattrs).
-        std::unique_ptr<Mount> mntEtc{new Mount{"/etc"}};
-        if (mntEtc->isMount()) {
+        // (using Sync instead of a plain copy to preserve xattrs).
+        if (mountTable.isMount("/etc")) {
             std::filesystem::path targetRoot = "/";
             std::string base;
 
@@ -572,9 +1014,14 @@ void Transaction::impl::closeSnapshot(bool aborted) {
                 tulog.info("Merging changes in /etc into the previous snapshot.");
                 targetRoot = snapshotMgr->open(base)->getRoot();
             }
-            Util::exec("rsync --archive --inplace --xattrs --acls --exclude 'fstab' --exclude 'etc.syncpoint' --delete --quiet '" + bindDir.native() + "/etc/' " + targetRoot.native() + "/etc");
+            Sync etcSync{bindDir / "etc", targetRoot / "etc"};
+            etcSync.exclude("fstab");
+            etcSync.exclude("etc.syncpoint");
+            etcSync.setDelete(true);
+            etcSync.run();
         }
 
+        releaseNamespace(true);
         TransactionalUpdate::Plugins plugins_without_transaction{nullptr, keepIfError};
         plugins_without_transaction.run("finalize-post", snapshot->getUid() + " " + "discarded");
         snapshot->abort();
@@ -589,10 +1036,19 @@ void Transaction::impl::closeSnapshot(bool aborted) {
         throw std::runtime_error{"Updating /usr timestamp failed: " + std::string(strerror(errno))};
 
     if (! aborted) {
+        if (Subvolume::isSubvolume(snapshot->getRoot())) {
+            // Only informational, the snapshot is usable without it
+            try {
+                ChangeManifest::compute(snapshot->getRoot()).write(ChangeManifest::getFile(snapshot->getRoot()));
+            } catch (const std::exception &e) {
+                tulog.error("Recording the changed files failed: ", e.what());
+            }
+        }
         snapshot->close();
     }
     supplements.cleanup();
     dirsToMount.clear();
+    releaseNamespace(true);
 
     std::unique_ptr<Snapshot> defaultSnap = snapshotMgr->open(snapshotMgr->getDefault());
     if (defaultSnap->isReadOnly())
@@ -600,6 +1056,13 @@ void Transaction::impl::closeSnapshot(bool aborted) {
     if (! aborted) {
         snapshot->setDefault();
         tulog.info("New default snapshot is #" + snapshot->getUid() + " (" + std::string(snapshot->getRoot()) + ").");
+        if (SnapshotPool::getSize(*snapshotMgr) > 0) {
+            try {
+                SnapshotPool{*snapshotMgr}.updateInBackground(snapshot->getUid());
+            } catch (const std::exception &e) {
+                tulog.error("Updating the snapshot pool failed: ", e.what());
+            }
+        }
     }
 }
 
@@ -616,12 +1079,36 @@ void Transaction::finalize() {
     plugins_without_transaction.run("finalize-post", id);
 }
 
+bool Transaction::abort() {
+    std::string id = pImpl->snapshot->getUid();
+    tulog.info("Discarding snapshot ", id, ".");
+
+    // The snapshot can't be deleted while the environment is still mounted
+    if (!pImpl->pinDir.empty())
+        pImpl->releaseNamespace(true);
+    pImpl->dirsToMount.clear();
+    if (!pImpl->bindDir.empty()) {
+        fs::remove(pImpl->bindDir);
+        pImpl->bindDir.clear();
+    }
+    if (pImpl->keepIfError) {
+        pImpl->closeSnapshot(true);
+    } else {
+        pImpl->snapshot->abort();
+    }
+    pImpl->snapshot.reset();
+
+    TransactionalUpdate::Plugins plugins{nullptr, pImpl->keepIfError};
+    plugins.run("abort-post", id);
+    return !pImpl->keepIfError;
+}
+
 void Transaction::keep() {
     TransactionalUpdate::Plugins plugins{this, pImpl->keepIfError};
     plugins.run("keep-pre", nullptr);
 
     sync();
-    if (fs::exists(pImpl->snapshot->getRoot() / "discardIfNoChange") && (inotifyFd != 0 && pImpl->inotifyRead() > 0)) {
+    if (fs::exists(pImpl->snapshot->getRoot() / "discardIfNoChange") && pImpl->isTrackingChanges() && pImpl->hasChanges()) {
         tulog.debug("Snapshot was changed, removing discard flagfile.");
         fs::remove(pImpl->snapshot->getRoot() / "discardIfNoChange");
     }
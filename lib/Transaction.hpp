@@ -13,7 +13,11 @@
 #define T_U_TRANSACTION_H
 
 #include <filesystem>
+#include <functional>
+#include <memory>
 #include <optional>
+#include <string>
+#include <vector>
 
 namespace TransactionalUpdate {
 
@@ -61,9 +65,11 @@ public:
      * @brief Set flag to discard snapshots if no changes are detected
      * @param discard true or false
      *
-     * If discard is true, then an inotify watcher will be registered to listen for changes
-     * in the root file system during execute() and callExt() calls. In case no change is
-     * detected the snapshot will be discarded when calling finalize().
+     * If discard is true, then changes in the root file system will be detected from the first
+     * execute() or callExt() call on. If the snapshot is a btrfs subvolume, its generation
+     * number is compared, otherwise the snapshot's file system is watched with fanotify or, if
+     * that is not supported, an inotify watcher will be registered for every directory.
+     * In case no change is detected the snapshot will be discarded when calling finalize().
      * If the snapshot will be discarded and if /etc is an overlay file system, then potentially
      * changed files in /etc will be synchronized into the running system.
      *
@@ -72,10 +78,37 @@ public:
      * whether the snapshot may be a candidate for discarding.
      *
      * Be aware that inotify registration may fail, e.g. if a system has a lot of open inotify
-     * listeners already. Changes may not be detected correctly in this case.
+     * listeners already. Changes may not be detected correctly in this case. With btrfs any
+     * change to the subvolume counts, so the snapshot is mounted with noatime.
      */
     void setDiscardIfUnchanged(bool discard);
 
+    /**
+     * @brief Keep the update environment's mount namespace between calls
+     * @param pin true or false
+     *
+     * If pin is true, then the mount namespace containing the prepared update environment
+     * (bind mounts, SELinux relabelling of /var etc.) is bind mounted to /run/tukit/<id>/mnt
+     * by init(). Later resume() calls for the same snapshot will just enter that namespace
+     * instead of setting up the environment again; it is unmounted when the transaction is
+     * finalized or aborted, or when the snapshot is deleted. As the environment is reused,
+     * files in its /run and /tmp persist across calls.
+     *
+     * This method has to be called before init(), otherwise setting the mode has no effect.
+     * If the namespace cannot be pinned, the transaction continues without.
+     */
+    void setPinNamespace(bool pin);
+
+    /**
+     * @brief Release the pinned mount namespace of a kept transaction
+     * @param id Snapshot ID
+     *
+     * Has to be called before the snapshot of a kept transaction is deleted without
+     * resuming it, as the pinned environment would keep the snapshot mounted otherwise.
+     * Does nothing if the transaction's namespace isn't pinned.
+     */
+    static void unpinNamespace(std::string id);
+
     /**
      * @brief Resume an existing transaction
      * @param id Snapshot ID
@@ -99,6 +132,27 @@ public:
      */
     int execute(char* argv[], std::string *output=nullptr);
 
+    /**
+     * @brief Receives a command's output while it is running
+     *
+     * stdout and stderr of the command are combined. The output is passed on in complete
+     * lines (possibly several at once), except for lines exceeding the internal buffer of
+     * 64 KiB and a missing line break at the end of the output.
+     */
+    using OutputHandler = std::function<void(const char* data, size_t len)>;
+
+    /**
+     * @brief Execute the given application in the new snapshot, streaming its output
+     * @param argv
+     * @param handler Called with the command's output; if empty the output will be printed
+     * to the corresponding streams
+     * @return application's return code
+     *
+     * Like execute(char*[], std::string*), but without keeping the whole output in memory.
+     * Exceptions thrown by the handler are passed on after the command has terminated.
+     */
+    int execute(char* argv[], const OutputHandler& handler);
+
     /**
      * @brief Replace '{}' in argv with mount directory and execute command
      * @param argv
@@ -118,6 +172,34 @@ public:
      */
     int callExt(char* argv[], std::string *output=nullptr);
 
+    /**
+     * @brief Replace '{}' in argv with mount directory and execute command, streaming its output
+     * @param argv
+     * @param handler Called with the command's output, see execute(char*[], const OutputHandler&)
+     * @return application's return code
+     */
+    int callExt(char* argv[], const OutputHandler& handler);
+
+    struct BatchStep {
+        std::vector<std::string> argv;
+        // Run like callExt() instead of execute()
+        bool external = false;
+        // Skip the remaining steps if this one returns a non-zero exit status
+        bool stopOnError = true;
+    };
+
+    /**
+     * @brief Execute several commands in a row
+     * @param steps Commands to execute
+     * @return exit status of each executed step
+     *
+     * Executes the steps one after another as execute() or callExt() would, but within the
+     * same environment and looking up the plugins only once. If a step returns a non-zero exit
+     * status and stopOnError is set for it, the remaining steps are skipped, i.e. the returned
+     * vector may be shorter than @steps.
+     */
+    std::vector<int> executeBatch(const std::vector<BatchStep>& steps);
+
     /**
      * @brief Close a transaction and set it as the new default snapshot
      *
@@ -139,6 +221,16 @@ public:
      */
     void keep();
 
+    /**
+     * @brief Discard the transaction right away
+     * @return true if the snapshot was deleted, false if it was closed as aborted instead
+     * because of setKeepIfError()
+     *
+     * Does the same as the destructor for a transaction that was neither finalized nor kept,
+     * but errors are thrown instead of only being logged.
+     */
+    bool abort();
+
     /**
      * @brief Sends a signal to the executed process
      * @param int Signal number
@@ -0,0 +1,91 @@
+# SPDX-License-Identifier: GPL-2.0-or-later
+# SPDX-FileCopyrightText: Copyright SUSE LLC
+
+# Common setup for tests which need a real btrfs file system: a loop image
+# with snapper's snapshot layout is created, and commands are run chrooted
+# into its snapshot 1 inside a separate mount namespace. Snapshot 1 is thus
+# the current and the default snapshot, without touching the host's
+# snapshots.
+#
+# Tests are skipped if not running as root or if btrfs isn't available.
+
+btrfs_dir=""
+btrfs_loop=""
+
+# Binaries to be copied into snapshot 1 together with the libraries they need
+btrfs_binaries=(sh true touch cat)
+
+btrfs_setup() {
+	[ "$(id -u)" -eq 0 ] || skip "needs to be run as root"
+	command -v mkfs.btrfs >/dev/null || skip "mkfs.btrfs is not installed"
+	command -v btrfs >/dev/null || skip "btrfs is not installed"
+	grep -qw btrfs /proc/filesystems || modprobe btrfs 2>/dev/null || skip "btrfs is not supported"
+	helper="${PWD}/snapshot-helper"
+	[ -x "${helper}" ] || skip "snapshot-helper is missing, use 'make check'"
+
+	btrfs_dir="$(mktemp --directory /tmp/tukit.btrfstest.XXXX)"
+	# Mount namespaces can only be bound to files on private mounts
+	mount --bind "${btrfs_dir}" "${btrfs_dir}"
+	mount --make-private "${btrfs_dir}"
+	truncate --size 512M "${btrfs_dir}/image"
+	mkfs.btrfs --quiet "${btrfs_dir}/image"
+	btrfs_loop="$(losetup --find --show "${btrfs_dir}/image")"
+	touch "${btrfs_dir}/ns"
+	unshare --mount="${btrfs_dir}/ns" --propagation private true
+
+	local top="${btrfs_dir}/top"
+	local snapshot="${top}/.snapshots/1/snapshot"
+	btrfs_ns mkdir "${top}" "${btrfs_dir}/root"
+	btrfs_ns mount "${btrfs_loop}" "${top}"
+	btrfs_ns btrfs subvolume create "${top}/.snapshots" >/dev/null
+	btrfs_ns mkdir "${top}/.snapshots/1"
+	btrfs_ns btrfs subvolume create "${snapshot}" >/dev/null
+	cat > "${btrfs_dir}/info.xml" <<-EOF
+		<?xml version="1.0"?>
+		<snapshot>
+		  <type>single</type>
+		  <num>1</num>
+		  <date>$(date --utc +"%Y-%m-%d %H:%M:%S")</date>
+		  <description>first root filesystem</description>
+		</snapshot>
+	EOF
+	btrfs_ns cp "${btrfs_dir}/info.xml" "${top}/.snapshots/1/info.xml"
+	btrfs_ns btrfs subvolume set-default "${snapshot}"
+
+	btrfs_ns mkdir -p "${snapshot}"/{.snapshots,dev,etc,proc,run,sys,tmp,var/cache,var/log}
+	btrfs_ns touch "${snapshot}/etc/fstab"
+	local binary file
+	for binary in "${helper}" "${btrfs_binaries[@]}"; do
+		binary="$(command -v "${binary}")"
+		for file in "${binary}" $(ldd "${binary}" | grep --only-matching '/[^ ]*'); do
+			btrfs_ns cp --dereference --parents "${file}" "${snapshot}"
+		done
+	done
+
+	local root="${btrfs_dir}/root"
+	btrfs_ns mount -o subvol=.snapshots/1/snapshot "${btrfs_loop}" "${root}"
+	btrfs_ns mount -o subvol=.snapshots "${btrfs_loop}" "${root}/.snapshots"
+	for dir in dev proc sys; do
+		btrfs_ns mount --rbind "/${dir}" "${root}/${dir}"
+	done
+}
+
+btrfs_teardown() {
+	[ -n "${btrfs_dir}" ] || return 0
+	# Releasing the namespace unmounts everything mounted in it
+	umount "${btrfs_dir}/ns" 2>/dev/null || true
+	[ -z "${btrfs_loop}" ] || losetup --detach "${btrfs_loop}"
+	umount "${btrfs_dir}"
+	rm -rf "${btrfs_dir}"
+}
+
+# Runs the given command in the test's mount namespace; the top level
+# subvolume is mounted at ${btrfs_dir}/top
+btrfs_ns() {
+	nsenter --mount="${btrfs_dir}/ns" "$@"
+}
+
+# Runs the given command chrooted into snapshot 1
+btrfs_run() {
+	nsenter --mount="${btrfs_dir}/ns" chroot "${btrfs_dir}/root" "$@"
+}
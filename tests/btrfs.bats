@@ -0,0 +1,121 @@
+# SPDX-License-Identifier: GPL-2.0-or-later
+# SPDX-FileCopyrightText: Copyright SUSE LLC
+
+load btrfs
+
+setup() {
+	btrfs_setup
+}
+
+teardown() {
+	btrfs_teardown
+}
+
+@test "btrfs: Create and list snapshots" {
+	run btrfs_run "${helper}" create 1 "Test snapshot"
+	[ "$status" -eq 0 ]
+	[ "$output" = "2" ]
+	btrfs_ns test -d "${btrfs_dir}/top/.snapshots/2/snapshot/etc"
+
+	run btrfs_run "${helper}" list number,description,default,active
+	[ "$status" -eq 0 ]
+	[ "${#lines[@]}" -eq 3 ]
+	[ "${lines[0]}" = $'0\tcurrent\tno\tno' ]
+	[ "${lines[1]}" = $'1\tfirst root filesystem\tyes\tyes' ]
+	[ "${lines[2]}" = $'2\tTest snapshot\tno\tno' ]
+}
+
+@test "btrfs: Create snapshot of a missing base" {
+	run btrfs_run "${helper}" create 5 "Test snapshot"
+	[ "$status" -eq 1 ]
+	[[ "$output" == *"Base snapshot '5' does not exist."* ]]
+	btrfs_ns test ! -e "${btrfs_dir}/top/.snapshots/2"
+}
+
+@test "btrfs: Delete snapshots" {
+	btrfs_run "${helper}" create 1 "Test snapshot A"
+	btrfs_run "${helper}" create 1 "Test snapshot B"
+	btrfs_run "${helper}" create 1 "Test snapshot C"
+
+	run btrfs_run "${helper}" delete 2 4
+	[ "$status" -eq 0 ]
+	run btrfs_run "${helper}" list number
+	[ "$output" = $'0\n1\n3' ]
+	btrfs_ns test ! -e "${btrfs_dir}/top/.snapshots/2"
+	btrfs_ns test ! -e "${btrfs_dir}/top/.snapshots/4"
+}
+
+@test "btrfs: Default and current snapshot can't be deleted" {
+	btrfs_run "${helper}" create 1 "Test snapshot"
+	btrfs_run "${helper}" set-default 2
+
+	run btrfs_run "${helper}" delete 2
+	[ "$status" -eq 1 ]
+	[[ "$output" == *"it is the default snapshot"* ]]
+	run btrfs_run "${helper}" delete 1
+	[ "$status" -eq 1 ]
+	[[ "$output" == *"it is the currently mounted snapshot"* ]]
+	btrfs_ns test -d "${btrfs_dir}/top/.snapshots/1/snapshot"
+	btrfs_ns test -d "${btrfs_dir}/top/.snapshots/2/snapshot"
+}
+
+@test "btrfs: Set default snapshot" {
+	btrfs_run "${helper}" create 1 "Test snapshot"
+
+	run btrfs_run "${helper}" set-default 2
+	[ "$status" -eq 0 ]
+	run btrfs_run "${helper}" default
+	[ "$output" = "2" ]
+	run btrfs_ns btrfs subvolume get-default "${btrfs_dir}/top"
+	[[ "$output" == *" path .snapshots/2/snapshot" ]]
+	run btrfs_run "${helper}" current
+	[ "$output" = "1" ]
+}
+
+@test "btrfs: Rollback on a writable system boots a copy of the snapshot" {
+	btrfs_run "${helper}" create 1 "Test snapshot"
+
+	run btrfs_run "${helper}" rollback 2
+	[ "$status" -eq 0 ]
+	[ "$output" = "3" ]
+	run btrfs_run "${helper}" list number,description,default,read-only
+	[ "${lines[2]}" = $'2\tTest snapshot\tno\tno' ]
+	[ "${lines[3]}" = $'3\tRollback to snapshot 2\tyes\tno' ]
+}
+
+@test "btrfs: Rollback on a read-only system boots the snapshot itself" {
+	btrfs_run "${helper}" set-read-only 1 yes
+	btrfs_run "${helper}" create 1 "Test snapshot"
+	btrfs_run "${helper}" set-read-only 2 yes
+
+	run btrfs_run "${helper}" rollback 2
+	[ "$status" -eq 0 ]
+	[ "$output" = "2" ]
+	run btrfs_run "${helper}" list number,default,read-only
+	[ "${#lines[@]}" -eq 3 ]
+	[ "${lines[2]}" = $'2\tyes\tyes' ]
+}
+
+@test "btrfs: Rollback to a missing snapshot" {
+	run btrfs_run "${helper}" rollback 5
+	[ "$status" -eq 1 ]
+	[[ "$output" == *"Snapshot 5 does not exist."* ]]
+	run btrfs_run "${helper}" default
+	[ "$output" = "1" ]
+}
+
+@test "btrfs: Discard a snapshot without changes" {
+	run btrfs_run "${helper}" execute --discard 1 cat /etc/fstab
+	[ "$status" -eq 0 ]
+	run btrfs_run "${helper}" list number
+	[ "$output" = $'0\n1' ]
+	btrfs_ns test ! -e "${btrfs_dir}/top/.snapshots/2"
+}
+
+@test "btrfs: Keep a snapshot with changes despite discard" {
+	run btrfs_run "${helper}" execute --discard 1 touch /etc/changed
+	[ "$status" -eq 0 ]
+	run btrfs_run "${helper}" list number
+	[ "$output" = $'0\n1\n2' ]
+	btrfs_ns test -e "${btrfs_dir}/top/.snapshots/2/snapshot/etc/changed"
+}
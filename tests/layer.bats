@@ -0,0 +1,103 @@
+# SPDX-License-Identifier: GPL-2.0-or-later
+# SPDX-FileCopyrightText: Copyright SUSE LLC
+
+load oci
+
+setup() {
+	oci_setup
+
+	mkdir -p lower/dir
+	echo "a" > lower/dir/a
+	echo "b" > lower/dir/b
+	lower="$(oci_layer lower)"
+}
+
+@test "layer: Whiteouts remove entries of lower layers" {
+	mkdir -p upper/dir
+	touch upper/dir/.wh.a
+	oci_image "${lower}" "$(oci_layer upper)"
+
+	run "${helper}" "oci:${oci_dir}" "${root}" "${record}"
+	[ "$status" -eq 0 ]
+	[ ! -e "${root}/dir/a" ]
+	[ ! -e "${root}/dir/.wh.a" ]
+	[ "$(cat "${root}/dir/b")" = "b" ]
+}
+
+@test "layer: Opaque directories hide the entries of lower layers" {
+	mkdir -p upper/dir
+	touch upper/dir/.wh..wh..opq
+	# Sorted before and after the opaque whiteout
+	echo "first" > upper/dir/+first
+	echo "c" > upper/dir/c
+	oci_image "${lower}" "$(oci_layer upper)"
+
+	run "${helper}" "oci:${oci_dir}" "${root}" "${record}"
+	[ "$status" -eq 0 ]
+	[ "$(ls -A "${root}/dir" | tr '\n' ' ')" = "+first c " ]
+}
+
+@test "layer: Hard links" {
+	mkdir links
+	echo "data" > links/file
+	ln links/file links/link
+	oci_image "$(oci_layer links)"
+
+	run "${helper}" "oci:${oci_dir}" "${root}" "${record}"
+	[ "$status" -eq 0 ]
+	[ "$(stat --format %i "${root}/file")" = "$(stat --format %i "${root}/link")" ]
+	[ "$(stat --format %h "${root}/file")" -eq 2 ]
+	[ "$(cat "${root}/link")" = "data" ]
+}
+
+@test "layer: File properties and long names" {
+	local long="$(printf 'directory%.0s/' {1..12})$(printf 'x%.0s' {1..120})"
+	mkdir -p "props/$(dirname "${long}")"
+	echo "long" > "props/${long}"
+	echo "data" > props/file
+	chmod 0751 props/file
+	touch --date "2020-01-02 03:04:05" props/file
+	ln -s file props/symlink
+	oci_image "$(oci_layer props)"
+
+	run "${helper}" "oci:${oci_dir}" "${root}" "${record}"
+	[ "$status" -eq 0 ]
+	[ "$(cat "${root}/${long}")" = "long" ]
+	[ "$(stat --format %a "${root}/file")" = "751" ]
+	[ "$(stat --format %Y "${root}/file")" = "$(date --date "2020-01-02 03:04:05" +%s)" ]
+	[ "$(readlink "${root}/symlink")" = "file" ]
+}
+
+@test "layer: Extended attributes" {
+	command -v setfattr >/dev/null || skip "setfattr is not installed"
+	mkdir attrs
+	echo "data" > attrs/file
+	setfattr --name=user.tukit --value=test attrs/file 2>/dev/null || skip "user xattrs are not supported"
+	oci_image "$(oci_layer attrs --xattrs --xattrs-include='user.*' .)"
+
+	run "${helper}" "oci:${oci_dir}" "${root}" "${record}"
+	[ "$status" -eq 0 ]
+	[ "$(getfattr --only-values --name=user.tukit "${root}/file")" = "test" ]
+}
+
+@test "layer: Entries outside of the root directory are rejected" {
+	mkdir -p escape
+	echo "outside" > outside
+	oci_image "$(oci_layer escape --absolute-names ../outside)"
+
+	run "${helper}" "oci:${oci_dir}" "${root}" "${record}"
+	[ "$status" -eq 1 ]
+	[[ "$output" == *"Invalid path '../outside'"* ]]
+	[ -z "$(ls -A "${root}")" ]
+}
+
+@test "layer: Absolute entries are rejected" {
+	mkdir -p escape
+	echo "outside" > outside
+	oci_image "$(oci_layer escape --absolute-names "${BATS_TEST_TMPDIR}/outside")"
+
+	run "${helper}" "oci:${oci_dir}" "${root}" "${record}"
+	[ "$status" -eq 1 ]
+	[[ "$output" == *"Invalid path '${BATS_TEST_TMPDIR}/outside'"* ]]
+	[ -z "$(ls -A "${root}")" ]
+}
@@ -0,0 +1,88 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Microbenchmark for MountList::getList: creates a synthetic mount table of
+  <mounts> tmpfs mounts plus 20 mounts below a "snapshot" directory in a
+  private mount namespace, then compares parsing mountinfo with walking the
+  mount tree via listmount() / statmount(). Has to be run as root; build it
+  with "make mountlist-bench".
+ */
+
+#include "Mount.hpp"
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <sched.h>
+#include <stdexcept>
+#include <stdlib.h>
+#include <string>
+#include <sys/mount.h>
+#include <vector>
+
+using namespace std;
+using namespace TransactionalUpdate;
+
+static void mountTmpfs(const filesystem::path& target) {
+    filesystem::create_directories(target);
+    if (mount("tmpfs", target.c_str(), "tmpfs", 0, "size=64k") < 0)
+        throw runtime_error{"Mounting " + target.native() + " failed: " + string(strerror(errno))};
+}
+
+// Average time of one call in microseconds
+static double measure(int iterations, const function<size_t()>& list, size_t& found) {
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++)
+        found = list();
+    auto duration = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+    return static_cast<double>(duration.count()) / iterations;
+}
+
+int main(int argc, char *argv[]) {
+    int mounts = argc > 1 ? stoi(argv[1]) : 1000;
+    int iterations = argc > 2 ? stoi(argv[2]) : 20;
+
+    try {
+        if (unshare(CLONE_NEWNS) < 0)
+            throw runtime_error{"Creating mount namespace failed: " + string(strerror(errno))};
+        if (mount("none", "/", NULL, MS_REC | MS_PRIVATE, NULL) < 0)
+            throw runtime_error{"Making / private failed: " + string(strerror(errno))};
+
+        char tmpl[] = "/tmp/mountlist-bench.XXXXXX";
+        if (mkdtemp(tmpl) == nullptr)
+            throw runtime_error{"Creating temporary directory failed: " + string(strerror(errno))};
+        filesystem::path base = tmpl;
+        mountTmpfs(base);
+        for (int i = 0; i < mounts; i++)
+            mountTmpfs(base / "other" / to_string(i));
+        filesystem::path snapshot = base / "snapshot";
+        mountTmpfs(snapshot);
+        for (int i = 0; i < 19; i++)
+            mountTmpfs(snapshot / "dir" / to_string(i));
+
+        for (const filesystem::path& below: {snapshot, filesystem::path{"/"}}) {
+            size_t mountinfoFound = 0, listmountFound = 0;
+            double mountinfo = measure(iterations, [&]() {
+                // A new table parses mountinfo again for each call
+                MountTable table;
+                table.getMountInfo();
+                return table.getList("/", below).size();
+            }, mountinfoFound);
+            double listmount = measure(iterations, [&]() {
+                return MountList::getList("/", below).size();
+            }, listmountFound);
+            cout << "N=" << mounts << ", below=" << below.native() << ": "
+                 << "mountinfo " << mountinfo << " us (" << mountinfoFound << " mounts), "
+                 << "getList " << listmount << " us (" << listmountFound << " mounts)" << endl;
+        }
+
+        umount2(base.c_str(), MNT_DETACH);
+        filesystem::remove(base);
+    } catch (const exception &e) {
+        cerr << "ERROR: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
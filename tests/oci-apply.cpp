@@ -0,0 +1,42 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Applies an OCI image to a directory the same way the podman snapshot
+  manager does for OCI_TARGET=oci:..., but without requiring a snapshot
+ */
+
+#include "Log.hpp"
+#include "OciImage.hpp"
+#include <filesystem>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace TransactionalUpdate;
+
+int main(int argc, char *argv[]) {
+    if (argc < 4) {
+        cerr << "Syntax: oci-apply <reference> <root> <record> [<kept path>...]" << endl;
+        return 1;
+    }
+    try {
+        tulog.setLogOutput("console");
+        OciImage image = OciImage::fromReference(argv[1]);
+        OciImage::Record applied = OciImage::readRecord(argv[3]);
+        vector<filesystem::path> keep(argv + 4, argv + argc);
+        vector<Sync::Change> changes;
+        bool incremental = image.apply(argv[2], applied.layers, keep, changes);
+        OciImage::writeRecord(argv[3], image.getRecord());
+        cout << (incremental ? "incremental" : "full") << "\n";
+        for (auto& change: changes)
+            cout << (change.created ? "+ /" : "c /") << change.path << "\n";
+        cout << flush;
+    } catch (const exception &e) {
+        cerr << "ERROR: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,53 @@
+# SPDX-License-Identifier: GPL-2.0-or-later
+# SPDX-FileCopyrightText: Copyright SUSE LLC
+
+# Helpers for building OCI image layouts for the tests; images are applied
+# to ${root} with oci-apply, which records the applied layers in ${record}.
+# The tests run in ${BATS_TEST_TMPDIR}.
+
+oci_setup() {
+	helper="${PWD}/oci-apply"
+	[ -x "${helper}" ] || skip "oci-apply is missing, use 'make check'"
+	cd "${BATS_TEST_TMPDIR}"
+	oci_dir="${BATS_TEST_TMPDIR}/layout"
+	root="${BATS_TEST_TMPDIR}/root"
+	record="${BATS_TEST_TMPDIR}/oci-layers"
+	mkdir -p "${oci_dir}/blobs/sha256" "${root}"
+	echo '{"imageLayoutVersion": "1.0.0"}' > "${oci_dir}/oci-layout"
+}
+
+# Adds the file to the layout and prints its descriptor
+oci_blob() {
+	local mediatype="$1" file="$2"
+	local digest="$(sha256sum "${file}" | cut -d ' ' -f 1)"
+	cp "${file}" "${oci_dir}/blobs/sha256/${digest}"
+	printf '{"mediaType": "%s", "digest": "sha256:%s", "size": %s}' \
+		"${mediatype}" "${digest}" "$(stat --format %s "${file}")"
+}
+
+# Prints the blob file of the given descriptor
+oci_blob_file() {
+	echo "${oci_dir}/blobs/sha256/$(grep --only-matching '[0-9a-f]\{64\}' <<< "$1")"
+}
+
+# Creates an uncompressed layer of the given directory's contents and prints
+# its descriptor; further arguments are passed to tar, "." by default
+oci_layer() {
+	local dir="$1"
+	shift
+	[ $# -gt 0 ] || set -- .
+	tar --create --format=pax --numeric-owner --sort=name --file "${BATS_TEST_TMPDIR}/layer.tar" --directory "${dir}" "$@"
+	oci_blob application/vnd.oci.image.layer.v1.tar "${BATS_TEST_TMPDIR}/layer.tar"
+}
+
+# Sets the layout's image to one with the given layer descriptors
+oci_image() {
+	local layers
+	layers="$(IFS=,; echo "$*")"
+	echo '{}' > "${BATS_TEST_TMPDIR}/config.json"
+	local config="$(oci_blob application/vnd.oci.image.config.v1+json "${BATS_TEST_TMPDIR}/config.json")"
+	printf '{"schemaVersion": 2, "mediaType": "application/vnd.oci.image.manifest.v1+json", "config": %s, "layers": [%s]}' \
+		"${config}" "${layers}" > "${BATS_TEST_TMPDIR}/manifest.json"
+	local manifest="$(oci_blob application/vnd.oci.image.manifest.v1+json "${BATS_TEST_TMPDIR}/manifest.json")"
+	printf '{"schemaVersion": 2, "manifests": [%s]}' "${manifest}" > "${oci_dir}/index.json"
+}
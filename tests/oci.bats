@@ -0,0 +1,118 @@
+# SPDX-License-Identifier: GPL-2.0-or-later
+# SPDX-FileCopyrightText: Copyright SUSE LLC
+
+load oci
+
+setup() {
+	oci_setup
+
+	mkdir -p base/usr/bin base/usr/lib
+	echo "a" > base/usr/bin/a
+	echo "x" > base/usr/lib/x
+	base="$(oci_layer base)"
+
+	mkdir -p update/usr/bin update/usr/lib
+	echo "b" > update/usr/bin/b
+	touch update/usr/lib/.wh.x
+	update="$(oci_layer update)"
+}
+
+@test "oci: Apply all layers of an image" {
+	oci_image "${base}" "${update}"
+	echo "stale" > "${root}/stale"
+
+	run "${helper}" "oci:${oci_dir}" "${root}" "${record}"
+	[ "$status" -eq 0 ]
+	[ "${lines[0]}" = "full" ]
+	[ "$(cat "${root}/usr/bin/a")" = "a" ]
+	[ "$(cat "${root}/usr/bin/b")" = "b" ]
+	[ ! -e "${root}/usr/lib/x" ]
+	[ ! -e "${root}/usr/lib/.wh.x" ]
+	[ ! -e "${root}/stale" ]
+	[ "$(grep --count '^layer ' "${record}")" -eq 2 ]
+}
+
+@test "oci: Only apply layers on top of the applied ones" {
+	oci_image "${base}"
+	"${helper}" "oci:${oci_dir}" "${root}" "${record}"
+	echo "local" > "${root}/usr/bin/local"
+
+	oci_image "${base}" "${update}"
+	run "${helper}" "oci:${oci_dir}" "${root}" "${record}"
+	[ "$status" -eq 0 ]
+	[ "${lines[0]}" = "incremental" ]
+	[[ "${lines[*]}" == *"c /usr/bin/b"* ]]
+	[[ "${lines[*]}" != *"/usr/bin/a"* ]]
+	[ "$(cat "${root}/usr/bin/local")" = "local" ]
+	[ "$(cat "${root}/usr/bin/b")" = "b" ]
+	[ ! -e "${root}/usr/lib/x" ]
+	[ "$(grep --count '^layer ' "${record}")" -eq 2 ]
+
+	run "${helper}" "oci:${oci_dir}" "${root}" "${record}"
+	[ "$status" -eq 0 ]
+	[ "${output}" = "incremental" ]
+}
+
+@test "oci: Rewrite everything if the bottom layers changed" {
+	oci_image "${base}"
+	"${helper}" "oci:${oci_dir}" "${root}" "${record}"
+	echo "local" > "${root}/usr/bin/local"
+
+	oci_image "${update}"
+	run "${helper}" "oci:${oci_dir}" "${root}" "${record}"
+	[ "$status" -eq 0 ]
+	[ "${lines[0]}" = "full" ]
+	[ ! -e "${root}/usr/bin/local" ]
+	[ ! -e "${root}/usr/bin/a" ]
+	[ "$(cat "${root}/usr/bin/b")" = "b" ]
+}
+
+@test "oci: Compressed layers" {
+	oci_layer update > /dev/null
+	gzip layer.tar
+	oci_image "${base}" "$(oci_blob application/vnd.oci.image.layer.v1.tar+gzip layer.tar.gz)"
+
+	run "${helper}" "oci:${oci_dir}" "${root}" "${record}"
+	[ "$status" -eq 0 ]
+	[ "$(cat "${root}/usr/bin/b")" = "b" ]
+	[ ! -e "${root}/usr/lib/x" ]
+}
+
+@test "oci: Kept paths and /etc merge" {
+	mkdir -p "${root}/etc" "${root}/var"
+	echo "local" > "${root}/etc/conf"
+	echo "data" > "${root}/var/data"
+	mkdir -p image/etc image/var
+	echo "image" > image/etc/conf
+	echo "new" > image/etc/new
+	echo "image" > image/var/image
+	oci_image "$(oci_layer image)"
+
+	run "${helper}" "oci:${oci_dir}" "${root}" "${record}" /etc /var
+	[ "$status" -eq 0 ]
+	[ "$(cat "${root}/etc/conf")" = "local" ]
+	[ "$(cat "${root}/etc/new")" = "new" ]
+	[ "$(cat "${root}/var/data")" = "data" ]
+	[ ! -e "${root}/var/image" ]
+}
+
+@test "oci: Corrupted layers are rejected" {
+	oci_image "${base}" "${update}"
+	echo "corrupted" >> "$(oci_blob_file "${update}")"
+
+	run "${helper}" "oci:${oci_dir}" "${root}" "${record}"
+	[ "$status" -eq 1 ]
+	[[ "$output" == *"is corrupted"* ]]
+	[ ! -e "${root}/usr/bin/b" ]
+	[ ! -e "${record}" ]
+}
+
+@test "oci: Corrupted manifests are rejected" {
+	oci_image "${base}"
+	local manifest="$(grep --only-matching 'sha256:[0-9a-f]*' "${oci_dir}/index.json")"
+	sed -i 's/"layers"/"layers" /' "$(oci_blob_file "${manifest}")"
+
+	run "${helper}" "oci:${oci_dir}" "${root}" "${record}"
+	[ "$status" -eq 1 ]
+	[[ "$output" == *"Blob ${manifest} is corrupted"* ]]
+}
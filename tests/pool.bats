@@ -0,0 +1,84 @@
+# SPDX-License-Identifier: GPL-2.0-or-later
+# SPDX-FileCopyrightText: Copyright SUSE LLC
+
+load btrfs
+
+setup() {
+	btrfs_setup
+	btrfs_run "${helper}" set-read-only 1 yes
+}
+
+teardown() {
+	btrfs_teardown
+}
+
+@test "pool: Refill creates entries without cleanup algorithm" {
+	run btrfs_run "${helper}" -o POOL_SIZE=2 pool-refill
+	[ "$status" -eq 0 ]
+	run btrfs_run "${helper}" pool
+	[ "$output" = $'2\t1\n3\t1' ]
+	run btrfs_run "${helper}" list number,cleanup,userdata
+	[ "${lines[2]}" = $'2\t\ttransactional-update-pool=1' ]
+	[ "${lines[3]}" = $'3\t\ttransactional-update-pool=1' ]
+}
+
+@test "pool: Refill ignores writable default snapshots" {
+	btrfs_run "${helper}" set-read-only 1 no
+
+	run btrfs_run "${helper}" -o POOL_SIZE=2 pool-refill
+	[ "$status" -eq 0 ]
+	run btrfs_run "${helper}" list number
+	[ "$output" = $'0\n1' ]
+}
+
+@test "pool: Claim an entry" {
+	btrfs_run "${helper}" -o POOL_SIZE=2 pool-refill
+
+	run btrfs_run "${helper}" pool-claim 1 "Claimed snapshot"
+	[ "$status" -eq 0 ]
+	[ "$output" = "2" ]
+	run btrfs_run "${helper}" list number,description,cleanup,userdata
+	[ "${lines[2]}" = $'2\tClaimed snapshot\tnumber\t' ]
+	run btrfs_run "${helper}" pool
+	[ "$output" = $'3\t1' ]
+
+	run btrfs_run "${helper}" pool-claim 2 "Claimed snapshot"
+	[ "$status" -eq 1 ]
+	[[ "$output" == *"Snapshot pool is empty"* ]]
+}
+
+@test "pool: Prune entries of an old default snapshot" {
+	btrfs_run "${helper}" -o POOL_SIZE=1 pool-refill
+	btrfs_run "${helper}" create 1 "New default snapshot"
+	btrfs_run "${helper}" set-read-only 3 yes
+	btrfs_run "${helper}" set-default 3
+
+	run btrfs_run "${helper}" -o POOL_SIZE=1 pool-refill
+	[ "$status" -eq 0 ]
+	run btrfs_run "${helper}" pool
+	[ "$output" = $'4\t3' ]
+	btrfs_ns test ! -e "${btrfs_dir}/top/.snapshots/2"
+}
+
+@test "pool: Entries can't be used for a rollback" {
+	btrfs_run "${helper}" -o POOL_SIZE=1 pool-refill
+
+	run btrfs_run "${helper}" -o POOL_SIZE=1 rollback 2
+	[ "$status" -eq 1 ]
+	[[ "$output" == *"Snapshot 2 is part of the snapshot pool"* ]]
+	run btrfs_run "${helper}" default
+	[ "$output" = "1" ]
+}
+
+@test "pool: Rollback refills the pool" {
+	btrfs_run "${helper}" create 1 "Test snapshot"
+	btrfs_run "${helper}" set-read-only 2 yes
+	btrfs_run "${helper}" -o POOL_SIZE=1 pool-refill
+
+	run btrfs_run "${helper}" -o POOL_SIZE=1 rollback 2
+	[ "$status" -eq 0 ]
+	[ "$output" = "2" ]
+	run btrfs_run "${helper}" pool
+	[ "$output" = $'4\t2' ]
+	btrfs_ns test ! -e "${btrfs_dir}/top/.snapshots/3"
+}
@@ -0,0 +1,115 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Calls the snapshot manager API directly for the tests in this directory;
+  see btrfs.bash for the environment it's meant to run in
+ */
+
+#include "Configuration.hpp"
+#include "Log.hpp"
+#include "Snapshot.hpp"
+#include "SnapshotManager.hpp"
+#include "SnapshotPool.hpp"
+#include "Transaction.hpp"
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace TransactionalUpdate;
+
+static void printTable(const SnapshotTable& table) {
+    for (size_t row = 0; row < table.rows(); row++) {
+        for (size_t column = 0; column < table.getColumns().size(); column++) {
+            cout << (column > 0 ? "\t" : "") << table.get(row, column);
+        }
+        cout << "\n";
+    }
+    cout << flush;
+}
+
+int main(int argc, char *argv[]) {
+    // Options overwriting tukit.conf settings, as with "tukit --option"
+    int pos = 1;
+    vector<string> options;
+    for (; pos + 1 < argc && string(argv[pos]) == "-o"; pos += 2)
+        options.push_back(argv[pos + 1]);
+    if (pos >= argc) {
+        cerr << "Syntax: snapshot-helper [-o <KEY>=<VALUE>...] <command> [<argument>...]" << endl;
+        return 1;
+    }
+    string command = argv[pos];
+    vector<string> args(argv + pos + 1, argv + argc);
+
+    try {
+        tulog.setLogOutput("console");
+        config.set("SNAPSHOT_MANAGER", "btrfs");
+        for (auto& option: options) {
+            size_t delim = option.find('=');
+            if (delim == string::npos)
+                throw invalid_argument{"Invalid option '" + option + "'"};
+            config.set(option.substr(0, delim), option.substr(delim + 1));
+        }
+        unique_ptr<SnapshotManager> snapshotMgr = SnapshotFactory::get();
+        if (command == "create" && args.size() == 2) {
+            unique_ptr<Snapshot> snapshot = snapshotMgr->create(args[0], args[1]);
+            snapshot->close();
+            cout << snapshot->getUid() << endl;
+        } else if (command == "list" && args.size() == 1) {
+            printTable(snapshotMgr->getList(args[0]));
+        } else if (command == "delete" && !args.empty()) {
+            snapshotMgr->deleteSnaps(args);
+        } else if (command == "current" && args.empty()) {
+            cout << snapshotMgr->getCurrent() << endl;
+        } else if (command == "default" && args.empty()) {
+            cout << snapshotMgr->getDefault() << endl;
+        } else if (command == "set-default" && args.size() == 1) {
+            snapshotMgr->open(args[0])->setDefault();
+        } else if (command == "set-read-only" && args.size() == 2) {
+            snapshotMgr->open(args[0])->setReadOnly(args[1] == "yes");
+        } else if (command == "rollback" && args.size() == 1) {
+            cout << snapshotMgr->rollbackTo(args[0]) << endl;
+        } else if (command == "pool" && args.empty()) {
+            for (auto& [id, base]: SnapshotPool{*snapshotMgr}.getEntries())
+                cout << id << "\t" << base << "\n";
+            cout << flush;
+        } else if (command == "pool-refill" && args.empty()) {
+            SnapshotPool{*snapshotMgr}.update(snapshotMgr->getDefault());
+        } else if (command == "pool-claim" && args.size() == 2) {
+            unique_ptr<Snapshot> snapshot = SnapshotPool{*snapshotMgr}.claim(args[0], args[1]);
+            if (!snapshot)
+                throw runtime_error{"Snapshot pool is empty"};
+            snapshot->close();
+            cout << snapshot->getUid() << endl;
+        } else if (command == "execute" && args.size() >= 2) {
+            // execute [--discard] <base> <command> [<argument>...]: runs the command in a
+            // new transaction and prints the snapshot id
+            bool discard = args[0] == "--discard";
+            if (discard && args.size() < 3)
+                throw invalid_argument{"Missing command for execute"};
+            Transaction transaction;
+            transaction.setDiscardIfUnchanged(discard);
+            transaction.init(args[discard ? 1 : 0]);
+            vector<char*> argv;
+            for (size_t i = discard ? 2 : 1; i < args.size(); i++)
+                argv.push_back(args[i].data());
+            argv.push_back(nullptr);
+            int status = transaction.execute(argv.data());
+            if (status != 0)
+                throw runtime_error{"Command failed with exit status " + to_string(status)};
+            string id = transaction.getSnapshot();
+            transaction.finalize();
+            cout << id << endl;
+        } else {
+            cerr << "Unknown command or wrong number of arguments: " << command << endl;
+            return 1;
+        }
+    } catch (const exception &e) {
+        cerr << "ERROR: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
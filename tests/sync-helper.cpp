@@ -0,0 +1,55 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Synchronizes a directory into another one with the Sync class as used for
+  podman images and /etc merges, printing the recorded changes
+ */
+
+#include "Log.hpp"
+#include "Sync.hpp"
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace TransactionalUpdate;
+
+int main(int argc, char *argv[]) {
+    int pos = 1;
+    try {
+        tulog.setLogOutput("console");
+        bool del = false, ignoreExisting = false;
+        vector<string> excludes;
+        for (; pos < argc && argv[pos][0] == '-'; pos++) {
+            string option = argv[pos];
+            if (option == "--delete")
+                del = true;
+            else if (option == "--ignore-existing")
+                ignoreExisting = true;
+            else if (option == "--exclude" && pos + 1 < argc)
+                excludes.push_back(argv[++pos]);
+            else
+                throw invalid_argument{"Unknown option " + option};
+        }
+        if (argc - pos != 2) {
+            cerr << "Syntax: sync-helper [--delete] [--ignore-existing] [--exclude <path>...] <source> <target>" << endl;
+            return 1;
+        }
+        Sync sync{argv[pos], argv[pos + 1]};
+        sync.setDelete(del);
+        sync.setIgnoreExisting(ignoreExisting);
+        for (auto& path: excludes)
+            sync.exclude(path);
+        sync.setRecordChanges(true);
+        sync.run();
+        for (auto& change: sync.getChanges())
+            cout << (change.created ? "+ /" : "c /") << change.path << "\n";
+        cout << flush;
+    } catch (const exception &e) {
+        cerr << "ERROR: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
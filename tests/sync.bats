@@ -0,0 +1,159 @@
+# SPDX-License-Identifier: GPL-2.0-or-later
+# SPDX-FileCopyrightText: Copyright SUSE LLC
+
+setup() {
+	helper="${PWD}/sync-helper"
+	[ -x "${helper}" ] || skip "sync-helper is missing, use 'make check'"
+	cd "${BATS_TEST_TMPDIR}"
+	mkdir source target
+}
+
+# Changes reported by the helper in a stable order
+sync_run() {
+	"${helper}" "$@" | sort
+}
+
+@test "sync: Copy a tree and make no changes on a second run" {
+	mkdir -p source/dir/sub
+	echo "data" > source/dir/sub/file
+	ln -s sub/file source/dir/symlink
+	chmod 0751 source/dir/sub/file
+	touch --date "2020-01-02 03:04:05" source/dir/sub/file
+
+	run sync_run source target
+	[ "$status" -eq 0 ]
+	[ "$output" = "+ /dir" ]
+	[ "$(cat target/dir/sub/file)" = "data" ]
+	[ "$(readlink target/dir/symlink)" = "sub/file" ]
+	[ "$(stat --format %a target/dir/sub/file)" = "751" ]
+	[ "$(stat --format %Y target/dir/sub/file)" = "$(stat --format %Y source/dir/sub/file)" ]
+
+	run sync_run --delete source target
+	[ "$status" -eq 0 ]
+	[ -z "$output" ]
+}
+
+@test "sync: Modified files are reported and updated" {
+	mkdir source/dir target/dir
+	echo "new" > source/dir/file
+	echo "old" > target/dir/file
+	# Same size, so only the modification time tells them apart
+	touch --date "2020-01-02 03:04:05" target/dir/file
+
+	run sync_run source target
+	[ "$status" -eq 0 ]
+	[ "$output" = "c /dir/file" ]
+	[ "$(cat target/dir/file)" = "new" ]
+}
+
+@test "sync: Hard links across directories" {
+	mkdir source/a source/b
+	echo "data" > source/a/file
+	ln source/a/file source/b/link
+
+	run sync_run source target
+	[ "$status" -eq 0 ]
+	[ "$(stat --format %i target/a/file)" = "$(stat --format %i target/b/link)" ]
+	[ "$(stat --format %h target/a/file)" -eq 2 ]
+
+	run sync_run source target
+	[ "$status" -eq 0 ]
+	[ -z "$output" ]
+}
+
+@test "sync: Extended attributes" {
+	command -v setfattr >/dev/null || skip "setfattr is not installed"
+	echo "data" > source/file
+	setfattr --name=user.tukit --value=test source/file 2>/dev/null || skip "user xattrs are not supported"
+	echo "data" > target/file
+	touch --reference=source/file target/file
+	setfattr --name=user.stale --value=old target/file
+
+	run sync_run source target
+	[ "$status" -eq 0 ]
+	[ "$output" = "c /file" ]
+	[ "$(getfattr --only-values --name=user.tukit target/file)" = "test" ]
+	run getfattr --only-values --name=user.stale target/file
+	[ "$status" -ne 0 ]
+}
+
+@test "sync: ACLs" {
+	command -v setfacl >/dev/null || skip "setfacl is not installed"
+	mkdir source/dir
+	setfacl --modify user:65534:r-x source/dir 2>/dev/null || skip "ACLs are not supported"
+	setfacl --default --modify user:65534:r-- source/dir
+
+	run sync_run source target
+	[ "$status" -eq 0 ]
+	[ "$(getfacl --omit-header --numeric target/dir)" = "$(getfacl --omit-header --numeric source/dir)" ]
+}
+
+@test "sync: setuid bit survives the change of owner" {
+	[ "$(id -u)" -eq 0 ] || skip "needs to be run as root"
+	echo "data" > source/file
+	chown 65534:65534 source/file
+	chmod 4755 source/file
+
+	run sync_run source target
+	[ "$status" -eq 0 ]
+	[ "$(stat --format %u:%g:%a target/file)" = "65534:65534:4755" ]
+}
+
+@test "sync: Type changes between symlinks and directories" {
+	ln -s elsewhere source/was-dir
+	mkdir source/was-link
+	echo "data" > source/was-link/file
+	mkdir -p target/was-dir/sub
+	touch target/was-dir/sub/file
+	ln -s somewhere target/was-link
+
+	run sync_run --delete source target
+	[ "$status" -eq 0 ]
+	[ "$(readlink target/was-dir)" = "elsewhere" ]
+	[ ! -L target/was-link ]
+	[ "$(cat target/was-link/file)" = "data" ]
+
+	run sync_run --delete source target
+	[ "$status" -eq 0 ]
+	[ -z "$output" ]
+}
+
+@test "sync: Excluded paths are neither copied nor deleted" {
+	mkdir -p source/dir source/sub/dir target/dir target/sub/dir
+	echo "new" > source/dir/excluded
+	echo "new" > source/sub/dir/excluded
+	echo "new" > source/fstab
+	echo "new" > source/sub/fstab
+	echo "old" > target/dir/excluded
+	echo "old" > target/sub/dir/excluded
+	touch --date "2020-01-02 03:04:05" target/dir/excluded target/sub/dir/excluded
+	echo "old" > target/extra
+	echo "old" > target/fstab
+	touch --date "2020-01-02 03:04:05" target/fstab
+	echo "old" > target/sub/only-in-target
+
+	run sync_run --delete --exclude dir/excluded --exclude fstab source target
+	[ "$status" -eq 0 ]
+	# Paths with a slash only match relative to the source directory
+	[ "$(cat target/dir/excluded)" = "old" ]
+	[ "$(cat target/sub/dir/excluded)" = "new" ]
+	# Names without a slash match at any depth, as with rsync
+	[ "$(cat target/fstab)" = "old" ]
+	[ ! -e target/sub/fstab ]
+	[ ! -e target/extra ]
+	[ ! -e target/sub/only-in-target ]
+}
+
+@test "sync: Existing files are kept with ignore existing" {
+	echo "new" > source/existing
+	echo "new" > source/missing
+	echo "old" > target/existing
+	touch --date "2020-01-02 03:04:05" target/existing
+
+	run sync_run --ignore-existing source target
+	[ "$status" -eq 0 ]
+	# Only new directories are reported as created
+	[ "$output" = "c /missing" ]
+	[ "$(cat target/existing)" = "old" ]
+	[ "$(cat target/missing)" = "new" ]
+}
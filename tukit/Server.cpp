@@ -0,0 +1,271 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Serves a resumed transaction on a unix socket
+ */
+
+#include "Server.hpp"
+#include "Log.hpp"
+#include <arpa/inet.h>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+
+static const size_t MAX_REQUEST_SIZE = 1024 * 1024;
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void requestStop(int signal) {
+    (void)signal;
+    stopRequested = 1;
+}
+
+// Returns false if the client is gone; it will notice on the next read
+static bool sendAll(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t rc = send(fd, data, len, MSG_NOSIGNAL);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc < 0)
+            return false;
+        data += rc;
+        len -= rc;
+    }
+    return true;
+}
+
+static bool sendMessage(int fd, char type, const char* data, size_t len) {
+    char header[5];
+    uint32_t netLen = htonl(len);
+    header[0] = type;
+    memcpy(header + 1, &netLen, sizeof(netLen));
+    return sendAll(fd, header, sizeof(header)) && sendAll(fd, data, len);
+}
+
+static void sendStatus(int fd, int status) {
+    uint32_t netStatus = htonl(static_cast<uint32_t>(status));
+    sendMessage(fd, 'S', reinterpret_cast<const char*>(&netStatus), sizeof(netStatus));
+}
+
+static void sendError(int fd, const string& message) {
+    sendMessage(fd, 'E', message.data(), message.length());
+}
+
+// Returns false if the connection was closed before the first byte
+static bool readAll(int fd, char* data, size_t len) {
+    for (size_t done = 0; done < len; ) {
+        ssize_t rc = read(fd, data + done, len - done);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc < 0)
+            throw runtime_error{"Reading request failed: " + string(strerror(errno))};
+        if (rc == 0) {
+            if (done == 0)
+                return false;
+            throw runtime_error{"Reading request failed: connection closed"};
+        }
+        done += rc;
+    }
+    return true;
+}
+
+TransactionServer::TransactionServer(TransactionalUpdate::Transaction& transaction, filesystem::path socket, unsigned int timeout)
+    : transaction{transaction}, socketPath{std::move(socket)}, timeout{timeout}
+{
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (socketPath.native().length() >= sizeof(addr.sun_path))
+        throw invalid_argument{"Socket path '" + socketPath.native() + "' is too long."};
+    strcpy(addr.sun_path, socketPath.c_str());
+
+    filesystem::create_directories(socketPath.parent_path());
+    if (unlink(socketPath.c_str()) < 0 && errno != ENOENT)
+        throw runtime_error{"Removing old socket '" + socketPath.native() + "' failed: " + string(strerror(errno))};
+    listenFd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenFd < 0)
+        throw runtime_error{"Creating socket failed: " + string(strerror(errno))};
+    // Only root may talk to the server
+    mode_t oldMask = umask(0077);
+    int rc = bind(listenFd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr));
+    umask(oldMask);
+    if (rc < 0 || listen(listenFd, 4) < 0) {
+        int err = errno;
+        close(listenFd);
+        listenFd = -1;
+        throw runtime_error{"Listening on '" + socketPath.native() + "' failed: " + string(strerror(err))};
+    }
+}
+
+TransactionServer::~TransactionServer() {
+    if (listenFd >= 0) {
+        close(listenFd);
+        unlink(socketPath.c_str());
+    }
+}
+
+// Returns false after the idle timeout or if the server should stop
+bool TransactionServer::waitForInput(int fd) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    for (;;) {
+        if (stopRequested)
+            return false;
+        int rc = poll(&pfd, 1, timeout ? static_cast<int>(timeout) * 1000 : -1);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc < 0)
+            throw runtime_error{"Waiting for requests failed: " + string(strerror(errno))};
+        return rc > 0;
+    }
+}
+
+void TransactionServer::run() {
+    struct sigaction action = {}, oldActions[3];
+    const int signals[] = {SIGTERM, SIGINT, SIGHUP};
+    action.sa_handler = requestStop;
+    sigemptyset(&action.sa_mask);
+    for (size_t i = 0; i < 3; i++)
+        sigaction(signals[i], &action, &oldActions[i]);
+    stopRequested = 0;
+
+    cout << "Socket: " << socketPath.native() << endl;
+    tulog.info("Serving transaction ", transaction.getSnapshot(), " on ", socketPath.native(), ".");
+
+    Result result = Result::Continue;
+    while (result == Result::Continue) {
+        if (!waitForInput(listenFd)) {
+            tulog.info(stopRequested ? "Stop requested" : "Idle timeout reached", ", keeping transaction.");
+            transaction.keep();
+            break;
+        }
+        int client = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            throw runtime_error{"Accepting connection failed: " + string(strerror(errno))};
+        }
+        try {
+            result = serveClient(client);
+        } catch (...) {
+            close(client);
+            for (size_t i = 0; i < 3; i++)
+                sigaction(signals[i], &oldActions[i], nullptr);
+            throw;
+        }
+        close(client);
+    }
+
+    for (size_t i = 0; i < 3; i++)
+        sigaction(signals[i], &oldActions[i], nullptr);
+}
+
+TransactionServer::Result TransactionServer::serveClient(int client) {
+    for (;;) {
+        if (!waitForInput(client)) {
+            tulog.info(stopRequested ? "Stop requested" : "Idle timeout reached", ", keeping transaction.");
+            transaction.keep();
+            return Result::Exit;
+        }
+        string payload;
+        char header[5];
+        uint32_t len;
+        try {
+            if (!readAll(client, header, sizeof(header)))
+                return Result::Continue;
+            memcpy(&len, header + 1, sizeof(len));
+            len = ntohl(len);
+            if (len > MAX_REQUEST_SIZE) {
+                sendError(client, "Request too large.");
+                return Result::Continue;
+            }
+            payload.resize(len);
+            if (!readAll(client, payload.data(), len))
+                throw runtime_error{"Reading request failed: connection closed"};
+        } catch (const exception& e) {
+            // The client is gone, wait for the next one
+            tulog.error(e.what());
+            return Result::Continue;
+        }
+        Result result = handleRequest(client, header[0], payload);
+        if (result != Result::Continue)
+            return result;
+    }
+}
+
+TransactionServer::Result TransactionServer::handleRequest(int client, char type, string& payload) {
+    switch (type) {
+    case 'X':
+    case 'C':
+    {
+        vector<string> args;
+        for (size_t pos = 0; pos < payload.length(); ) {
+            size_t end = payload.find('\0', pos);
+            if (end == string::npos)
+                break;
+            args.push_back(payload.substr(pos, end - pos));
+            pos = end + 1;
+        }
+        if (args.empty() || payload.back() != '\0') {
+            sendError(client, "Invalid command.");
+            return Result::Continue;
+        }
+        int status;
+        try {
+            status = runCommand(client, std::move(args), type == 'C');
+        } catch (const exception& e) {
+            tulog.error("Request failed: ", e.what());
+            sendError(client, e.what());
+            return Result::Continue;
+        }
+        sendStatus(client, status);
+        return Result::Continue;
+    }
+    case 'K':
+    case 'F':
+    case 'A':
+    {
+        int status = 0;
+        try {
+            if (type == 'K')
+                transaction.keep();
+            else if (type == 'F')
+                transaction.finalize();
+            else if (!transaction.abort())
+                status = 1;
+        } catch (const exception& e) {
+            sendError(client, e.what());
+            throw;
+        }
+        sendStatus(client, status);
+        return Result::Exit;
+    }
+    default:
+        sendError(client, "Unknown request type '" + string(1, type) + "'.");
+        return Result::Continue;
+    }
+}
+
+// The command's stdout and stderr are forwarded to the client while it is running
+int TransactionServer::runCommand(int client, vector<string> args, bool external) {
+    vector<char*> argv;
+    for (auto& arg: args)
+        argv.push_back(arg.data());
+    argv.push_back(nullptr);
+
+    bool connected = true;
+    // Keep consuming the output even if the client is gone, the command would block otherwise
+    auto forward = [client, &connected](const char* data, size_t len) {
+        if (connected)
+            connected = sendMessage(client, 'O', data, len);
+    };
+    return external ? transaction.callExt(argv.data(), forward) : transaction.execute(argv.data(), forward);
+}
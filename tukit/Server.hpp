@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* SPDX-FileCopyrightText: Copyright SUSE LLC */
+
+/*
+  Serves a resumed transaction on a unix socket ("tukit serve"), so a series
+  of commands can be executed without setting up the environment each time.
+
+  Every message starts with a one byte type and the length of the payload as
+  a 32 bit unsigned integer in network byte order.
+  Requests:
+    'X' execute, 'C' callext: the command's arguments, each terminated by '\0'
+    'K' keep, 'F' finalize, 'A' abort: no payload; the server exits afterwards
+  Responses:
+    'O' output of the command (stdout and stderr)
+    'S' exit status as 32 bit signed integer in network byte order
+    'E' error message
+  Each request is answered with any number of 'O' messages followed by either
+  'S' or 'E'. For 'K' and 'F' the status is 0; for 'A' it is 0 if the snapshot
+  was deleted and 1 if it was kept because of --keep.
+ */
+
+#ifndef T_U_SERVER_H
+#define T_U_SERVER_H
+
+#include "Transaction.hpp"
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+class TransactionServer {
+public:
+    // timeout is the idle time in seconds after which the transaction is kept
+    // and the server exits; 0 disables it
+    TransactionServer(TransactionalUpdate::Transaction& transaction, std::filesystem::path socket, unsigned int timeout);
+    ~TransactionServer();
+    // Returns after a keep, finalize or abort request, the idle timeout or
+    // SIGTERM / SIGINT / SIGHUP
+    void run();
+private:
+    enum class Result { Continue, Exit };
+    TransactionalUpdate::Transaction& transaction;
+    std::filesystem::path socketPath;
+    unsigned int timeout;
+    int listenFd = -1;
+    bool waitForInput(int fd);
+    Result serveClient(int client);
+    Result handleRequest(int client, char type, std::string& payload);
+    int runCommand(int client, std::vector<std::string> args, bool external);
+};
+
+#endif // T_U_SERVER_H
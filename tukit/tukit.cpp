@@ -6,8 +6,11 @@
  */
 
 #include "tukit.hpp"
+#include "Server.hpp"
+#include "ChangeManifest.hpp"
 #include "Configuration.hpp"
 #include "SnapshotManager.hpp"
+#include "SnapshotPool.hpp"
 #include "Transaction.hpp"
 #include "Reboot.hpp"
 #include "Log.hpp"
@@ -16,13 +19,83 @@
 #include <unistd.h>
 #include <csignal>
 #include <cstring>
+#include <fstream>
 #include <iostream>
+#include <vector>
 
 using namespace std;
 using TransactionalUpdate::config;
 
 bool cancel;
 
+// Splits a line into arguments, honoring single and double quotes and backslash escapes
+static vector<string> splitBatchLine(const string& line, size_t lineNo) {
+    vector<string> args;
+    string arg;
+    bool inArg = false;
+    char quote = 0;
+    for (size_t i = 0; i < line.length(); i++) {
+        char c = line[i];
+        if (quote == '\'') {
+            if (c == '\'')
+                quote = 0;
+            else
+                arg += c;
+        } else if (c == '\\' && i + 1 < line.length() && (quote == 0 || strchr("\"\\$`", line[i + 1]))) {
+            arg += line[++i];
+            inArg = true;
+        } else if (quote == '"') {
+            if (c == '"')
+                quote = 0;
+            else
+                arg += c;
+        } else if (c == '\'' || c == '"') {
+            quote = c;
+            inArg = true;
+        } else if (c == ' ' || c == '\t') {
+            if (inArg)
+                args.push_back(arg);
+            arg.clear();
+            inArg = false;
+        } else {
+            arg += c;
+            inArg = true;
+        }
+    }
+    if (quote != 0)
+        throw invalid_argument{"Unterminated quote in line " + to_string(lineNo) + " of batch."};
+    if (inArg)
+        args.push_back(arg);
+    return args;
+}
+
+static vector<TransactionalUpdate::Transaction::BatchStep> readBatch(istream& input) {
+    vector<TransactionalUpdate::Transaction::BatchStep> steps;
+    string line;
+    for (size_t lineNo = 1; getline(input, line); lineNo++) {
+        vector<string> args = splitBatchLine(line, lineNo);
+        if (args.empty() || args[0][0] == '#')
+            continue;
+        TransactionalUpdate::Transaction::BatchStep step;
+        string command = args[0];
+        if (command[0] == '-') {
+            step.stopOnError = false;
+            command.erase(0, 1);
+        }
+        if (command == "callext")
+            step.external = true;
+        else if (command != "call")
+            throw invalid_argument{"Unknown command '" + command + "' in line " + to_string(lineNo) + " of batch."};
+        if (args.size() < 2)
+            throw invalid_argument{"Missing command in line " + to_string(lineNo) + " of batch."};
+        step.argv.assign(args.begin() + 1, args.end());
+        steps.push_back(std::move(step));
+    }
+    if (input.bad())
+        throw runtime_error{"Reading batch failed."};
+    return steps;
+}
+
 void TUKit::displayHelp() {
     cout << "Syntax: tukit [option...] command\n";
     cout << "\n";
@@ -45,6 +118,17 @@ void TUKit::displayHelp() {
     cout << "\tenvironment, but instead runs in the current system, replacing '{}' with the\n";
     cout << "\tmount directory of the given snapshot; returns the exit status of the given\n";
     cout << "\tcommand, but will not delete the snapshot in case of errors\n";
+    cout << "batch <ID> [<file>]\n";
+    cout << "\tExecutes the commands listed in the given file (or stdin) one after another,\n";
+    cout << "\tresuming the transaction with the given ID only once. Each line consists of\n";
+    cout << "\t'call' or 'callext' and the command, split into arguments like a shell would\n";
+    cout << "\t(without any expansion); prefixed with '-' a failing command doesn't stop the\n";
+    cout << "\tbatch. Returns the exit status of the command stopping the batch, if any\n";
+    cout << "serve <ID> [<socket>]\n";
+    cout << "\tResumes the transaction with the given ID once and executes commands sent to\n";
+    cout << "\tthe unix socket (default: /run/tukit/<ID>.sock) until the transaction is\n";
+    cout << "\tkept, closed or aborted by a client, or no requests arrived for\n";
+    cout << "\tSERVE_TIMEOUT seconds; see Server.hpp for the protocol\n";
     cout << "close <ID>\n";
     cout << "\tCloses the given transaction and sets the snapshot as the new default snapshot\n";
     cout << "abort <ID>\n";
@@ -57,14 +141,26 @@ void TUKit::displayHelp() {
     cout << "--description=<description>  Use custom snapshot description for \"open\"\n";
     cout << "--keep, -k                   Keep snapshot even if there is an error\n";
     cout << "--discard, -d                Discard snapshot if no files were changed in root\n";
+    cout << "--pin, -p                    Keep the environment of \"open\" mounted for further\n";
+    cout << "                             \"call\"s until the transaction is closed or aborted;\n";
+    cout << "                             the contents of /run and /tmp are kept between calls\n";
     cout << "\n";
     cout << "Snapshot Commands:\n";
     cout << "snapshots\n";
     cout << "\tPrints a list of all available transactions\n";
+    cout << "diff <ID>\n";
+    cout << "\tPrints the files created (+), changed (c) or deleted (-) in snapshot\n";
+    cout << "\t<ID> compared to the snapshot it was created from\n";
+    cout << "pool [refill]\n";
+    cout << "\tPrints the snapshot pool entries and their base snapshot; with\n";
+    cout << "\t\"refill\" outdated entries are removed and the pool is filled up\n";
+    cout << "\tto POOL_SIZE snapshots of the default snapshot\n";
     cout << "\n";
     cout << "Snapshot Options:\n"; //TODO: Migrate to options of command
     cout << "--fields=<default,active,number,date,description>, -f<...>\n";
-    cout << "                             List of fields to print\n";
+    cout << "                             List of fields to print; the fields referenced,\n";
+    cout << "                             exclusive and changed show the space used by the\n";
+    cout << "                             snapshots in bytes\n";
     cout << "\n";
     cout << "Reboot Commands:\n";
     cout << "reboot [auto|rebootmgr|notify|systemd|kured|kexec|none]\n";
@@ -80,18 +176,19 @@ void TUKit::displayHelp() {
     cout << "--version, -V                Display version and exit\n";
     cout << "\n";
     cout << "Important options (for use with -o=):\n";
-    cout << "SNAPSHOT_MANAGER=<MANAGER>   Force snapshot manager, e.g. podman or snapper\n";
+    cout << "SNAPSHOT_MANAGER=<MANAGER>   Force snapshot manager, e.g. podman, snapper or btrfs\n";
     cout << "OCI_TARGET=<SOURCE>          Pull a custom image for updating with Podman\n";
     cout << endl;
 }
 
 int TUKit::parseOptions(int argc, char *argv[]) {
-    static const char optstring[] = "+c::dkf:hl:o:qvV";
+    static const char optstring[] = "+c::dkpf:hl:o:qvV";
     static const struct option longopts[] = {
         { "continue", optional_argument, nullptr, 'c' },
         { "description", required_argument, nullptr, 0 },
         { "keep", no_argument, nullptr, 'k' },
         { "discard", no_argument, nullptr, 'd' },
+        { "pin", no_argument, nullptr, 'p' },
         { "fields", required_argument, nullptr, 'f' },
         { "help", no_argument, nullptr, 'h' },
         { "log", required_argument, nullptr, 'l' },
@@ -122,6 +219,9 @@ int TUKit::parseOptions(int argc, char *argv[]) {
         case 'd':
             discardSnapshot = true;
             break;
+        case 'p':
+            pinNamespace = true;
+            break;
         case 'f':
             fields = optarg;
             break;
@@ -186,6 +286,9 @@ int TUKit::processCommand(char *argv[]) {
         if (discardSnapshot) {
             transaction.setDiscardIfUnchanged(true);
         }
+        if (pinNamespace) {
+            transaction.setPinNamespace(true);
+        }
         transaction.init(baseSnapshot, description);
         cout << "ID: " << transaction.getSnapshot() << endl;
         transaction.keep();
@@ -219,6 +322,54 @@ int TUKit::processCommand(char *argv[]) {
         transaction.keep();
         return status;
     }
+    else if (arg == "batch") {
+        if (argv[1] == nullptr) {
+            displayHelp();
+            throw invalid_argument{"Missing argument for 'batch'"};
+        }
+        vector<TransactionalUpdate::Transaction::BatchStep> steps;
+        if (argv[2] != nullptr && string(argv[2]) != "-") {
+            ifstream input{argv[2]};
+            if (!input)
+                throw runtime_error{"Could not open batch file '" + string(argv[2]) + "': " + strerror(errno)};
+            steps = readBatch(input);
+        } else {
+            steps = readBatch(cin);
+        }
+        TransactionalUpdate::Transaction transaction{};
+        if (keepSnapshot) {
+            transaction.setKeepIfError(true);
+        }
+        transaction.resume(argv[1]);
+        vector<int> results = transaction.executeBatch(steps);
+        transaction.keep();
+        for (size_t i = 0; i < results.size(); i++) {
+            if (results[i] != 0 && steps[i].stopOnError)
+                return results[i];
+        }
+        return 0;
+    }
+    else if (arg == "serve") {
+        if (argv[1] == nullptr) {
+            displayHelp();
+            throw invalid_argument{"Missing argument for 'serve'"};
+        }
+        unsigned int timeout;
+        try {
+            timeout = stoul(config.get("SERVE_TIMEOUT"));
+        } catch (const logic_error&) {
+            throw invalid_argument{"Invalid value '" + config.get("SERVE_TIMEOUT") + "' for SERVE_TIMEOUT."};
+        }
+        string socket = argv[2] ? argv[2] : "/run/tukit/" + string(argv[1]) + ".sock";
+        TransactionalUpdate::Transaction transaction{};
+        if (keepSnapshot) {
+            transaction.setKeepIfError(true);
+        }
+        transaction.resume(argv[1]);
+        TransactionServer server{transaction, socket, timeout};
+        server.run();
+        return 0;
+    }
     else if (arg == "close") {
         if (argv[1] == nullptr) {
             displayHelp();
@@ -254,18 +405,47 @@ int TUKit::processCommand(char *argv[]) {
         cout << "ID: " << id << endl;
         return 0;
     }
+    else if (arg == "pool") {
+        unique_ptr<TransactionalUpdate::SnapshotManager> snapshotMgr = TransactionalUpdate::SnapshotFactory::get();
+        TransactionalUpdate::SnapshotPool pool{*snapshotMgr};
+        if (argv[1] != nullptr) {
+            if (string(argv[1]) != "refill") {
+                displayHelp();
+                throw invalid_argument{"Unknown argument '" + string(argv[1]) + "' for 'pool'"};
+            }
+            pool.update(snapshotMgr->getDefault());
+        }
+        for (auto& [id, base]: pool.getEntries()) {
+            cout << id << "\t" << base << "\n";
+        }
+        cout << flush;
+        return 0;
+    }
     else if (arg == "snapshots") {
         unique_ptr<TransactionalUpdate::SnapshotManager> snapshotMgr = TransactionalUpdate::SnapshotFactory::get();
         if (fields.empty()) {
             fields = "number";
         }
-        for(auto value: snapshotMgr->getList(fields)) {
-            stringstream fieldsStream(fields);
-            for (string field; getline(fieldsStream, field, ','); ) {
-                cout << value[field] << "\t";
+        TransactionalUpdate::SnapshotTable list = snapshotMgr->getList(fields);
+        for (size_t row = 0; row < list.rows(); row++) {
+            for (size_t column = 0; column < list.getColumns().size(); column++) {
+                cout << list.get(row, column) << "\t";
             }
-            cout << endl;
+            cout << "\n";
+        }
+        cout << flush;
+        return 0;
+    }
+    else if (arg == "diff") {
+        if (argv[1] == nullptr) {
+            displayHelp();
+            throw invalid_argument{"Missing argument for 'diff'"};
+        }
+        TransactionalUpdate::ChangeManifest manifest = TransactionalUpdate::ChangeManifest::forSnapshot(argv[1]);
+        for (auto& entry: manifest.getEntries()) {
+            cout << static_cast<char>(entry.change) << "\t" << entry.path << "\n";
         }
+        cout << flush;
         return 0;
     }
     else if (arg == "reboot") {
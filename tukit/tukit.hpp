@@ -23,6 +23,7 @@ private:
     std::string baseSnapshot = "active";
     bool keepSnapshot = false;
     bool discardSnapshot = false;
+    bool pinNamespace = false;
     std::string fields;
     std::optional<std::string> description = std::nullopt;
 };